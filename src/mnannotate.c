@@ -18,12 +18,19 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include "mnannotate.h"
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mnannotate_priv.h"
 
 
 #define d_printf(fmt, args...)    if (debug) fprintf(stderr, fmt, ## args)
 
-static int debug = 1;
 
 static int
 annotation_get_op(json_object *obj, int *op) 
@@ -36,6 +43,9 @@ annotation_get_op(json_object *obj, int *op)
 static int
 annotation_get_point(json_object *obj, Point *p) 
 {
+    if (!json_object_is_type(obj, json_type_object))
+	return -1;
+
     json_object_object_foreach(obj, key, val) {
 	switch (key[0]) {
 	    case 'x':
@@ -55,14 +65,18 @@ annotation_get_point(json_object *obj, Point *p)
 }
 
 static int
-annotation_get_roi(json_object *obj, Annotation *a) 
+annotation_get_roi(json_object *obj, Annotation *a, AnnotationArena *arena) 
 {
     json_object *item;
     int i, count;
     Point *p;
 
+    if (!json_object_is_type(obj, json_type_array))
+	return -1;
+
     count = json_object_array_length(obj);
-    a->roi = (Point *)malloc(count*sizeof(Point));
+    arena_free(arena, a->roi);
+    a->roi = (Point *)arena_alloc(arena, count*sizeof(Point));
     if (a->roi == NULL)
 	return -1;
 
@@ -81,6 +95,9 @@ annotation_get_phi(json_object *obj, double *phi)
     json_object *item;
     int i, count;
 
+    if (!json_object_is_type(obj, json_type_array))
+	return -1;
+
     count = json_object_array_length(obj);
 
     if (count > 3)
@@ -99,6 +116,9 @@ annotation_get_argb(json_object *obj, int *argb)
     json_object *item;
     int i, count;
 
+    if (!json_object_is_type(obj, json_type_array))
+	return -1;
+
     count = json_object_array_length(obj);
 
     if (count > 4)
@@ -117,6 +137,9 @@ annotation_get_fill(json_object *obj, int *fill)
     json_object *item;
     int i, count;
 
+    if (!json_object_is_type(obj, json_type_array))
+	return -1;
+
     count = json_object_array_length(obj);
 
     if (count > 4)
@@ -153,9 +176,21 @@ annotation_get_label(json_object *obj, char **label)
     return 0;
 }
 
-
 static int
-parse_annotation(json_object *obj, Annotation *annotation)
+annotation_get_quality(json_object *obj, int *quality) 
+{
+    *quality = json_object_get_int(obj);
+    
+    return 0;
+}
+
+
+/*
+ * Parse an annotation object, the ROI and grid are allocated from the arena
+ * or the heap without one. The label belongs to the JSON object.
+ */
+int
+parse_annotation(json_object *obj, Annotation *annotation, AnnotationArena *arena)
 {
     int op_seen = 0;
 
@@ -163,6 +198,9 @@ parse_annotation(json_object *obj, Annotation *annotation)
 	return -1;
 
     memset(annotation, 0, sizeof(Annotation));
+    if (!json_object_is_type(obj, json_type_object))
+	return -1;
+
     json_object_object_foreach(obj, key, val) {
 	switch (key[0]) {
 	    case 'a':
@@ -173,10 +211,18 @@ parse_annotation(json_object *obj, Annotation *annotation)
 		annotation_get_bold(val, &annotation->bold);
 		break;
 
+	    case 'c':
+		annotation_get_colormap(val, &annotation->colormap);
+		break;
+
 	    case 'f':
 		annotation_get_fill(val, annotation->fill);
 		break;
 
+	    case 'g':
+		annotation_get_grid(val, annotation, arena);
+		break;
+
 	    case 'l':
 		annotation_get_label(val, &annotation->label);
 		break;
@@ -193,8 +239,12 @@ parse_annotation(json_object *obj, Annotation *annotation)
 		annotation_get_phi(val, annotation->phi);
 		break;
 
+	    case 'q':
+		annotation_get_quality(val, &annotation->quality);
+		break;
+
 	    case 'r':
-		annotation_get_roi(val, annotation);
+		annotation_get_roi(val, annotation, arena);
 		break;
 
 	    case 's':
@@ -210,751 +260,1378 @@ parse_annotation(json_object *obj, Annotation *annotation)
 }
 
 
-CvMat *
-LoadImageFile(const char *filename, int width, int height, int pixel_format)
+/*
+ * Size in bytes of a raw image, 0 for encoded image formats
+ */
+size_t
+ImageBufferSize(int width, int height, int pixel_format)
 {
-    FILE *file;
-    CvMat *src_mat, *dst_mat;
-    int n;
-
-    if (pixel_format != PIXEL_FORMAT_IYUV &&
-	pixel_format != PIXEL_FORMAT_UYVY &&
-	pixel_format != PIXEL_FORMAT_NV12)
-	return cvLoadImageM(filename, CV_LOAD_IMAGE_COLOR);
-
-    file = fopen(filename , "r");
-    if (!file) {
-	printf("Error: failed to open image file %s\n", filename);
-	return NULL;
-    }
-
     switch (pixel_format) {
 	case PIXEL_FORMAT_IYUV:
-	    src_mat = cvCreateMat(height+height/2, width, CV_8UC1);
-	    if (!src_mat)
-		return NULL;
-	    dst_mat = cvCreateMat(height, width, CV_8UC3); 
-	    if (!dst_mat) {
-		cvReleaseMat(&src_mat);
-		return NULL;
-	    }
-	    n = fread(src_mat->data.ptr, 1, width*(height+height/2), file);
-	    if (n != width*(height+height/2)) {
-		cvReleaseMat(&src_mat);
-		cvReleaseMat(&dst_mat);
-		return NULL;
-	    }
-	    cvCvtColor(src_mat, dst_mat, CV_YUV2BGR_IYUV);
-	    cvReleaseMat(&src_mat);
-	    return dst_mat;
+	case PIXEL_FORMAT_NV12:
+	    return (size_t)width*(height+height/2);
 
 	case PIXEL_FORMAT_UYVY:
-	    src_mat = cvCreateMat(height, width, CV_8UC2);
-	    if (!src_mat)
-		return NULL;
-	    dst_mat = cvCreateMat(height, width, CV_8UC3); 
-	    if (!dst_mat) {
-		cvReleaseMat(&src_mat);
-		return NULL;
-	    }
-	    n = fread(src_mat->data.ptr, 1, width*height*2, file);
-	    if (n != width*height*2) {
-		cvReleaseMat(&src_mat);
-		cvReleaseMat(&dst_mat);
-		return NULL;
-	    }
-	    cvCvtColor(src_mat, dst_mat, CV_YUV2BGR_UYVY);
-	    cvReleaseMat(&src_mat);
-	    return dst_mat;
-
-	case PIXEL_FORMAT_NV12:
-	    src_mat = cvCreateMat(height+height/2, width, CV_8UC1);
-	    if (!src_mat)
-		return NULL;
-	    dst_mat = cvCreateMat(height, width, CV_8UC3); 
-	    if (!dst_mat) {
-		cvReleaseMat(&src_mat);
-		return NULL;
-	    }
-	    n = fread(src_mat->data.ptr, 1, width*(height+height/2), file);
-	    if (n != width*(height+height/2)) {
-		cvReleaseMat(&src_mat);
-		cvReleaseMat(&dst_mat);
-		return NULL;
-	    }
-	    cvCvtColor(src_mat, dst_mat, CV_YUV2BGR_NV12);
-	    cvReleaseMat(&src_mat);
-	    return dst_mat;
+	    return (size_t)width*height*2;
 
-	case PIXEL_FORMAT_NONE:
 	default:
 	    break;
     }
 
-    return NULL;
+    return 0;
 }
 
 
-CvMat *
-LoadImageBuffer(unsigned char *buffer, int width, int height, int pixel_format)
+/*
+ * Convert a raw IYUV, UYVY or NV12 image into a caller-owned BGR image of
+ * the same size, without any allocation
+ */
+int
+LoadImageBufferInto(CvMat *dst, const unsigned char *buffer, int width, int height, int pixel_format)
 {
-    CvMat src_mat, *dst_mat;
+    CvMat src_mat;
 
+    if (!dst || !buffer)
+	return -1;
 
-    if (!buffer)
-	return NULL;
-
-    if (pixel_format != PIXEL_FORMAT_IYUV &&
-	pixel_format != PIXEL_FORMAT_UYVY &&
-	pixel_format != PIXEL_FORMAT_NV12) {
-	src_mat = cvMat(height, width, CV_32FC3, (void *)buffer);
-	return cvDecodeImageM(&src_mat, CV_LOAD_IMAGE_COLOR);
+    if (dst->cols != width || dst->rows != height || CV_MAT_TYPE(dst->type) != CV_8UC3) {
+	fprintf(stderr, "Error: Destination image is not a %dx%d BGR image\n", width, height);
+	return -1;
     }
 
-    dst_mat = cvCreateMat(height, width, CV_8UC3); 
-    if (!dst_mat)
-	return NULL;
-
     switch (pixel_format) {
 	case PIXEL_FORMAT_IYUV:
 	    src_mat = cvMat(height+height/2, width, CV_8UC1, (void *)buffer);
-	    cvCvtColor(&src_mat, dst_mat, CV_YUV2BGR_IYUV);
-	    return dst_mat;
+	    cvCvtColor(&src_mat, dst, CV_YUV2BGR_IYUV);
+	    return 0;
 
 	case PIXEL_FORMAT_UYVY:
 	    src_mat = cvMat(height, width, CV_8UC2, (void *)buffer);
-	    cvCvtColor(&src_mat, dst_mat, CV_YUV2BGR_UYVY);
-	    return dst_mat;
+	    cvCvtColor(&src_mat, dst, CV_YUV2BGR_UYVY);
+	    return 0;
 
 	case PIXEL_FORMAT_NV12:
 	    src_mat = cvMat(height+height/2, width, CV_8UC1, (void *)buffer);
-	    cvCvtColor(&src_mat, dst_mat, CV_YUV2BGR_NV12);
-	    return dst_mat;
+	    cvCvtColor(&src_mat, dst, CV_YUV2BGR_NV12);
+	    return 0;
 
 	case PIXEL_FORMAT_NONE:
 	default:
 	    break;
     }
 
-    if (dst_mat)
-	cvReleaseMat(&dst_mat);
-
-    return NULL;
+    return -1;
 }
 
 
-static int
-DrawText(CvMat *mat, Annotation *a)
+/*
+ * Read a raw image file into a reusable staging buffer of at least
+ * ImageBufferSize() bytes and convert it into a caller-owned BGR image
+ */
+int
+LoadImageFileInto(CvMat *dst, const char *filename, int width, int height, int pixel_format,
+		  unsigned char *staging, size_t staging_size)
 {
-    double alpha = 0;
-    CvRect roi;
-    CvFont font;
-    CvMat src_mat, *dst_mat;
-    int base_line = 0;
-    CvSize text_size;
+    size_t size, done = 0;
+    ssize_t n;
+    int fd;
 
+    size = ImageBufferSize(width, height, pixel_format);
+    if (!size || !staging || staging_size < size)
+	return -1;
 
-    cvInitFont(&font, CV_FONT_HERSHEY_PLAIN, a->scale, a->scale, 0, a->bold, CV_AA);
-    cvGetTextSize(a->label, &font, &text_size, &base_line);
-
-    /*
-     * Draw it on src image directly if there is no alpha blend or background color applied
-     */
-    if (a->argb[0] == 255 && a->fill[0] == 0) {
-	cvPutText(mat, a->label, cvPoint(a->roi[0].x, a->roi[0].y + text_size.height + base_line), &font,
-		  CV_RGB(a->argb[1], a->argb[2], a->argb[3]));
-	return 0;
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+	printf("Error: failed to open image file %s\n", filename);
+	return -1;
     }
 
-    /*
-     * Get dimension of the ROI
-     */
-    roi.x = a->roi[0].x;
-    roi.y = a->roi[0].y;
-    roi.width = text_size.width;
-    roi.height = text_size.height + 2*base_line;
-    if (roi.x + roi.width > mat->cols)
-	roi.width -= roi.x +roi.width - mat->cols;
-    if (roi.y + roi.height > mat->rows)
-	roi.width -= roi.y +roi.height - mat->rows;
-
-    /*
-     * Create source image
-     */
-    cvGetSubRect(mat, &src_mat, roi);
-
-#if 0
-    printf("##### subrect width = %d, subrec height = %d\n", src_mat.cols, src_mat.rows);
-    cvShowImage("src", &src_mat);
-    cvWaitKey(0);
-#endif
-
-    /*
-     * Create target image
-     */
-    dst_mat = cvCloneMat(&src_mat);
-    if (a->fill[0]) {
-	/*
-	 * Alpha belend background first
-	 */
-	cvSet(dst_mat, CV_RGB(a->fill[1], a->fill[2], a->fill[3]), NULL);
-	alpha = (double)a->fill[0] / 255;
-	cvAddWeighted(&src_mat, 1 - alpha, dst_mat, alpha, 0.0, &src_mat);
+    while (done < size) {
+	n = read(fd, staging + done, size - done);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    break;
+	done += n;
     }
+    close(fd);
 
-#if 0
-    cvShowImage("src_bg", &src_mat);
-    cvWaitKey(0);
-#endif
+    if (done != size)
+	return -1;
 
-    /*
-     * Draw and alpha belend foreground objects
-     */
-    if (a->argb[0] != 255) {
-	cvCopy(&src_mat, dst_mat, NULL);
-	cvPutText(dst_mat, a->label, cvPoint(0, text_size.height + base_line), &font,
-		  CV_RGB(a->argb[1], a->argb[2], a->argb[3]));
-	alpha = (double)a->argb[0] / 255;
-	cvAddWeighted(&src_mat, 1 - alpha, dst_mat, alpha, 0.0, &src_mat);
-	cvReleaseMat(&dst_mat);
-    } else {
-	cvPutText(mat, a->label, cvPoint(a->roi[0].x, a->roi[0].y + text_size.height + base_line), &font,
-		  CV_RGB(a->argb[1], a->argb[2], a->argb[3]));
-    }
+    return LoadImageBufferInto(dst, staging, width, height, pixel_format);
+}
 
-#if 0
-    cvShowImage("src_bg_fg", &src_mat);
-    cvWaitKey(0);
-#endif
 
-    return 0;
-}
+struct _raw_image_file {
+    unsigned char *data;	/* Mapping of the whole file */
+    size_t length;
+    size_t frame_size;
+    int num_frames;
+    int width, height;
+    int pixel_format;
+};
 
 
-static int
-DrawRectangle(CvMat *mat, Annotation *a)
+/*
+ * Map a raw image file, frames are converted straight from the mapping
+ * without reading them into a buffer. A trailing partial frame is ignored.
+ */
+RawImageFile *
+OpenRawImageFile(const char *filename, int width, int height, int pixel_format)
 {
-    double alpha = 0;
-    CvRect roi;
-    CvMat src_mat, *dst_mat;
+    RawImageFile *raw;
+    struct stat sb;
+    size_t frame_size;
+    void *data;
+    int fd;
+
+    frame_size = ImageBufferSize(width, height, pixel_format);
+    if (!filename || !frame_size)
+	return NULL;
 
-    /*
-     * Check anchor point
-     */
-    if (a->roi[1].x < a->roi[0].x || a->roi[1].y < a->roi[0].y)
-	return -1;
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+	fprintf(stderr, "Error: Failed to open image file %s\n", filename);
+	return NULL;
+    }
 
-    /*
-     * Draw it on src image directly if there is no alpha blend or background color applied
-     */
-    if (a->argb[0] == 255 && a->fill[0] == 0) {
-	cvRectangle(mat, cvPoint(a->roi[0].x + a->bold/2, a->roi[0].y + a->bold/2),
-		    cvPoint(a->roi[1].x - a->bold/2, a->roi[1].y - a->bold/2), 
-		    CV_RGB(a->argb[1], a->argb[2], a->argb[3]), a->bold, CV_AA, 0);
-	return 0;
+    if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) || (size_t)sb.st_size < frame_size) {
+	close(fd);
+	return NULL;
     }
 
-    /*
-     * Get dimension of the ROI
-     */
-    roi.x = a->roi[0].x;
-    roi.y = a->roi[0].y;
-    roi.width = a->roi[1].x - a->roi[0].x;
-    roi.height = a->roi[1].y - a->roi[0].y;
-    if (roi.x + roi.width > mat->cols)
-	roi.width -= roi.x +roi.width - mat->cols;
-    if (roi.y + roi.height > mat->rows)
-	roi.width -= roi.y +roi.height - mat->rows;
+    data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+	return NULL;
 
-    /*
-     * Create source image
-     */
-    cvGetSubRect(mat, &src_mat, roi);
+    raw = (RawImageFile *)calloc(1, sizeof(RawImageFile));
+    if (!raw) {
+	munmap(data, sb.st_size);
+	return NULL;
+    }
 
-#if 0
-    printf("##### subrect width = %d, subrec height = %d\n", src_mat.cols, src_mat.rows);
-    cvShowImage("src", &src_mat);
-    cvWaitKey(0);
-#endif
+    raw->data = (unsigned char *)data;
+    raw->length = sb.st_size;
+    raw->frame_size = frame_size;
+    raw->num_frames = (raw->length / frame_size > INT_MAX) ? INT_MAX : raw->length / frame_size;
+    raw->width = width;
+    raw->height = height;
+    raw->pixel_format = pixel_format;
+
+    if (raw->length % frame_size)
+	fprintf(stderr, "Warning: Ignore %zu trailing bytes of %s\n", raw->length % frame_size, filename);
 
     /*
-     * Create target image
+     * Frames are mostly converted in order
      */
-    dst_mat = cvCloneMat(&src_mat);
-    if (a->fill[0]) {
-	/*
-	 * Alpha belend background first
-	 */
-	cvSet(dst_mat, CV_RGB(a->fill[1], a->fill[2], a->fill[3]), NULL);
-	alpha = (double)a->fill[0] / 255;
-	cvAddWeighted(&src_mat, 1 - alpha, dst_mat, alpha, 0.0, &src_mat);
-    }
+    if (raw->num_frames > 1)
+	madvise(raw->data, raw->length, MADV_SEQUENTIAL);
+
+    return raw;
+}
 
-#if 0
-    cvShowImage("src_bg", &src_mat);
-    cvWaitKey(0);
-#endif
 
-    /*
-     * Draw and alpha belend foreground objects
-     */
-    if (a->argb[0] != 255) {
-	cvCopy(&src_mat, dst_mat, NULL);
-	cvRectangle(dst_mat, cvPoint(a->bold/2, a->bold/2),
-		    cvPoint(a->roi[1].x - a->roi[0].x - a->bold/2, a->roi[1].y - a->roi[0].y - a->bold/2), 
-		    CV_RGB(a->argb[1], a->argb[2], a->argb[3]), a->bold, CV_AA, 0);
-	alpha = (double)a->argb[0] / 255;
-	cvAddWeighted(&src_mat, 1 - alpha, dst_mat, alpha, 0.0, &src_mat);
-	cvReleaseMat(&dst_mat);
-    } else {
-	cvRectangle(mat, cvPoint(a->roi[0].x + a->bold/2, a->roi[0].y + a->bold/2),
-		    cvPoint(a->roi[1].x - a->bold/2, a->roi[1].y - a->bold/2), 
-		    CV_RGB(a->argb[1], a->argb[2], a->argb[3]), a->bold, CV_AA, 0);
-    }
+void
+CloseRawImageFile(RawImageFile **raw)
+{
+    if (!raw || !*raw)
+	return;
+
+    munmap((*raw)->data, (*raw)->length);
+    free(*raw);
+    *raw = NULL;
+}
 
-#if 0
-    cvShowImage("alpha_0", &src_mat);
-    cvWaitKey(0);
-#endif
 
-    return 0;
+int
+RawImageFileFrames(RawImageFile *raw)
+{
+    return raw ? raw->num_frames : 0;
 }
 
 
-static int
-DrawLine(CvMat *mat, Annotation *a)
+/*
+ * Pixels of a frame in the mapping, read-only
+ */
+const unsigned char *
+RawImageFileFrame(RawImageFile *raw, int index)
 {
-    double alpha = 0;
-    CvRect roi;
-    CvMat src_mat, *dst_mat;
+    if (!raw || index < 0 || index >= raw->num_frames)
+	return NULL;
 
+    return raw->data + (size_t)index * raw->frame_size;
+}
 
-    /*
-     * Check anchor point
-     */
-    if (a->roi[1].x < a->roi[0].x || a->roi[1].y < a->roi[0].y)
-	return -1;
 
-    /*
-     * Draw it on src image directly if there is no alpha blend
-     */
-    if (a->argb[0] == 255) {
-	cvLine(mat, cvPoint(a->roi[0].x + a->bold/2, a->roi[0].y + a->bold/2),
-	       cvPoint(a->roi[1].x - a->bold/2, a->roi[1].y - a->bold/2), 
-	       CV_RGB(a->argb[1], a->argb[2], a->argb[3]), a->bold, CV_AA, 0);
+/*
+ * Convert a frame of a mapped file into a caller-owned BGR image
+ */
+int
+LoadRawImageFrameInto(CvMat *dst, RawImageFile *raw, int index)
+{
+    const unsigned char *frame;
 
-	return 0;
+    frame = RawImageFileFrame(raw, index);
+    if (!frame) {
+	fprintf(stderr, "Error: No frame %d in raw image file\n", index);
+	return -1;
     }
 
-    /*
-     * Get dimension of the ROI
-     */
-    roi.x = a->roi[0].x;
-    roi.y = a->roi[0].y;
-    roi.width = a->roi[1].x - a->roi[0].x;
-    roi.height = a->roi[1].y - a->roi[0].y;
-    if (roi.x + roi.width > mat->cols)
-	roi.width -= roi.x +roi.width - mat->cols;
-    if (roi.y + roi.height > mat->rows)
-	roi.width -= roi.y +roi.height - mat->rows;
+    return LoadImageBufferInto(dst, frame, raw->width, raw->height, raw->pixel_format);
+}
 
-    /*
-     * Create source image
-     */
-    cvGetSubRect(mat, &src_mat, roi);
 
-#if 0
-    printf("##### subrect width = %d, subrec height = %d\n", src_mat.cols, src_mat.rows);
-    cvShowImage("src", &src_mat);
-    cvWaitKey(0);
-#endif
+CvMat *
+LoadImageFile(const char *filename, int width, int height, int pixel_format)
+{
+    RawImageFile *raw;
+    CvMat *src_mat, *dst_mat;
+    size_t size;
+
+    size = ImageBufferSize(width, height, pixel_format);
+    if (!size)
+	return cvLoadImageM(filename, CV_LOAD_IMAGE_COLOR);
 
     /*
-     * Create target image
+     * Convert from the mapping of regular files, read anything else
      */
-    dst_mat = cvCloneMat(&src_mat);
-    if (a->argb[0] != 255)
-	cvLine(dst_mat, cvPoint(a->bold/2, a->bold/2), 
-	       cvPoint(a->roi[1].x - a->roi[0].x -a->bold/2, a->roi[1].y - a->roi[0].y - a->bold/2), 
-	       CV_RGB(a->argb[1], a->argb[2], a->argb[3]), a->bold, CV_AA, 0);
+    raw = OpenRawImageFile(filename, width, height, pixel_format);
+    if (raw) {
+	dst_mat = cvCreateMat(height, width, CV_8UC3);
+	if (dst_mat && LoadRawImageFrameInto(dst_mat, raw, 0) < 0)
+	    cvReleaseMat(&dst_mat);
+	CloseRawImageFile(&raw);
+	return dst_mat;
+    }
 
-#if 0
-    cvShowImage("dst", dst_mat);
-    cvWaitKey(0);
-#endif
+    src_mat = cvCreateMat(1, size, CV_8UC1);
+    if (!src_mat)
+	return NULL;
 
-    /*
-     * Alpha belend 
-     */
-    alpha = (double)a->argb[0] / 255;
-    cvAddWeighted(&src_mat, 1 - alpha, dst_mat, alpha, 0.0, &src_mat);
-    cvReleaseMat(&dst_mat);
+    dst_mat = cvCreateMat(height, width, CV_8UC3);
+    if (!dst_mat) {
+	cvReleaseMat(&src_mat);
+	return NULL;
+    }
 
-#if 0
-    cvShowImage("src_fg", &src_mat);
-    cvWaitKey(0);
-#endif
+    if (LoadImageFileInto(dst_mat, filename, width, height, pixel_format, src_mat->data.ptr, size) < 0)
+	cvReleaseMat(&dst_mat);
 
-    return 0;
+    cvReleaseMat(&src_mat);
+
+    return dst_mat;
 }
 
 
-static int
-DrawEllipse(CvMat *mat, Annotation *a)
+CvMat *
+LoadImageBuffer(unsigned char *buffer, int width, int height, int pixel_format)
 {
-    double alpha = 0;
-    CvRect roi;
     CvMat src_mat, *dst_mat;
 
-    /*
-     * Check axes
-     */
-    if (a->roi[1].x <= 0 || a->roi[1].y <= 0)
-	return -1;
 
-    /*
-     * Draw it on src image directly if there is no alpha blend or background color applied
-     */
-    if (a->argb[0] == 255 && a->fill[0] == 0) {
-	cvEllipse(mat, cvPoint(a->roi[0].x, a->roi[0].y), cvSize(a->roi[1].x - a->bold/2, a->roi[1].y - a->bold/2),
-		  a->phi[0], 0, 360, CV_RGB(a->argb[1], a->argb[2], a->argb[3]), a->bold, CV_AA, 0);
+    if (!buffer)
+	return NULL;
 
-	return 0;
+    if (!ImageBufferSize(width, height, pixel_format)) {
+	src_mat = cvMat(height, width, CV_32FC3, (void *)buffer);
+	return cvDecodeImageM(&src_mat, CV_LOAD_IMAGE_COLOR);
     }
 
-    /*
-     * Get dimension of the ROI
-     */
-    roi.x = 0;
-    roi.y = 0;
-    roi.width = mat->cols;
-    roi.height = mat->rows;
+    dst_mat = cvCreateMat(height, width, CV_8UC3); 
+    if (!dst_mat)
+	return NULL;
 
-    /*
-     * Create source image
-     */
-    cvGetSubRect(mat, &src_mat, roi);
+    if (LoadImageBufferInto(dst_mat, buffer, width, height, pixel_format) < 0)
+	cvReleaseMat(&dst_mat);
 
-#if 0
-    printf("##### subrect width = %d, subrec height = %d\n", src_mat.cols, src_mat.rows);
-    cvShowImage("src", &src_mat);
-    cvWaitKey(0);
-#endif
+    return dst_mat;
+}
+
+
+/*
+ * The Draw functions rasterize the shape coverage into the overlay mask of
+ * the clip area, the item bounds or a part of them, with coordinates
+ * relative to it, then blend the fill or the stroke color over the overlay.
+ * The frame itself is only touched by the composite.
+ */
+static void
+DrawText(Overlay *ov, DrawItem *item, CvRect clip)
+{
+    Annotation *a = &item->a;
+    CvMat mask;
+    CvPoint org;
+
+    overlay_mask(ov, clip, &mask);
+    org = cvPoint(a->roi[0].x - clip.x, a->roi[0].y - clip.y);
 
-    /*
-     * Create target image
-     */
-    dst_mat = cvCloneMat(mat);
     if (a->fill[0]) {
-	/*
-	 * Alpha belend background first
-	 */
-	cvEllipse(dst_mat, cvPoint(a->roi[0].x, a->roi[0].y), cvSize(a->roi[1].x, a->roi[1].y),
-		  a->phi[0], 0, 360, CV_RGB(a->fill[1], a->fill[2], a->fill[3]), CV_FILLED, CV_AA, 0);
-	alpha = (double)a->fill[0] / 255;
-	cvAddWeighted(&src_mat, 1 - alpha, dst_mat, alpha, 0.0, &src_mat);
+	cvRectangle(&mask, org, cvPoint(org.x + item->text_size.width - 1,
+					org.y + item->text_size.height + 2*item->base_line - 1),
+		    cvScalarAll(255), CV_FILLED, 8, 0);
+	overlay_blend(ov, clip, a->fill);
+    }
+
+    if (a->argb[0]) {
+	glyph_atlas_draw(item->atlas, &mask, cvPoint(org.x, org.y + item->text_size.height + item->base_line),
+			 a->label);
+	overlay_blend(ov, clip, a->argb);
     }
+}
+
+
+static void
+DrawRectangle(Overlay *ov, DrawItem *item, CvRect clip)
+{
+    Annotation *a = &item->a;
+    CvMat mask;
+    CvPoint p0, p1;
 
-#if 0
-    cvShowImage("src_bg", &src_mat);
-    cvWaitKey(0);
-#endif
+    overlay_mask(ov, clip, &mask);
+    p0 = cvPoint(a->roi[0].x - clip.x, a->roi[0].y - clip.y);
+    p1 = cvPoint(a->roi[1].x - clip.x, a->roi[1].y - clip.y);
 
     /*
-     * Draw and alpha belend foreground objects
+     * The background covers the ROI up to but excluding roi[1], as the
+     * original per-rectangle blend did
      */
-    if (a->argb[0] != 255) {
-	cvCopy(&src_mat, dst_mat, NULL);
-	cvEllipse(dst_mat, cvPoint(a->roi[0].x, a->roi[0].y), cvSize(a->roi[1].x - a->bold/2, a->roi[1].y - a->bold/2),
-		  a->phi[0], 0, 360, CV_RGB(a->argb[1], a->argb[2], a->argb[3]), a->bold, CV_AA, 0);
-	alpha = (double)a->argb[0] / 255;
-	cvAddWeighted(&src_mat, 1 - alpha, dst_mat, alpha, 0.0, &src_mat);
-	cvReleaseMat(&dst_mat);
-    } else {
-	cvEllipse(mat, cvPoint(a->roi[0].x, a->roi[0].y), cvSize(a->roi[1].x - a->bold/2, a->roi[1].y - a->bold/2),
-		  a->phi[0], 0, 360, CV_RGB(a->argb[1], a->argb[2], a->argb[3]), a->bold, CV_AA, 0);
+    if (a->fill[0]) {
+	cvRectangle(&mask, p0, cvPoint(p1.x - 1, p1.y - 1), cvScalarAll(255), CV_FILLED, 8, 0);
+	overlay_blend(ov, clip, a->fill);
     }
 
-#if 0
-    cvShowImage("src_bg_fg", &src_mat);
-    cvWaitKey(0);
-#endif
-
-    return 0;
+    if (a->argb[0]) {
+	cvRectangle(&mask, cvPoint(p0.x + a->bold/2, p0.y + a->bold/2),
+		    cvPoint(p1.x - a->bold/2, p1.y - a->bold/2),
+		    cvScalarAll(255), a->bold, item->line_type, 0);
+	overlay_blend(ov, clip, a->argb);
+    }
 }
 
 
-static int
-DrawPolygon(CvMat *mat, Annotation *a)
+static void
+DrawLine(Overlay *ov, DrawItem *item, CvRect clip)
 {
-    int i;
-    double alpha = 0;
-    CvRect roi;
-    CvMat src_mat, *dst_mat;
-    CvPoint *pts;
+    Annotation *a = &item->a;
+    CvMat mask;
 
+    if (!a->argb[0])
+	return;
 
-    pts = (CvPoint *)malloc(a->np*sizeof(CvPoint));
-    if (!pts) 
-	return -1;
+    overlay_mask(ov, clip, &mask);
+    cvLine(&mask, cvPoint(a->roi[0].x - clip.x + a->bold/2, a->roi[0].y - clip.y + a->bold/2),
+	   cvPoint(a->roi[1].x - clip.x - a->bold/2, a->roi[1].y - clip.y - a->bold/2),
+	   cvScalarAll(255), a->bold, item->line_type, 0);
+    overlay_blend(ov, clip, a->argb);
+}
 
-    for (i = 0; i < a->np; i++) {
-	pts[i] = cvPoint(a->roi[i].x, a->roi[i].y);
-    }
 
-    /*
-     * Draw it on src image directly if there is no alpha blend or background color applied
-     */
-    if (a->argb[0] == 255 && a->fill[0] == 0) {
-	cvPolyLine(mat, &pts, &a->np, 1, 1, CV_RGB(a->argb[1], a->argb[2], a->argb[3]), a->bold, CV_AA, 0);
+static void
+DrawEllipse(Overlay *ov, DrawItem *item, CvRect clip)
+{
+    Annotation *a = &item->a;
+    CvMat mask;
+    CvPoint center;
 
-	return 0;
-    }
+    overlay_mask(ov, clip, &mask);
+    center = cvPoint(a->roi[0].x - clip.x, a->roi[0].y - clip.y);
 
-    /*
-     * Get dimension of the ROI
-     */
-    roi.x = 0;
-    roi.y = 0;
-    roi.width = mat->cols;
-    roi.height = mat->rows;
+    if (a->fill[0]) {
+	cvEllipse(&mask, center, cvSize(a->roi[1].x, a->roi[1].y),
+		  a->phi[0], 0, 360, cvScalarAll(255), CV_FILLED, item->line_type, 0);
+	overlay_blend(ov, clip, a->fill);
+    }
 
-    /*
-     * Create source image
-     */
-    cvGetSubRect(mat, &src_mat, roi);
+    if (a->argb[0]) {
+	cvEllipse(&mask, center, cvSize(a->roi[1].x - a->bold/2, a->roi[1].y - a->bold/2),
+		  a->phi[0], 0, 360, cvScalarAll(255), a->bold, item->line_type, 0);
+	overlay_blend(ov, clip, a->argb);
+    }
+}
 
-#if 0
-    printf("##### subrect width = %d, subrec height = %d\n", src_mat.cols, src_mat.rows);
-    cvShowImage("src", &src_mat);
-    cvWaitKey(0);
-#endif
 
-    /*
-     * Create target image
-     */
-    dst_mat = cvCloneMat(mat);
-    if (a->fill[0]) {
-	/*
-	 * Alpha belend background first
-	 */
-	cvFillPoly(dst_mat, &pts, &a->np, 1, CV_RGB(a->fill[1], a->fill[2], a->fill[3]), CV_AA, 0);
-	alpha = (double)a->fill[0] / 255;
-	cvAddWeighted(&src_mat, 1 - alpha, dst_mat, alpha, 0.0, &src_mat);
-    }
+/*
+ * The vertices are kept relative to the bounds, pts holds them moved to a
+ * clip area with another origin
+ */
+static void
+DrawPolygon(Overlay *ov, DrawItem *item, CvRect clip, CvPoint *pts)
+{
+    Annotation *a = &item->a;
+    CvMat mask;
+    int n;
 
-#if 0
-    cvShowImage("src_bg", &src_mat);
-    cvWaitKey(0);
-#endif
+    overlay_mask(ov, clip, &mask);
 
-    /*
-     * Draw and alpha belend foreground objects
-     */
-    if (a->argb[0] != 255) {
-	cvCopy(&src_mat, dst_mat, NULL);
-	cvPolyLine(dst_mat, &pts, &a->np, 1, 1, CV_RGB(a->argb[1], a->argb[2], a->argb[3]), a->bold, CV_AA, 0);
-	alpha = (double)a->argb[0] / 255;
-	cvAddWeighted(&src_mat, 1 - alpha, dst_mat, alpha, 0.0, &src_mat);
-	cvReleaseMat(&dst_mat);
+    if (clip.x == item->bounds.x && clip.y == item->bounds.y) {
+	pts = item->pts;
     } else {
-	cvPolyLine(mat, &pts, &a->np, 1, 1, CV_RGB(a->argb[1], a->argb[2], a->argb[3]), a->bold, CV_AA, 0);
+	for (n = 0; n < a->np; n++)
+	    pts[n] = cvPoint(item->pts[n].x + item->bounds.x - clip.x, item->pts[n].y + item->bounds.y - clip.y);
     }
 
-#if 0
-    cvShowImage("src_bg_fg", &src_mat);
-    cvWaitKey(0);
-#endif
+    if (a->fill[0]) {
+	cvFillPoly(&mask, &pts, &a->np, 1, cvScalarAll(255), item->line_type, 0);
+	overlay_blend(ov, clip, a->fill);
+    }
 
-    return 0;
+    if (a->argb[0]) {
+	cvPolyLine(&mask, &pts, &a->np, 1, 1, cvScalarAll(255), a->bold, item->line_type, 0);
+	overlay_blend(ov, clip, a->argb);
+    }
 }
 
 
-static int
-DrawCircle(CvMat *mat, Annotation *a)
+static void
+DrawCircle(Overlay *ov, DrawItem *item, CvRect clip)
 {
-    double alpha = 0;
-    CvRect roi;
-    CvMat src_mat, *dst_mat;
+    Annotation *a = &item->a;
+    CvMat mask;
+    CvPoint center;
+    int radius;
 
+    overlay_mask(ov, clip, &mask);
+    center = cvPoint(a->roi[0].x - clip.x, a->roi[0].y - clip.y);
+    radius = a->roi[1].x - a->roi[0].x;
 
-    /*
-     * Check radius
-     */
-    if (a->roi[1].x - a->roi[0].x <= 0)
+    if (a->fill[0]) {
+	cvCircle(&mask, center, radius, cvScalarAll(255), CV_FILLED, item->line_type, 0);
+	overlay_blend(ov, clip, a->fill);
+    }
+
+    if (a->argb[0]) {
+	cvCircle(&mask, center, radius - a->bold/2, cvScalarAll(255), a->bold, item->line_type, 0);
+	overlay_blend(ov, clip, a->argb);
+    }
+}
+
+
+/*
+ * Bounding box in pixel of the shape, grown by the stroke width and the
+ * antialias margin and clipped to the frame
+ */
+static CvRect
+annotation_bounds(DrawItem *item, int width, int height)
+{
+    Annotation *a = &item->a;
+    double x0, y0, x1, y1, hx, hy, c, s;
+    int n, margin;
+    CvRect r;
+
+    margin = ((a->bold > 0) ? a->bold : 1) / 2 + 2;
+
+    switch (a->op) {
+	case OL_ELLIPSE:
+	    c = cos(a->phi[0] * CV_PI / 180);
+	    s = sin(a->phi[0] * CV_PI / 180);
+	    hx = sqrt(a->roi[1].x*a->roi[1].x*c*c + a->roi[1].y*a->roi[1].y*s*s);
+	    hy = sqrt(a->roi[1].x*a->roi[1].x*s*s + a->roi[1].y*a->roi[1].y*c*c);
+	    x0 = a->roi[0].x - hx;
+	    x1 = a->roi[0].x + hx;
+	    y0 = a->roi[0].y - hy;
+	    y1 = a->roi[0].y + hy;
+	    break;
+
+	case OL_LABEL:
+	    x0 = a->roi[0].x;
+	    x1 = x0 + item->text_size.width;
+	    y0 = a->roi[0].y;
+	    y1 = y0 + item->text_size.height + 2*item->base_line;
+	    break;
+
+	case OL_BLUR:
+	case OL_PIXELATE:
+	    if (a->np > 2)
+		goto points;
+	    /* fall through */
+
+	case OL_HEATMAP:
+	    /*
+	     * Exactly the pixels of the rectangle
+	     */
+	    margin = 0;
+	    x0 = a->roi[0].x;
+	    x1 = a->roi[1].x - 1;
+	    y0 = a->roi[0].y;
+	    y1 = a->roi[1].y - 1;
+	    break;
+
+	case OL_CIRCLE:
+	    hx = a->roi[1].x - a->roi[0].x;
+	    x0 = a->roi[0].x - hx;
+	    x1 = a->roi[0].x + hx;
+	    y0 = a->roi[0].y - hx;
+	    y1 = a->roi[0].y + hx;
+	    break;
+
+	default:
+	points:
+	    x0 = x1 = a->roi[0].x;
+	    y0 = y1 = a->roi[0].y;
+	    for (n = 1; n < a->np; n++) {
+		x0 = (a->roi[n].x < x0) ? a->roi[n].x : x0;
+		x1 = (a->roi[n].x > x1) ? a->roi[n].x : x1;
+		y0 = (a->roi[n].y < y0) ? a->roi[n].y : y0;
+		y1 = (a->roi[n].y > y1) ? a->roi[n].y : y1;
+	    }
+	    break;
+    }
+
+    r.x = floor(x0) - margin;
+    r.y = floor(y0) - margin;
+    r.width = ceil(x1) + margin + 1 - r.x;
+    r.height = ceil(y1) + margin + 1 - r.y;
+
+    if (r.x < 0) {
+	r.width += r.x;
+	r.x = 0;
+    }
+    if (r.y < 0) {
+	r.height += r.y;
+	r.y = 0;
+    }
+    if (r.x + r.width > width)
+	r.width = width - r.x;
+    if (r.y + r.height > height)
+	r.height = height - r.y;
+
+    return r;
+}
+
+
+/*
+ * Check the annotation has what its drawing operation needs
+ */
+static int
+validate_annotation(Annotation *a)
+{
+    switch (a->op) {
+	case OL_LABEL:
+	    return (a->np >= 1 && a->label) ? 0 : -1;
+
+	case OL_RECTANGLE:
+	case OL_LINE:
+	    /*
+	     * Check anchor point
+	     */
+	    return (a->np >= 2 && a->roi[1].x >= a->roi[0].x && a->roi[1].y >= a->roi[0].y) ? 0 : -1;
+
+	case OL_ELLIPSE:
+	    /*
+	     * Check axes
+	     */
+	    return (a->np >= 2 && a->roi[1].x > 0 && a->roi[1].y > 0) ? 0 : -1;
+
+	case OL_CIRCLE:
+	    /*
+	     * Check radius
+	     */
+	    return (a->np >= 2 && a->roi[1].x - a->roi[0].x > 0) ? 0 : -1;
+
+	case OL_POLYGON:
+	    return (a->np >= 1) ? 0 : -1;
+
+	case OL_HEATMAP:
+	    /*
+	     * Check the rectangle and the grid
+	     */
+	    return (a->np >= 2 && a->roi[1].x > a->roi[0].x && a->roi[1].y > a->roi[0].y && a->grid) ? 0 : -1;
+
+	case OL_BLUR:
+	case OL_PIXELATE:
+	    /*
+	     * A rectangle or a polygon
+	     */
+	    if (a->np == 2)
+		return (a->roi[1].x > a->roi[0].x && a->roi[1].y > a->roi[0].y) ? 0 : -1;
+	    return (a->np >= 3) ? 0 : -1;
+
+	default:
+	    break;
+    }
+
+    return -1;
+}
+
+
+void
+release_annotation(Annotation *a, AnnotationArena *arena)
+{
+    arena_free(arena, a->roi);
+    arena_free(arena, a->label);
+    arena_free(arena, a->grid);
+    memset(a, 0, sizeof(Annotation));
+}
+
+
+/*
+ * Line type of an annotation quality for the frame size
+ */
+static int
+annotation_line_type(int quality, int width, int height)
+{
+    switch (quality) {
+	case ANNOTATION_QUALITY_AA:
+	    return CV_AA;
+
+	case ANNOTATION_QUALITY_FAST:
+	    return 8;
+
+	default:
+	    break;
+    }
+
+    return ((long)width * height < ANNOTATION_AUTO_FAST_PIXELS) ? 8 : CV_AA;
+}
+
+
+/*
+ * Convert a parsed annotation to pixel for the frame size and precompute
+ * what drawing needs. Return -1 if the annotation can't be drawn or lies
+ * outside of the frame.
+ */
+int
+prepare_item(DrawItem *item, int width, int height, AnnotationArena *arena)
+{
+    Annotation *a = &item->a;
+    CvRect r;
+    int n;
+
+    if (a->np < 1)
 	return -1;
 
     /*
-     * Draw it on src image directly if there is no alpha blend or background color applied
+     * Covert relative coordinates to pixel coordinates
      */
-    if (a->argb[0] == 255 && a->fill[0] == 0) {
-	cvCircle(mat, cvPoint(a->roi[0].x, a->roi[0].y), (int)(a->roi[1].x - a->roi[0].x - a->bold/2),
-		 CV_RGB(a->argb[1], a->argb[2], a->argb[3]), a->bold, CV_AA, 0);
+    for (n = 0; n < a->np; n++) {
+	a->roi[n].x *= width;
+	a->roi[n].y *= height;
+    }
 
-	return 0;
+    /*
+     * Clamp the color
+     */
+    for (n = 0; n < 4; n++) {
+	a->argb[n] = (a->argb[n] < 0)? 0 : a->argb[n];
+	a->argb[n] = (a->argb[n] > 255)? 255 : a->argb[n];
+	a->fill[n] = (a->fill[n] < 0)? 0 : a->fill[n];
+	a->fill[n] = (a->fill[n] > 255)? 255 : a->fill[n];
     }
 
+    if (validate_annotation(a))
+	return -1;
+
+    item->line_type = annotation_line_type(a->quality, width, height);
+
     /*
-     * Get dimension of the ROI
+     * Labels are drawn from the glyph atlas of their font
      */
-    roi.x = 0;
-    roi.y = 0;
-    roi.width = mat->cols;
-    roi.height = mat->rows;
+    if (a->op == OL_LABEL) {
+	item->atlas = glyph_atlas_get(CV_FONT_HERSHEY_PLAIN, a->scale, a->bold, item->line_type);
+	if (!item->atlas)
+	    return -1;
+	item->text_size = glyph_atlas_measure(item->atlas, a->label, &item->base_line);
+    }
 
     /*
-     * Create source image
+     * Cull what the frame doesn't show, the rest is clamped to the frame.
+     * The grid of a heatmap is mapped to its whole rectangle and cropped.
      */
-    cvGetSubRect(mat, &src_mat, roi);
+    r = annotation_bounds(item, width, height);
+    if (r.width <= 0 || r.height <= 0)
+	return -1;
+
+    if (a->op == OL_HEATMAP) {
+	item->grid_area[0] = a->roi[0];
+	item->grid_area[1] = a->roi[1];
+    }
+
+    for (n = 0; n < a->np; n++) {
+	if (a->roi[n].x < 0) a->roi[n].x = 0;
+	if (a->roi[n].x > width) a->roi[n].x = width;
+	if (a->roi[n].y < 0) a->roi[n].y = 0;
+	if (a->roi[n].y > height) a->roi[n].y = height;
+    }
+
+    if (validate_annotation(a))
+	return -1;
 
-#if 0
-    printf("##### subrect width = %d, subrec height = %d\n", src_mat.cols, src_mat.rows);
-    cvShowImage("src", &src_mat);
-    cvWaitKey(0);
-#endif
+    item->bounds = annotation_bounds(item, width, height);
 
     /*
-     * Create target image
+     * Polygon vertices in pixel, relative to the bounding box
      */
-    dst_mat = cvCloneMat(mat);
-    if (a->fill[0]) {
-	/*
-	 * Alpha belend background first
-	 */
-	cvCircle(dst_mat, cvPoint(a->roi[0].x, a->roi[0].y), (int)(a->roi[1].x - a->roi[0].x),
-		 CV_RGB(a->fill[1], a->fill[2], a->fill[3]), CV_FILLED, CV_AA, 0);
-	alpha = (double)a->fill[0] / 255;
-	cvAddWeighted(&src_mat, 1 - alpha, dst_mat, alpha, 0.0, &src_mat);
+    if (a->op == OL_HEATMAP && heatmap_prepare(item, arena) < 0)
+	return -1;
+
+    if (a->op == OL_POLYGON || ((a->op == OL_BLUR || a->op == OL_PIXELATE) && a->np > 2)) {
+	item->pts = (CvPoint *)arena_alloc(arena, a->np*sizeof(CvPoint));
+	if (!item->pts)
+	    return -1;
+
+	for (n = 0; n < a->np; n++)
+	    item->pts[n] = cvPoint(a->roi[n].x - item->bounds.x, a->roi[n].y - item->bounds.y);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Grow the list bounds by the item bounds aligned to the overlay tiles
+ */
+static void
+list_add_bounds(AnnotationList *list, CvRect r)
+{
+    int x0, y0, x1, y1;
+
+    if (r.width <= 0 || r.height <= 0)
+	return;
+
+    x0 = r.x / OVERLAY_TILE_SIZE * OVERLAY_TILE_SIZE;
+    y0 = r.y / OVERLAY_TILE_SIZE * OVERLAY_TILE_SIZE;
+    x1 = (r.x + r.width + OVERLAY_TILE_SIZE - 1) / OVERLAY_TILE_SIZE * OVERLAY_TILE_SIZE;
+    y1 = (r.y + r.height + OVERLAY_TILE_SIZE - 1) / OVERLAY_TILE_SIZE * OVERLAY_TILE_SIZE;
+    if (x1 > list->width)
+	x1 = list->width;
+    if (y1 > list->height)
+	y1 = list->height;
+
+    if (list->bounds.width > 0) {
+	if (list->bounds.x < x0) x0 = list->bounds.x;
+	if (list->bounds.y < y0) y0 = list->bounds.y;
+	if (list->bounds.x + list->bounds.width > x1) x1 = list->bounds.x + list->bounds.width;
+	if (list->bounds.y + list->bounds.height > y1) y1 = list->bounds.y + list->bounds.height;
     }
 
-#if 0
-    cvShowImage("src_bg", &src_mat);
-    cvWaitKey(0);
-#endif
+    list->bounds = cvRect(x0, y0, x1 - x0, y1 - y0);
+}
+
 
+/*
+ * Add the item to the bins of the frame tiles its bounds touch
+ */
+static int
+list_bin_item(AnnotationList *list, int index)
+{
+    CvRect r = list->items[index].bounds;
+    TileBin *bin;
+    int *items;
+    int tx, ty, capacity;
+
+    if (!list->bins) {
+	list->tiles_x = (list->width + OVERLAY_TILE_SIZE - 1) / OVERLAY_TILE_SIZE;
+	list->tiles_y = (list->height + OVERLAY_TILE_SIZE - 1) / OVERLAY_TILE_SIZE;
+	list->bins = (TileBin *)arena_calloc(list->arena, list->tiles_x * list->tiles_y, sizeof(TileBin));
+	if (!list->bins)
+	    return -1;
+    }
+
+    for (ty = r.y / OVERLAY_TILE_SIZE; ty <= (r.y + r.height - 1) / OVERLAY_TILE_SIZE; ty++) {
+	for (tx = r.x / OVERLAY_TILE_SIZE; tx <= (r.x + r.width - 1) / OVERLAY_TILE_SIZE; tx++) {
+	    bin = &list->bins[ty * list->tiles_x + tx];
+	    if (bin->count == bin->capacity) {
+		capacity = bin->capacity ? bin->capacity * 2 : 8;
+		items = (int *)arena_realloc(list->arena, bin->items, bin->capacity * sizeof(int),
+					     capacity * sizeof(int));
+		if (!items)
+		    goto fail;
+		bin->items = items;
+		bin->capacity = capacity;
+	    }
+	    bin->items[bin->count++] = index;
+	}
+    }
+
+    return 0;
+
+fail:
     /*
-     * Draw and alpha belend foreground objects
+     * Take the item back out of the bins it made it to
      */
-    if (a->argb[0] != 255) {
-	cvCopy(&src_mat, dst_mat, NULL);
-	cvCircle(dst_mat, cvPoint(a->roi[0].x, a->roi[0].y), (int)(a->roi[1].x - a->roi[0].x - a->bold/2),
-		 CV_RGB(a->argb[1], a->argb[2], a->argb[3]), a->bold, CV_AA, 0);
-	alpha = (double)a->argb[0] / 255;
-	cvAddWeighted(&src_mat, 1 - alpha, dst_mat, alpha, 0.0, &src_mat);
-	cvReleaseMat(&dst_mat);
-    } else {
-	cvCircle(mat, cvPoint(a->roi[0].x, a->roi[0].y), (int)(a->roi[1].x - a->roi[0].x - a->bold/2),
-		 CV_RGB(a->argb[1], a->argb[2], a->argb[3]), a->bold, CV_AA, 0);
+    for (ty = r.y / OVERLAY_TILE_SIZE; ty <= (r.y + r.height - 1) / OVERLAY_TILE_SIZE; ty++) {
+	for (tx = r.x / OVERLAY_TILE_SIZE; tx <= (r.x + r.width - 1) / OVERLAY_TILE_SIZE; tx++) {
+	    bin = &list->bins[ty * list->tiles_x + tx];
+	    if (bin->count > 0 && bin->items[bin->count - 1] == index)
+		bin->count--;
+	}
     }
 
-#if 0
-    cvShowImage("src_bg_fg", &src_mat);
-    cvWaitKey(0);
-#endif
+    return -1;
+}
 
-    return 0;
+
+/*
+ * Cull the earlier items an opaque filled rectangle hides completely. The
+ * fill isn't antialiased, it covers the pixels between the corners.
+ */
+static void
+list_cull_covered(AnnotationList *list, int index)
+{
+    DrawItem *cover = &list->items[index], *item;
+    Annotation *a = &cover->a;
+    TileBin *bin;
+    CvRect b;
+    int x0, y0, x1, y1, tx, ty, i;
+
+    if (a->op != OL_RECTANGLE || a->fill[0] != 255)
+	return;
+
+    x0 = a->roi[0].x;
+    y0 = a->roi[0].y;
+    x1 = a->roi[1].x;
+    y1 = a->roi[1].y;
+
+    for (ty = y0 / OVERLAY_TILE_SIZE; ty <= y1 / OVERLAY_TILE_SIZE && ty < list->tiles_y; ty++) {
+	for (tx = x0 / OVERLAY_TILE_SIZE; tx <= x1 / OVERLAY_TILE_SIZE && tx < list->tiles_x; tx++) {
+	    bin = &list->bins[ty * list->tiles_x + tx];
+	    for (i = 0; i < bin->count && bin->items[i] < index; i++) {
+		item = &list->items[bin->items[i]];
+		b = item->bounds;
+		if (b.x >= x0 && b.x + b.width - 1 <= x1 && b.y >= y0 && b.y + b.height - 1 <= y1)
+		    item->culled = 1;
+	    }
+	}
+    }
 }
 
 
+void
+release_item(DrawItem *item, AnnotationArena *arena)
+{
+    glyph_atlas_put(item->atlas);
+    arena_free(arena, item->pts);
+    arena_free(arena, item->lut);
+    release_annotation(&item->a, arena);
+    memset(item, 0, sizeof(DrawItem));
+}
+
+
+/*
+ * Create an empty list, everything of it comes from the arena if any
+ */
+AnnotationList *
+create_annotation_list(int width, int height, int quality, AnnotationArena *arena)
+{
+    AnnotationList *list;
+
+    list = (AnnotationList *)arena_calloc(arena, 1, sizeof(AnnotationList));
+    if (!list)
+	return NULL;
+
+    list->width = width;
+    list->height = height;
+    list->quality = quality;
+    list->arena = arena;
+
+    return list;
+}
+
+
+/*
+ * Append a parsed annotation to a list, which takes over its ROI, label and
+ * grid, allocated the way the list is. Annotations that can't be drawn are
+ * dropped.
+ */
 int
-AnnotateImage(CvMat *mat, char *commands)
+list_add_annotation(AnnotationList *list, Annotation *a, int debug)
+{
+    DrawItem *item;
+    int capacity;
+
+    if (list->count == list->capacity) {
+	capacity = list->capacity ? list->capacity * 2 : 16;
+	item = (DrawItem *)arena_realloc(list->arena, list->items, list->capacity * sizeof(DrawItem),
+					 capacity * sizeof(DrawItem));
+	if (!item)
+	    return -1;
+	list->items = item;
+	list->capacity = capacity;
+    }
+
+    item = &list->items[list->count];
+    memset(item, 0, sizeof(DrawItem));
+    item->a = *a;
+    a->roi = NULL;
+    a->label = NULL;
+    a->grid = NULL;
+    a = &item->a;
+    if (list->quality != ANNOTATION_QUALITY_AUTO)
+	a->quality = list->quality;
+
+    if (prepare_item(item, list->width, list->height, list->arena)) {
+	d_printf("##### Skip invalid annotation %d (op %d)\n", list->count, a->op);
+	release_item(item, list->arena);
+	return 0;
+    }
+
+    d_printf("\n");
+    d_printf("##### op      = %d\n", a->op);
+    d_printf("##### roi     = [ (%lf, %lf), (%lf, %lf) ]\n", a->roi[0].x, a->roi[0].y,
+	     a->roi[a->np > 1].x, a->roi[a->np > 1].y);
+    d_printf("##### phi     = [ %lf, %lf, %lf ]\n", a->phi[0], a->phi[1], a->phi[2]);
+    d_printf("##### argb    = [ %d, %d, %d, %d ]\n", a->argb[0], a->argb[1], a->argb[2], a->argb[3]);
+    d_printf("##### fill    = [ %d, %d, %d, %d ]\n", a->fill[0], a->fill[1], a->fill[2], a->fill[3]);
+    d_printf("##### label   = %s\n", a->label);
+    d_printf("##### scale   = %lf\n", a->scale);
+    d_printf("##### bold    = %d\n", a->bold);
+    d_printf("##### quality = %d\n", a->quality);
+    d_printf("\n");
+
+    if (list_bin_item(list, list->count) < 0) {
+	release_item(item, list->arena);
+	return -1;
+    }
+
+    list_add_bounds(list, item->bounds);
+    if (a->op == OL_POLYGON && a->np > list->max_np)
+	list->max_np = a->np;
+    if (a->op == OL_BLUR || a->op == OL_PIXELATE)
+	list->num_masks++;
+    list_cull_covered(list, list->count);
+    list->count++;
+
+    return 0;
+}
+
+
+typedef struct _compile_state {
+    AnnotationList *list;
+    int debug;
+} CompileState;
+
+
+static int
+compile_callback(void *data, Annotation *a)
 {
-    int i, n;
-    json_object *jobj, *obj;
-    json_object *annotations;
-    int count;
-    Annotation a;
+    CompileState *state = (CompileState *)data;
+
+    return list_add_annotation(state->list, a, state->debug);
+}
 
 
+/*
+ * Parse the JSON annotation request once into a draw list for a frame size:
+ * coordinates are converted to pixels and clamped, colors are clamped and
+ * invalid annotations are dropped, so applying it only draws. The request
+ * goes through the streaming parser, only one annotation object is held
+ * in JSON form at a time.
+ */
+AnnotationList *
+compile_annotation(const char *commands, int width, int height, int debug, int quality,
+		   AnnotationParser **keep, AnnotationArena *arena)
+{
+    AnnotationParser *parser, *own = NULL;
+    CompileState state;
+    int res;
+
     if (!commands) {
 	fprintf(stderr, "Error: No annotation input\n");
-	return -1;
+	return NULL;
     }
 
     d_printf("Annotation string: %s\n", commands);
 
-    jobj = json_tokener_parse(commands);
-    if (!jobj) {
+    state.debug = debug;
+    state.list = create_annotation_list(width, height, quality, arena);
+    if (!state.list)
+	return NULL;
+
+    /*
+     * A parser kept by the caller keeps its buffers from list to list
+     */
+    if (keep && *keep) {
+	parser = *keep;
+	parser_reset(parser, compile_callback, &state, arena);
+    } else {
+	parser = CreateAnnotationParser(compile_callback, &state);
+	if (!parser) {
+	    ReleaseAnnotation(&state.list);
+	    return NULL;
+	}
+	parser_reset(parser, compile_callback, &state, arena);
+	if (keep)
+	    *keep = parser;
+	else
+	    own = parser;
+    }
+
+    res = FeedAnnotationParser(parser, commands, strlen(commands));
+    if (res == 0)
+	res = FinishAnnotationParser(parser);
+    ReleaseAnnotationParser(&own);
+
+    if (res < 0) {
 	fprintf(stderr, "Error: No annotation was specified\n");
+	ReleaseAnnotation(&state.list);
+	return NULL;
+    }
+
+    d_printf("##### Number of annotations = %d\n", state.list->count);
+
+    return state.list;
+}
+
+
+/*
+ * Read an annotation document in chunks and compile it as it arrives, with
+ * the settings of the context or the defaults if NULL
+ */
+AnnotationList *
+CompileAnnotationFileContext(AnnotationContext *ctx, FILE *fh, int width, int height)
+{
+    AnnotationParser *parser;
+    CompileState state;
+    int res;
+
+    state.debug = ctx ? ctx->debug : DEFAULT_ANNOTATION_DEBUG;
+    state.list = create_annotation_list(width, height, ctx ? ctx->quality : ANNOTATION_QUALITY_AUTO, NULL);
+    if (!state.list)
+	return NULL;
+
+    parser = CreateAnnotationParser(compile_callback, &state);
+    if (!parser) {
+	ReleaseAnnotation(&state.list);
+	return NULL;
+    }
+
+    res = FeedAnnotationFile(parser, fh);
+    ReleaseAnnotationParser(&parser);
+
+    if (res < 0) {
+	ReleaseAnnotation(&state.list);
+	return NULL;
+    }
+
+    return state.list;
+}
+
+
+AnnotationList *
+CompileAnnotationFile(FILE *fh, int width, int height)
+{
+    return CompileAnnotationFileContext(NULL, fh, width, height);
+}
+
+
+/*
+ * Draw the part of an item within the clip area, a part of its bounds. pts
+ * has room for the polygon vertices when the clip area is not the bounds.
+ */
+static void
+draw_clip(Overlay *ov, DrawItem *item, CvRect clip, CvPoint *pts)
+{
+
+    switch (item->a.op) {
+	case OL_LABEL:
+	    DrawText(ov, item, clip);
+	    break;
+
+	case OL_RECTANGLE:
+	    DrawRectangle(ov, item, clip);
+	    break;
+
+	case OL_LINE:
+	    DrawLine(ov, item, clip);
+	    break;
+
+	case OL_ELLIPSE:
+	    DrawEllipse(ov, item, clip);
+	    break;
+
+	case OL_CIRCLE:
+	    DrawCircle(ov, item, clip);
+	    break;
+
+	case OL_POLYGON:
+	    DrawPolygon(ov, item, clip, pts);
+	    break;
+
+	case OL_HEATMAP:
+	    draw_heatmap(ov, item, clip);
+	    break;
+
+	default:
+	    break;
+    }
+}
+
+
+/*
+ * Draw the clipped item, counted in stats if any
+ */
+static void
+draw_item_stats(Overlay *ov, DrawItem *item, CvRect clip, CvPoint *pts, AnnotationStats *stats)
+{
+    uint64_t start;
+
+    if (item->culled || clip.width <= 0 || clip.height <= 0)
+	return;
+
+    if (!stats) {
+	draw_clip(ov, item, clip, pts);
+	return;
+    }
+
+    start = stats_clock();
+    draw_clip(ov, item, clip, pts);
+    stats->draw_time += stats_clock() - start;
+    stats_item(stats, item, clip, start);
+}
+
+
+void
+draw_item_clip(Overlay *ov, DrawItem *item, CvRect clip, CvPoint *pts)
+{
+    draw_item_stats(ov, item, clip, pts, ov->stats);
+}
+
+
+void
+draw_item(Overlay *ov, DrawItem *item)
+{
+    draw_item_clip(ov, item, item->bounds, NULL);
+}
+
+
+/*
+ * Draw every annotation of a compiled list on the overlay
+ */
+void
+draw_annotation_list(Overlay *ov, AnnotationList *list)
+{
+    DrawItem *item;
+
+    for (item = list->items; item < list->items + list->count; item++)
+	draw_item(ov, item);
+}
+
+
+/*
+ * Draw the items of the list binned to a frame tile, clipped to the tile
+ * and in list order. Only the tile area of the overlay is written, tiles
+ * may be drawn concurrently with one pts buffer and stats each.
+ */
+void
+draw_tile(Overlay *ov, AnnotationList *list, CvRect tile, CvPoint *pts, AnnotationStats *stats)
+{
+    TileBin *bin;
+    DrawItem *item;
+    CvRect clip;
+    int i;
+
+    if (!list->bins)
+	return;
+
+    bin = &list->bins[(tile.y / OVERLAY_TILE_SIZE) * list->tiles_x + tile.x / OVERLAY_TILE_SIZE];
+
+    for (i = 0; i < bin->count; i++) {
+	item = &list->items[bin->items[i]];
+
+	clip.x = (item->bounds.x > tile.x) ? item->bounds.x : tile.x;
+	clip.y = (item->bounds.y > tile.y) ? item->bounds.y : tile.y;
+	clip.width = ((item->bounds.x + item->bounds.width < tile.x + tile.width) ?
+		      item->bounds.x + item->bounds.width : tile.x + tile.width) - clip.x;
+	clip.height = ((item->bounds.y + item->bounds.height < tile.y + tile.height) ?
+		       item->bounds.y + item->bounds.height : tile.y + tile.height) - clip.y;
+
+	draw_item_stats(ov, item, clip, pts, stats);
+    }
+}
+
+
+AnnotationList *
+CompileAnnotation(const char *commands, int width, int height)
+{
+    return compile_annotation(commands, width, height, DEFAULT_ANNOTATION_DEBUG, ANNOTATION_QUALITY_AUTO,
+			      NULL, NULL);
+}
+
+
+/*
+ * Draw a compiled annotation list on an image of the size it was compiled
+ * for: every annotation is drawn on the scratch overlay, which is then
+ * blended onto the image in a single pass over the touched tiles.
+ */
+int
+apply_annotation(Overlay *ov, CvMat *mat, AnnotationList *list)
+{
+    uint64_t start;
+    int res;
+
+    if (!mat || !list)
+	return -1;
+
+    if (mat->cols != list->width || mat->rows != list->height) {
+	fprintf(stderr, "Error: Annotation compiled for %dx%d, image is %dx%d\n",
+		list->width, list->height, mat->cols, mat->rows);
 	return -1;
     }
 
-    d_printf("JSON string: \n %s\n", json_object_to_json_string_ext(jobj, JSON_C_TO_STRING_PRETTY));
+    if (overlay_check_image(mat) < 0)
+	return -1;
 
-    json_object_object_get_ex(jobj, "annotations", &annotations);
-    count = json_object_array_length(annotations);
-    d_printf("##### Number of annotations = %d\n", count);
+    if (ov->stats)
+	ov->stats->frames++;
 
-    for (i = 0; i < count; i++) {
-	obj = json_object_array_get_idx(annotations, i);
-	if (!parse_annotation(obj, &a)) {
-	    /*
-	     * Covert relative coordinates to pixel coordinates
-	     */
-	    for (n = 0; n < a.np; n++) {
-		a.roi[n].x *= mat->cols;
-		a.roi[n].y *= mat->rows;
-		if (a.roi[n].x < 0) a.roi[n].x = 0;
-		if (a.roi[n].x > mat->cols) a.roi[n].x = mat->cols;
-		if (a.roi[n].y < 0) a.roi[n].y = 0;
-		if (a.roi[n].y > mat->rows) a.roi[n].y = mat->rows;
-	    }
+    if (list->count == 0 || list->bounds.width <= 0)
+	return 0;
 
-	    /*
-	     * Clamp the color
-	     */
-	    for (n = 0; n < 4; n++) {
-		a.argb[n] = (a.argb[n] < 0)? 0 : a.argb[n];
-		a.argb[n] = (a.argb[n] > 255)? 255 : a.argb[n];
-		a.fill[n] = (a.fill[n] < 0)? 0 : a.fill[n];
-		a.fill[n] = (a.fill[n] > 255)? 255 : a.fill[n];
-	    }
+    if (overlay_prepare(ov, list->bounds) < 0) {
+	fprintf(stderr, "Error: Failed to allocate annotation overlay\n");
+	return -1;
+    }
 
-	    d_printf("\n");
-	    d_printf("##### op      = %d\n", a.op);
-	    d_printf("##### roi     = [ (%lf, %lf), (%lf, %lf) ]\n", a.roi[0].x, a.roi[0].y, a.roi[1].x, a.roi[1].y);
-	    d_printf("##### phi     = [ %lf, %lf, %lf ]\n", a.phi[0], a.phi[1], a.phi[2]);
-	    d_printf("##### argb    = [ %d, %d, %d, %d ]\n", a.argb[0], a.argb[1], a.argb[2], a.argb[3]);
-	    d_printf("##### fill    = [ %d, %d, %d, %d ]\n", a.fill[0], a.fill[1], a.fill[2], a.fill[3]);
-	    d_printf("##### label   = %s\n", a.label);
-	    d_printf("##### scale   = %lf\n", a.scale);
-	    d_printf("##### bold    = %d\n", a.bold);
-	    d_printf("\n");
-
-	    switch (a.op) {
-		case OL_LABEL:
-		    DrawText(mat, &a);
-		    break;
-
-		case OL_RECTANGLE:
-		    DrawRectangle(mat, &a);
-		    break;
-
-		case OL_LINE:
-		    DrawLine(mat, &a);
-		    break;
-
-		case OL_ELLIPSE:
-		    DrawEllipse(mat, &a);
-		    break;
-
-		case OL_CIRCLE:
-		    DrawCircle(mat, &a);
-		    break;
-
-		case OL_POLYGON:
-		    DrawPolygon(mat, &a);
-		    break;
-
-		default:
-		    break;
-	    }
+    draw_annotation_list(ov, list);
 
-	    if (a.roi)
-		free(a.roi);
-	}
+    /*
+     * Privacy masks change the frame under the overlay, a frame whose
+     * mask failed is not composited and must not be exported
+     */
+    if (mask_image(mat, list, ov) < 0) {
+	overlay_clear(ov);
+	return -1;
     }
+    res = 0;
 
-    return 0;
+    start = ov->stats ? stats_clock() : 0;
+    if (overlay_composite(ov, mat, 0) < 0) {
+	overlay_clear(ov);
+	res = -1;
+    }
+    if (ov->stats)
+	ov->stats->composite_time += stats_clock() - start;
+
+    return res;
 }
 
+
+int
+ApplyAnnotation(CvMat *mat, AnnotationList *list)
+{
+    Overlay ov;
+    int res;
+
+    memset(&ov, 0, sizeof(Overlay));
+    res = apply_annotation(&ov, mat, list);
+    overlay_free(&ov);
+
+    return res;
+}
+
+
+/*
+ * Annotate a raw IYUV or NV12 frame in place, without converting it to BGR:
+ * privacy masks are applied to the planes and the overlay is blended in YUV
+ */
+int
+apply_annotation_buffer(Overlay *ov, unsigned char *buffer, int width, int height, int pixel_format,
+			AnnotationList *list)
+{
+    uint64_t start;
+    int res;
+
+    if (!buffer || !list)
+	return -1;
+
+    if (width != list->width || height != list->height) {
+	fprintf(stderr, "Error: Annotation compiled for %dx%d, image is %dx%d\n",
+		list->width, list->height, width, height);
+	return -1;
+    }
+
+    if (overlay_check_yuv(width, height, pixel_format) < 0)
+	return -1;
+
+    if (ov->stats)
+	ov->stats->frames++;
+
+    if (mask_image_buffer(buffer, width, height, pixel_format, list, ov) < 0)
+	return -1;
+
+    if (list->count == 0 || list->bounds.width <= 0)
+	return 0;
+
+    if (overlay_prepare(ov, list->bounds) < 0) {
+	fprintf(stderr, "Error: Failed to allocate annotation overlay\n");
+	return -1;
+    }
+
+    draw_annotation_list(ov, list);
+
+    /*
+     * The overlay is reused, it must be left transparent even on failure
+     */
+    start = ov->stats ? stats_clock() : 0;
+    res = overlay_composite_yuv(ov, buffer, width, height, pixel_format);
+    if (res < 0)
+	overlay_clear(ov);
+    if (ov->stats)
+	ov->stats->composite_time += stats_clock() - start;
+
+    return res;
+}
+
+
+int
+ApplyAnnotationBuffer(unsigned char *buffer, int width, int height, int pixel_format, AnnotationList *list)
+{
+    Overlay ov;
+    int res;
+
+    memset(&ov, 0, sizeof(Overlay));
+    res = apply_annotation_buffer(&ov, buffer, width, height, pixel_format, list);
+    overlay_free(&ov);
+
+    return res;
+}
+
+
+void
+ReleaseAnnotation(AnnotationList **list)
+{
+    int i;
+
+    if (!list || !*list)
+	return;
+
+    for (i = 0; i < (*list)->count; i++)
+	release_item(&(*list)->items[i], (*list)->arena);
+
+    /*
+     * The memory of lists of a context arena goes with the next frame
+     */
+    if ((*list)->arena) {
+	(*list)->count = 0;
+	*list = NULL;
+	return;
+    }
+
+    if ((*list)->bins) {
+	for (i = 0; i < (*list)->tiles_x * (*list)->tiles_y; i++)
+	    free((*list)->bins[i].items);
+	free((*list)->bins);
+    }
+
+    free((*list)->items);
+    free(*list);
+    *list = NULL;
+}
+
+
+int
+AnnotateImage(CvMat *mat, char *commands)
+{
+    AnnotationList *list;
+    int res;
+
+    list = CompileAnnotation(commands, mat->cols, mat->rows);
+    if (!list)
+	return -1;
+
+    res = ApplyAnnotation(mat, list);
+    ReleaseAnnotation(&list);
+
+    return res;
+}
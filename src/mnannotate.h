@@ -20,6 +20,7 @@
 #include <opencv2/videoio/videoio_c.h>
 #include <opencv2/highgui/highgui_c.h>
 #include <json-c/json.h>
+#include <stdint.h>
 
 #define PIXEL_FORMAT_NONE	0	/* Default none */
 #define PIXEL_FORMAT_IYUV	1 	/* YUV420: e.g. mpeg decoder output */
@@ -32,9 +33,29 @@
 #define OL_CIRCLE		3
 #define OL_ELLIPSE		4
 #define OL_POLYGON		5
+#define OL_HEATMAP		6	/* Grid of values stretched over the ROI rectangle */
+#define OL_BLUR			7	/* Privacy masks of the ROI rectangle or polygon, */
+#define OL_PIXELATE		8	/* bold is the blur width or block size */
 
+#define ANNOTATION_OP_COUNT	9
 
-#define MAX_ANNOTATION_STRING_LEN	10*1024
+#define HEATMAP_COLORMAP_JET		0
+#define HEATMAP_COLORMAP_HOT		1
+#define HEATMAP_COLORMAP_GRAY		2
+#define HEATMAP_COLORMAP_MONO		3	/* ARGB color, the value is the coverage */
+
+/*
+ * Rasterization quality of an annotation, automatic draws smaller frames
+ * than ANNOTATION_AUTO_FAST_PIXELS fast and larger ones antialiased
+ */
+#define ANNOTATION_QUALITY_AUTO		0
+#define ANNOTATION_QUALITY_AA		1	/* Antialiased */
+#define ANNOTATION_QUALITY_FAST		2	/* 8-connected */
+
+#define ANNOTATION_AUTO_FAST_PIXELS	(640*360)
+
+
+#define MAX_ANNOTATION_STRING_LEN	10*1024	/* Legacy, documents are streamed */
 
 typedef struct _point {
     double x;
@@ -52,9 +73,178 @@ typedef struct _annotation {
     char *label;		/* Text string */
     double scale;		/* Scale ratio */
     int bold;			/* Thickness of the line of text */
+    int quality;		/* ANNOTATION_QUALITY_* */
+    unsigned char *grid;	/* Heatmap values, grid_width x grid_height */
+    int grid_width, grid_height;
+    int colormap;		/* HEATMAP_COLORMAP_* */
 } Annotation;
 
 
+/*
+ * Binary annotation document: a header followed by count records, each a
+ * record header, np points as float or 16-bit fixed point (0..65535 for
+ * 0..1) pairs, then label_size bytes of NUL terminated label, padded to 4
+ * bytes. Fields are in host byte order.
+ */
+#define ANNOTATION_BINARY_MAGIC		"MNAB"
+#define ANNOTATION_BINARY_VERSION	1
+#define ANNOTATION_BINARY_FIXED		0x0001	/* Points in fixed point */
+
+typedef struct _annotation_binary_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t flags;
+    uint32_t count;		/* Number of records */
+    uint32_t size;		/* Size of the document in bytes */
+} AnnotationBinaryHeader;
+
+typedef struct _annotation_record {
+    uint8_t op;
+    uint8_t quality;
+    uint16_t np;		/* Number of points */
+    uint8_t argb[4];
+    uint8_t fill[4];
+    int16_t bold;
+    uint16_t label_size;	/* Label bytes with the NUL, 0 for none */
+    float scale;
+    float phi[3];
+} AnnotationRecord;
+
+
+/*
+ * Annotation request compiled for a frame size, see CompileAnnotation()
+ */
+typedef struct _annotation_list AnnotationList;
+
+
+/*
+ * Cache of overlays pre-rendered from static annotation documents, see
+ * AnnotateImageCached()
+ */
+typedef struct _annotation_cache AnnotationCache;
+
+
+/*
+ * Reentrant annotation state with a worker pool, one per thread or service,
+ * see CreateAnnotationContext()
+ */
+typedef struct _annotation_context AnnotationContext;
+
+
+/*
+ * Counters of an annotation operation, see EnableAnnotationStats()
+ */
+typedef struct _annotation_op_stats {
+    uint64_t compiled;		/* Annotations compiled */
+    uint64_t drawn;		/* Items drawn or masked, once per tile when tiled */
+    uint64_t pixels;		/* Frame pixels of the areas drawn or masked */
+    uint64_t time;		/* Nanoseconds drawing or masking */
+} AnnotationOpStats;
+
+/*
+ * Performance counters of a context, times are in nanoseconds summed over
+ * the workers
+ */
+typedef struct _annotation_stats {
+    uint64_t lists;		/* Lists compiled */
+    uint64_t frames;		/* Images annotated */
+    uint64_t parse_time;	/* Compiling the lists */
+    uint64_t mask_time;		/* Privacy masks on the images */
+    uint64_t draw_time;		/* Drawing on the overlays */
+    uint64_t composite_time;	/* Blending the overlays onto the images */
+    uint64_t composite_bytes;	/* Image bytes blended */
+    AnnotationOpStats ops[ANNOTATION_OP_COUNT];
+} AnnotationStats;
+
+
+/*
+ * Incremental annotation document parser, see CreateAnnotationParser().
+ * The callback gets each annotation as its object completes; it may keep
+ * the ROI and label by setting them to NULL, and stops parsing by
+ * returning a negative value.
+ */
+typedef struct _annotation_parser AnnotationParser;
+typedef int (*AnnotationCallback)(void *data, Annotation *a);
+
+
+/*
+ * Time-keyed annotations of a document "tracks" array, each shown over a
+ * time range at a position interpolated between keys, see
+ * LoadAnnotationTracks()
+ */
+typedef struct _annotation_tracks AnnotationTracks;
+
+
+/*
+ * Raw image file mapped in memory, a sequence of concatenated frames of
+ * one size and pixel format, see OpenRawImageFile()
+ */
+typedef struct _raw_image_file RawImageFile;
+
+
 CvMat *LoadImageFile(const char *filename, int width, int height, int pixel_format);
 CvMat *LoadImageBuffer(unsigned char *buffer, int width, int height, int pixel_format);
+size_t ImageBufferSize(int width, int height, int pixel_format);
+int LoadImageBufferInto(CvMat *dst, const unsigned char *buffer, int width, int height, int pixel_format);
+int LoadImageFileInto(CvMat *dst, const char *filename, int width, int height, int pixel_format,
+		      unsigned char *staging, size_t staging_size);
+RawImageFile *OpenRawImageFile(const char *filename, int width, int height, int pixel_format);
+void CloseRawImageFile(RawImageFile **raw);
+int RawImageFileFrames(RawImageFile *raw);
+const unsigned char *RawImageFileFrame(RawImageFile *raw, int index);
+int LoadRawImageFrameInto(CvMat *dst, RawImageFile *raw, int index);
+int ApplyAnnotationBuffer(unsigned char *buffer, int width, int height, int pixel_format, AnnotationList *list);
+int MaskImageBuffer(unsigned char *buffer, int width, int height, int pixel_format, AnnotationList *list);
 int AnnotateImage(CvMat *mat, char *commands);
+
+AnnotationList *CompileAnnotation(const char *commands, int width, int height);
+int ApplyAnnotation(CvMat *mat, AnnotationList *list);
+void ReleaseAnnotation(AnnotationList **list);
+
+AnnotationCache *CreateAnnotationCache(AnnotationContext *ctx, int max_sprites);
+void ReleaseAnnotationCache(AnnotationCache **cache);
+int AnnotateImageCached(CvMat *mat, AnnotationCache *cache, const char *id, const char *commands,
+			AnnotationList *dynamic);
+
+AnnotationParser *CreateAnnotationParser(AnnotationCallback callback, void *data);
+int FeedAnnotationParser(AnnotationParser *parser, const char *buffer, size_t length);
+int FinishAnnotationParser(AnnotationParser *parser);
+int FeedAnnotationFile(AnnotationParser *parser, FILE *fh);
+void ReleaseAnnotationParser(AnnotationParser **parser);
+AnnotationList *CompileAnnotationFile(FILE *fh, int width, int height);
+AnnotationList *CompileAnnotationFileContext(AnnotationContext *ctx, FILE *fh, int width, int height);
+int AnnotateImageFile(CvMat *mat, FILE *fh);
+int AnnotateImageFileContext(AnnotationContext *ctx, CvMat *mat, FILE *fh);
+
+AnnotationList *CompileAnnotationBinary(const void *data, size_t size, int width, int height);
+AnnotationList *CompileAnnotationBinaryFile(const char *filename, int width, int height);
+AnnotationList *CompileAnnotationBinaryFileContext(AnnotationContext *ctx, const char *filename,
+						   int width, int height);
+int EncodeAnnotationBinary(const char *commands, int flags, void **data, size_t *size);
+char *DecodeAnnotationBinary(const void *data, size_t size);
+
+AnnotationTracks *LoadAnnotationTracks(const char *document);
+AnnotationList *CompileAnnotationTracks(AnnotationTracks *tracks, int64_t time, int width, int height);
+void ReleaseAnnotationTracks(AnnotationTracks **tracks);
+
+AnnotationContext *CreateAnnotationContext(int num_threads);
+void ReleaseAnnotationContext(AnnotationContext **ctx);
+void SetAnnotationDebug(AnnotationContext *ctx, int debug);
+void SetAnnotationQuality(AnnotationContext *ctx, int quality);
+int ParseAnnotationQuality(const char *str);
+AnnotationList *CompileAnnotationContext(AnnotationContext *ctx, const char *commands, int width, int height);
+AnnotationList *CompileAnnotationFrame(AnnotationContext *ctx, const char *commands, int width, int height);
+AnnotationList *CompileAnnotationBinaryFrame(AnnotationContext *ctx, const void *data, size_t size,
+					    int width, int height);
+AnnotationList *CompileAnnotationTracksFrame(AnnotationContext *ctx, AnnotationTracks *tracks, int64_t time,
+					    int width, int height);
+int ApplyAnnotationContext(AnnotationContext *ctx, CvMat *mat, AnnotationList *list);
+int ApplyAnnotationBufferContext(AnnotationContext *ctx, unsigned char *buffer, int width, int height,
+				 int pixel_format, AnnotationList *list);
+int AnnotateImageBatch(AnnotationContext *ctx, CvMat **mats, AnnotationList **lists, int count);
+
+void EnableAnnotationStats(AnnotationContext *ctx, int enable);
+void ResetAnnotationStats(AnnotationContext *ctx);
+int GetAnnotationStats(AnnotationContext *ctx, AnnotationStats *stats);
+void MergeAnnotationStats(AnnotationContext *ctx, AnnotationContext *from);
+char *DumpAnnotationStats(AnnotationContext *ctx);
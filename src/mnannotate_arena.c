@@ -0,0 +1,205 @@
+/*
+ * This file is part of media-utis
+ *
+ * Media-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Media-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with media-utils; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mnannotate_priv.h"
+
+#define ARENA_BLOCK_SIZE	(64*1024)
+#define ARENA_ALIGN		16
+
+#define ARENA_ROUND(n)		(((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_HEADER		ARENA_ROUND(sizeof(ArenaBlock))
+#define ARENA_DATA(block)	((unsigned char *)(block) + ARENA_HEADER)
+
+
+/*
+ * Every allocator below works on the heap when the arena is NULL, so the
+ * compile path is the same for lists released one by one and for lists of
+ * a context arena.
+ */
+
+static ArenaBlock *
+arena_new_block(AnnotationArena *arena, size_t size)
+{
+    ArenaBlock *block;
+
+    block = (ArenaBlock *)malloc(ARENA_HEADER + size);
+    if (!block)
+	return NULL;
+
+    block->next = arena->blocks;
+    block->size = size;
+    block->used = 0;
+    arena->blocks = block;
+    arena->total += size;
+
+    return block;
+}
+
+
+void *
+arena_alloc(AnnotationArena *arena, size_t size)
+{
+    ArenaBlock *block;
+    size_t block_size;
+    void *p;
+
+    if (!arena)
+	return malloc(size);
+
+    size = ARENA_ROUND(size ? size : 1);
+    block = arena->blocks;
+
+    if (!block || block->used + size > block->size) {
+	/*
+	 * Blocks double so a frame needs few of them, and a reset merges them
+	 */
+	block_size = (arena->total > ARENA_BLOCK_SIZE) ? arena->total : ARENA_BLOCK_SIZE;
+	if (block_size < size)
+	    block_size = size;
+	block = arena_new_block(arena, block_size);
+	if (!block)
+	    return NULL;
+    }
+
+    p = ARENA_DATA(block) + block->used;
+    block->used += size;
+    arena->last = p;
+
+    return p;
+}
+
+
+void *
+arena_calloc(AnnotationArena *arena, size_t count, size_t size)
+{
+    void *p;
+
+    if (!arena)
+	return calloc(count, size);
+
+    p = arena_alloc(arena, count * size);
+    if (p)
+	memset(p, 0, count * size);
+
+    return p;
+}
+
+
+/*
+ * Grow an allocation, in place if it is the last one of the arena
+ */
+void *
+arena_realloc(AnnotationArena *arena, void *ptr, size_t old_size, size_t size)
+{
+    ArenaBlock *block;
+    size_t offset;
+    void *p;
+
+    if (!arena)
+	return realloc(ptr, size);
+
+    if (!ptr)
+	return arena_alloc(arena, size);
+
+    block = arena->blocks;
+    if (ptr == arena->last) {
+	offset = (unsigned char *)ptr - ARENA_DATA(block);
+	if (offset + ARENA_ROUND(size) <= block->size) {
+	    block->used = offset + ARENA_ROUND(size);
+	    return ptr;
+	}
+    }
+
+    p = arena_alloc(arena, size);
+    if (p)
+	memcpy(p, ptr, (old_size < size) ? old_size : size);
+
+    return p;
+}
+
+
+char *
+arena_strdup(AnnotationArena *arena, const char *s)
+{
+    size_t length = strlen(s) + 1;
+    char *p;
+
+    p = (char *)arena_alloc(arena, length);
+    if (p)
+	memcpy(p, s, length);
+
+    return p;
+}
+
+
+/*
+ * Allocations of an arena go all at once with arena_reset()
+ */
+void
+arena_free(AnnotationArena *arena, void *ptr)
+{
+    if (!arena)
+	free(ptr);
+}
+
+
+/*
+ * Make the whole arena available again. The blocks a frame needed are
+ * merged into one, so a steady stream of frames stops allocating.
+ */
+void
+arena_reset(AnnotationArena *arena)
+{
+    ArenaBlock *block, *next;
+    size_t total = arena->total;
+
+    if (arena->blocks && arena->blocks->next) {
+	for (block = arena->blocks; block; block = next) {
+	    next = block->next;
+	    free(block);
+	}
+	arena->blocks = NULL;
+	arena->total = 0;
+
+	/*
+	 * Without the merged block, the next frame starts over with small
+	 * blocks
+	 */
+	arena_new_block(arena, total);
+    }
+
+    if (arena->blocks)
+	arena->blocks->used = 0;
+    arena->last = NULL;
+}
+
+
+void
+arena_destroy(AnnotationArena *arena)
+{
+    ArenaBlock *block, *next;
+
+    for (block = arena->blocks; block; block = next) {
+	next = block->next;
+	free(block);
+    }
+    memset(arena, 0, sizeof(AnnotationArena));
+}
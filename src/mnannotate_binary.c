@@ -0,0 +1,465 @@
+/*
+ * This file is part of media-utis
+ *
+ * Media-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Media-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with media-utils; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mnannotate_priv.h"
+
+#define FIXED_ONE		65535.0		/* 1.0 in fixed point coordinates */
+
+#define RECORD_ALIGN(n)		(((n) + 3) & ~3)
+
+
+static size_t
+point_size(int flags)
+{
+    return (flags & ANNOTATION_BINARY_FIXED) ? 2*sizeof(uint16_t) : 2*sizeof(float);
+}
+
+
+static int
+check_header(const AnnotationBinaryHeader *header, size_t size)
+{
+    if (size < sizeof(AnnotationBinaryHeader) || memcmp(header->magic, ANNOTATION_BINARY_MAGIC, 4)) {
+	fprintf(stderr, "Error: Not a binary annotation document\n");
+	return -1;
+    }
+
+    if (header->version != ANNOTATION_BINARY_VERSION) {
+	fprintf(stderr, "Error: Unsupported binary annotation version %d\n", header->version);
+	return -1;
+    }
+
+    if (header->size < sizeof(AnnotationBinaryHeader) || header->size > size) {
+	fprintf(stderr, "Error: Binary annotation document is truncated\n");
+	return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Load the record at offset into an annotation, with its own ROI and label
+ * allocated from the arena or the heap if NULL. Return the offset of the
+ * next record, or 0 if the record is damaged.
+ */
+static size_t
+load_record(const unsigned char *data, size_t size, size_t offset, int flags, Annotation *a,
+	    AnnotationArena *arena)
+{
+    const AnnotationRecord *r;
+    const unsigned char *p;
+    const float *fp;
+    const uint16_t *xp;
+    size_t length;
+    int i;
+
+    if (offset + sizeof(AnnotationRecord) > size)
+	return 0;
+
+    r = (const AnnotationRecord *)(data + offset);
+    length = sizeof(AnnotationRecord) + r->np * point_size(flags) + r->label_size;
+    if (offset + length > size)
+	return 0;
+
+    memset(a, 0, sizeof(Annotation));
+    a->op = r->op;
+    a->quality = r->quality;
+    a->np = r->np;
+    a->bold = r->bold;
+    a->scale = r->scale;
+    for (i = 0; i < 3; i++)
+	a->phi[i] = r->phi[i];
+    for (i = 0; i < 4; i++) {
+	a->argb[i] = r->argb[i];
+	a->fill[i] = r->fill[i];
+    }
+
+    p = (const unsigned char *)(r + 1);
+
+    if (r->np) {
+	a->roi = (Point *)arena_alloc(arena, r->np * sizeof(Point));
+	if (!a->roi)
+	    return 0;
+
+	if (flags & ANNOTATION_BINARY_FIXED) {
+	    xp = (const uint16_t *)p;
+	    for (i = 0; i < r->np; i++) {
+		a->roi[i].x = xp[2*i] / FIXED_ONE;
+		a->roi[i].y = xp[2*i + 1] / FIXED_ONE;
+	    }
+	} else {
+	    fp = (const float *)p;
+	    for (i = 0; i < r->np; i++) {
+		a->roi[i].x = fp[2*i];
+		a->roi[i].y = fp[2*i + 1];
+	    }
+	}
+	p += r->np * point_size(flags);
+    }
+
+    if (r->label_size) {
+	a->label = (char *)arena_alloc(arena, r->label_size + 1);
+	if (!a->label) {
+	    release_annotation(a, arena);
+	    return 0;
+	}
+	memcpy(a->label, p, r->label_size);
+	a->label[r->label_size] = '\0';
+    }
+
+    return offset + RECORD_ALIGN(length);
+}
+
+
+/*
+ * Compile a binary annotation document for a frame size, allocated from the
+ * arena or the heap if NULL
+ */
+AnnotationList *
+compile_annotation_binary(const void *data, size_t size, int width, int height, int quality,
+			  AnnotationArena *arena)
+{
+    const AnnotationBinaryHeader *header = (const AnnotationBinaryHeader *)data;
+    AnnotationList *list;
+    Annotation a;
+    size_t offset;
+    uint32_t i;
+
+    if (!data || check_header(header, size) < 0)
+	return NULL;
+
+    list = create_annotation_list(width, height, quality, arena);
+    if (!list)
+	return NULL;
+
+    offset = sizeof(AnnotationBinaryHeader);
+    for (i = 0; i < header->count; i++) {
+	offset = load_record((const unsigned char *)data, header->size, offset, header->flags, &a, arena);
+	if (!offset) {
+	    fprintf(stderr, "Error: Damaged binary annotation record %u\n", i);
+	    ReleaseAnnotation(&list);
+	    return NULL;
+	}
+
+	/*
+	 * High rate producers use this format, keep it quiet
+	 */
+	if (list_add_annotation(list, &a, 0) < 0) {
+	    release_annotation(&a, arena);
+	    ReleaseAnnotation(&list);
+	    return NULL;
+	}
+	release_annotation(&a, arena);
+    }
+
+    return list;
+}
+
+
+/*
+ * Compile a binary annotation document, e.g. a mapped file, for a frame
+ * size. See CompileAnnotationBinaryFrame() to compile frame after frame
+ * without allocating.
+ */
+AnnotationList *
+CompileAnnotationBinary(const void *data, size_t size, int width, int height)
+{
+    return compile_annotation_binary(data, size, width, height, ANNOTATION_QUALITY_AUTO, NULL);
+}
+
+
+/*
+ * Compile a binary annotation file with the quality of the context, or the
+ * one of each annotation if NULL
+ */
+AnnotationList *
+CompileAnnotationBinaryFileContext(AnnotationContext *ctx, const char *filename, int width, int height)
+{
+    AnnotationList *list;
+    struct stat sb;
+    void *data;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+	fprintf(stderr, "Error: Failed to open annotation file %s\n", filename);
+	return NULL;
+    }
+
+    if (fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof(AnnotationBinaryHeader)) {
+	close(fd);
+	return NULL;
+    }
+
+    data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+	return NULL;
+
+    list = compile_annotation_binary(data, sb.st_size, width, height,
+				     ctx ? ctx->quality : ANNOTATION_QUALITY_AUTO, NULL);
+    munmap(data, sb.st_size);
+
+    return list;
+}
+
+
+AnnotationList *
+CompileAnnotationBinaryFile(const char *filename, int width, int height)
+{
+    return CompileAnnotationBinaryFileContext(NULL, filename, width, height);
+}
+
+
+/*
+ * Binary document being encoded
+ */
+typedef struct _binary_writer {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    int flags;
+    uint32_t count;
+} BinaryWriter;
+
+
+static int
+encode_callback(void *arg, Annotation *a)
+{
+    BinaryWriter *w = (BinaryWriter *)arg;
+    AnnotationRecord *r;
+    unsigned char *data, *p;
+    float *fp;
+    uint16_t *xp;
+    size_t label_size, length, capacity;
+    double v;
+    int i, np;
+
+    /*
+     * Records have no room for heatmap grids
+     */
+    if (a->op == OL_HEATMAP) {
+	fprintf(stderr, "Warning: Skip heatmap annotation in binary document\n");
+	return 0;
+    }
+
+    np = (a->np > 0xffff) ? 0xffff : a->np;
+    label_size = a->label ? strlen(a->label) + 1 : 0;
+    if (label_size > 0xffff)
+	label_size = 0xffff;
+    length = RECORD_ALIGN(sizeof(AnnotationRecord) + np * point_size(w->flags) + label_size);
+
+    if (w->size + length > w->capacity) {
+	capacity = w->capacity ? w->capacity : 4096;
+	while (w->size + length > capacity)
+	    capacity *= 2;
+	data = (unsigned char *)realloc(w->data, capacity);
+	if (!data)
+	    return -1;
+	w->data = data;
+	w->capacity = capacity;
+    }
+
+    r = (AnnotationRecord *)(w->data + w->size);
+    memset(r, 0, length);
+    r->op = a->op;
+    r->quality = a->quality;
+    r->np = np;
+    r->bold = a->bold;
+    r->label_size = label_size;
+    r->scale = a->scale;
+    for (i = 0; i < 3; i++)
+	r->phi[i] = a->phi[i];
+    for (i = 0; i < 4; i++) {
+	r->argb[i] = (a->argb[i] < 0) ? 0 : (a->argb[i] > 255) ? 255 : a->argb[i];
+	r->fill[i] = (a->fill[i] < 0) ? 0 : (a->fill[i] > 255) ? 255 : a->fill[i];
+    }
+
+    p = (unsigned char *)(r + 1);
+    if (w->flags & ANNOTATION_BINARY_FIXED) {
+	/*
+	 * Relative coordinates are clamped to [0, 1] when compiled anyway
+	 */
+	xp = (uint16_t *)p;
+	for (i = 0; i < 2*np; i++) {
+	    v = (i & 1) ? a->roi[i/2].y : a->roi[i/2].x;
+	    v = (v < 0) ? 0 : (v > 1) ? 1 : v;
+	    xp[i] = (uint16_t)(v * FIXED_ONE + 0.5);
+	}
+    } else {
+	fp = (float *)p;
+	for (i = 0; i < np; i++) {
+	    fp[2*i] = a->roi[i].x;
+	    fp[2*i + 1] = a->roi[i].y;
+	}
+    }
+    p += np * point_size(w->flags);
+
+    if (label_size) {
+	memcpy(p, a->label, label_size - 1);
+	p[label_size - 1] = '\0';
+    }
+
+    w->size += length;
+    w->count++;
+
+    return 0;
+}
+
+
+/*
+ * Encode a JSON annotation document into a binary one, allocated for the
+ * caller. ANNOTATION_BINARY_FIXED stores points in 16-bit fixed point.
+ */
+int
+EncodeAnnotationBinary(const char *commands, int flags, void **data, size_t *size)
+{
+    AnnotationParser *parser;
+    AnnotationBinaryHeader *header;
+    BinaryWriter w;
+    int res;
+
+    if (!commands || !data || !size)
+	return -1;
+
+    memset(&w, 0, sizeof(BinaryWriter));
+    w.flags = flags & ANNOTATION_BINARY_FIXED;
+    w.capacity = 4096;
+    w.data = (unsigned char *)malloc(w.capacity);
+    if (!w.data)
+	return -1;
+    w.size = sizeof(AnnotationBinaryHeader);
+
+    parser = CreateAnnotationParser(encode_callback, &w);
+    if (!parser) {
+	free(w.data);
+	return -1;
+    }
+
+    res = FeedAnnotationParser(parser, commands, strlen(commands));
+    if (res == 0)
+	res = FinishAnnotationParser(parser);
+    ReleaseAnnotationParser(&parser);
+
+    if (res < 0) {
+	free(w.data);
+	return -1;
+    }
+
+    header = (AnnotationBinaryHeader *)w.data;
+    memset(header, 0, sizeof(AnnotationBinaryHeader));
+    memcpy(header->magic, ANNOTATION_BINARY_MAGIC, 4);
+    header->version = ANNOTATION_BINARY_VERSION;
+    header->flags = w.flags;
+    header->count = w.count;
+    header->size = w.size;
+
+    *data = w.data;
+    *size = w.size;
+
+    return 0;
+}
+
+
+static json_object *
+color_array(const int *color)
+{
+    json_object *array;
+    int i;
+
+    array = json_object_new_array();
+    for (i = 0; i < 4; i++)
+	json_object_array_add(array, json_object_new_int(color[i]));
+
+    return array;
+}
+
+
+/*
+ * Decode a binary annotation document into the JSON schema, the returned
+ * string is freed by the caller
+ */
+char *
+DecodeAnnotationBinary(const void *data, size_t size)
+{
+    const AnnotationBinaryHeader *header = (const AnnotationBinaryHeader *)data;
+    json_object *jobj, *annotations, *obj, *roi, *point, *phi;
+    Annotation a;
+    size_t offset;
+    uint32_t i;
+    int n;
+    char *str;
+
+    if (!data || check_header(header, size) < 0)
+	return NULL;
+
+    jobj = json_object_new_object();
+    annotations = json_object_new_array();
+    json_object_object_add(jobj, "annotations", annotations);
+
+    offset = sizeof(AnnotationBinaryHeader);
+    for (i = 0; i < header->count; i++) {
+	offset = load_record((const unsigned char *)data, header->size, offset, header->flags, &a, NULL);
+	if (!offset) {
+	    fprintf(stderr, "Error: Damaged binary annotation record %u\n", i);
+	    json_object_put(jobj);
+	    return NULL;
+	}
+
+	obj = json_object_new_object();
+	json_object_object_add(obj, "op", json_object_new_int(a.op));
+
+	roi = json_object_new_array();
+	for (n = 0; n < a.np; n++) {
+	    point = json_object_new_object();
+	    json_object_object_add(point, "x", json_object_new_double(a.roi[n].x));
+	    json_object_object_add(point, "y", json_object_new_double(a.roi[n].y));
+	    json_object_array_add(roi, point);
+	}
+	json_object_object_add(obj, "roi", roi);
+
+	phi = json_object_new_array();
+	for (n = 0; n < 3; n++)
+	    json_object_array_add(phi, json_object_new_double(a.phi[n]));
+	json_object_object_add(obj, "phi", phi);
+
+	json_object_object_add(obj, "argb", color_array(a.argb));
+	json_object_object_add(obj, "fill", color_array(a.fill));
+	if (a.label)
+	    json_object_object_add(obj, "label", json_object_new_string(a.label));
+	json_object_object_add(obj, "scale", json_object_new_double(a.scale));
+	json_object_object_add(obj, "bold", json_object_new_int(a.bold));
+	if (a.quality)
+	    json_object_object_add(obj, "q", json_object_new_int(a.quality));
+
+	json_object_array_add(annotations, obj);
+	release_annotation(&a, NULL);
+    }
+
+    str = strdup(json_object_to_json_string(jobj));
+    json_object_put(jobj);
+
+    return str;
+}
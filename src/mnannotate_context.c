@@ -0,0 +1,502 @@
+/*
+ * This file is part of media-utis
+ *
+ * Media-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Media-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with media-utils; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mnannotate_priv.h"
+
+
+/*
+ * Annotate the i-th frame of the batch with the overlay of the worker
+ */
+static int
+frame_job(AnnotationContext *ctx, AnnotationWorker *w, int i)
+{
+    if (!ctx->mats[i] || !ctx->lists[i])
+	return 0;
+
+    w->scratch.stats = ctx->stats ? &w->stats : NULL;
+
+    return apply_annotation(&w->scratch, ctx->mats[i], ctx->lists[i]);
+}
+
+
+/*
+ * Draw and composite the i-th tile of the overlay of the calling thread,
+ * shared by the workers for the single frame of the batch
+ */
+static int
+tile_job(AnnotationContext *ctx, AnnotationWorker *w, int i)
+{
+    Overlay *ov = &ctx->workers[0].scratch;
+    AnnotationStats *stats = ctx->stats ? &w->stats : NULL;
+    CvRect tile;
+    uint64_t start;
+    size_t bytes;
+    int tx = i % ov->tiles_x, ty = i / ov->tiles_x;
+
+    tile.x = ov->area.x + tx * OVERLAY_TILE_SIZE;
+    tile.y = ov->area.y + ty * OVERLAY_TILE_SIZE;
+    tile.width = ov->area.x + ov->area.width - tile.x;
+    tile.height = ov->area.y + ov->area.height - tile.y;
+    if (tile.width > OVERLAY_TILE_SIZE)
+	tile.width = OVERLAY_TILE_SIZE;
+    if (tile.height > OVERLAY_TILE_SIZE)
+	tile.height = OVERLAY_TILE_SIZE;
+
+    draw_tile(ov, ctx->lists[0], tile, w->pts, stats);
+
+    /*
+     * The overlay is shared, the worker counts its tiles
+     */
+    start = stats ? stats_clock() : 0;
+    bytes = overlay_composite_tile(ov, ctx->mats[0], tx, ty);
+    if (stats) {
+	stats->composite_time += stats_clock() - start;
+	stats->composite_bytes += bytes;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Run jobs of the current batch until none is left
+ */
+static void
+context_run(AnnotationContext *ctx, AnnotationWorker *w)
+{
+    int i;
+
+    for (;;) {
+	pthread_mutex_lock(&ctx->lock);
+	i = ctx->next++;
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (i >= ctx->count)
+	    break;
+
+	if (ctx->job(ctx, w, i) < 0) {
+	    pthread_mutex_lock(&ctx->lock);
+	    ctx->failed++;
+	    pthread_mutex_unlock(&ctx->lock);
+	}
+    }
+}
+
+
+/*
+ * Run count jobs across the worker pool and the calling thread, return the
+ * number of failed ones
+ */
+static int
+context_dispatch(AnnotationContext *ctx, AnnotationJob job, CvMat **mats, AnnotationList **lists, int count)
+{
+    int failed;
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->job = job;
+    ctx->mats = mats;
+    ctx->lists = lists;
+    ctx->count = count;
+    ctx->next = 0;
+    ctx->failed = 0;
+    ctx->active = ctx->num_workers - 1;
+    ctx->generation++;
+    pthread_cond_broadcast(&ctx->start);
+    pthread_mutex_unlock(&ctx->lock);
+
+    context_run(ctx, &ctx->workers[0]);
+
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->active > 0)
+	pthread_cond_wait(&ctx->done, &ctx->lock);
+    failed = ctx->failed;
+    ctx->job = NULL;
+    ctx->mats = NULL;
+    ctx->lists = NULL;
+    ctx->count = 0;
+    pthread_mutex_unlock(&ctx->lock);
+
+    return failed;
+}
+
+
+static void *
+context_worker(void *arg)
+{
+    AnnotationWorker *w = (AnnotationWorker *)arg;
+    AnnotationContext *ctx = w->ctx;
+    unsigned int generation = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+
+    for (;;) {
+	while (!ctx->quit && ctx->generation == generation)
+	    pthread_cond_wait(&ctx->start, &ctx->lock);
+
+	if (ctx->quit)
+	    break;
+
+	generation = ctx->generation;
+	pthread_mutex_unlock(&ctx->lock);
+
+	context_run(ctx, w);
+
+	pthread_mutex_lock(&ctx->lock);
+	if (--ctx->active == 0)
+	    pthread_cond_signal(&ctx->done);
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    return NULL;
+}
+
+
+/*
+ * Create an annotation context with a pool of num_threads workers, the
+ * calling thread being one of them. num_threads <= 0 uses every online core.
+ */
+AnnotationContext *
+CreateAnnotationContext(int num_threads)
+{
+    AnnotationContext *ctx;
+    int i;
+
+    if (num_threads <= 0)
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads <= 0)
+	num_threads = 1;
+
+    ctx = (AnnotationContext *)calloc(1, sizeof(AnnotationContext));
+    if (!ctx)
+	return NULL;
+
+    ctx->debug = DEFAULT_ANNOTATION_DEBUG;
+    ctx->workers = (AnnotationWorker *)calloc(num_threads, sizeof(AnnotationWorker));
+    if (!ctx->workers) {
+	free(ctx);
+	return NULL;
+    }
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->start, NULL);
+    pthread_cond_init(&ctx->done, NULL);
+
+    ctx->workers[0].ctx = ctx;
+    ctx->num_workers = 1;
+
+    for (i = 1; i < num_threads; i++) {
+	ctx->workers[i].ctx = ctx;
+	if (pthread_create(&ctx->workers[i].thread, NULL, context_worker, &ctx->workers[i]) != 0) {
+	    fprintf(stderr, "Warning: Only %d annotation threads could be started\n", i);
+	    break;
+	}
+	ctx->num_workers++;
+    }
+
+    return ctx;
+}
+
+
+void
+ReleaseAnnotationContext(AnnotationContext **ctx)
+{
+    AnnotationContext *c;
+    int i;
+
+    if (!ctx || !*ctx)
+	return;
+
+    c = *ctx;
+
+    pthread_mutex_lock(&c->lock);
+    c->quit = 1;
+    pthread_cond_broadcast(&c->start);
+    pthread_mutex_unlock(&c->lock);
+
+    for (i = 1; i < c->num_workers; i++)
+	pthread_join(c->workers[i].thread, NULL);
+
+    for (i = 0; i < c->num_workers; i++) {
+	overlay_free(&c->workers[i].scratch);
+	free(c->workers[i].pts);
+    }
+
+    pthread_cond_destroy(&c->done);
+    pthread_cond_destroy(&c->start);
+    pthread_mutex_destroy(&c->lock);
+
+    ReleaseAnnotation(&c->frame);
+    ReleaseAnnotationParser(&c->parser);
+    arena_destroy(&c->arena);
+    glyph_atlas_release_idle();
+    free(c->workers);
+    free(c);
+    *ctx = NULL;
+}
+
+
+void
+SetAnnotationDebug(AnnotationContext *ctx, int debug)
+{
+    if (ctx)
+	ctx->debug = debug;
+}
+
+
+/*
+ * Force a quality on every annotation the context compiles from now on, or
+ * let each one choose with ANNOTATION_QUALITY_AUTO
+ */
+void
+SetAnnotationQuality(AnnotationContext *ctx, int quality)
+{
+    if (ctx)
+	ctx->quality = quality;
+}
+
+
+/*
+ * Quality of a command line name, aa, fast or auto. Return -1 for anything
+ * else.
+ */
+int
+ParseAnnotationQuality(const char *str)
+{
+    if (!strcmp(str, "aa"))
+	return ANNOTATION_QUALITY_AA;
+    if (!strcmp(str, "fast"))
+	return ANNOTATION_QUALITY_FAST;
+    if (!strcmp(str, "auto"))
+	return ANNOTATION_QUALITY_AUTO;
+
+    return -1;
+}
+
+
+AnnotationList *
+CompileAnnotationContext(AnnotationContext *ctx, const char *commands, int width, int height)
+{
+    AnnotationList *list;
+    uint64_t start;
+
+    if (!ctx || !ctx->stats)
+	return compile_annotation(commands, width, height, ctx ? ctx->debug : DEFAULT_ANNOTATION_DEBUG,
+				  ctx ? ctx->quality : ANNOTATION_QUALITY_AUTO, NULL, NULL);
+
+    start = stats_clock();
+    list = compile_annotation(commands, width, height, ctx->debug, ctx->quality, NULL, NULL);
+    stats_list(&ctx->workers[0].stats, list, start);
+
+    return list;
+}
+
+
+/*
+ * Start the frame of a context: the list of the previous frame is gone and
+ * the arena is free again
+ */
+static uint64_t
+context_frame_begin(AnnotationContext *ctx)
+{
+    ReleaseAnnotation(&ctx->frame);
+    arena_reset(&ctx->arena);
+
+    return ctx->stats ? stats_clock() : 0;
+}
+
+
+static AnnotationList *
+context_frame_end(AnnotationContext *ctx, AnnotationList *list, uint64_t start)
+{
+    ctx->frame = list;
+
+    if (ctx->stats)
+	stats_list(&ctx->workers[0].stats, list, start);
+
+    return list;
+}
+
+
+/*
+ * Compile the annotation of a frame into the context arena, which is reset
+ * first. The list is valid until the next frame of the context,
+ * ReleaseAnnotation() on it is optional. Once the arena has grown to a
+ * frame the list allocates nothing, json-c still does while parsing.
+ */
+AnnotationList *
+CompileAnnotationFrame(AnnotationContext *ctx, const char *commands, int width, int height)
+{
+    uint64_t start;
+
+    if (!ctx || !commands)
+	return NULL;
+
+    start = context_frame_begin(ctx);
+    return context_frame_end(ctx, compile_annotation(commands, width, height, ctx->debug, ctx->quality,
+						     &ctx->parser, &ctx->arena), start);
+}
+
+
+/*
+ * Compile a binary annotation document into the context arena, like
+ * CompileAnnotationFrame(). Once the arena has grown to a frame, compiling
+ * allocates nothing.
+ */
+AnnotationList *
+CompileAnnotationBinaryFrame(AnnotationContext *ctx, const void *data, size_t size, int width, int height)
+{
+    uint64_t start;
+
+    if (!ctx || !data)
+	return NULL;
+
+    start = context_frame_begin(ctx);
+    return context_frame_end(ctx, compile_annotation_binary(data, size, width, height, ctx->quality,
+							    &ctx->arena), start);
+}
+
+
+/*
+ * Compile the tracks shown at a time, in milliseconds, into the context
+ * arena, like CompileAnnotationBinaryFrame()
+ */
+AnnotationList *
+CompileAnnotationTracksFrame(AnnotationContext *ctx, AnnotationTracks *tracks, int64_t time,
+			     int width, int height)
+{
+    uint64_t start;
+
+    if (!ctx || !tracks)
+	return NULL;
+
+    start = context_frame_begin(ctx);
+    return context_frame_end(ctx, compile_annotation_tracks(tracks, time, width, height, ctx->quality,
+							    &ctx->arena), start);
+}
+
+
+/*
+ * Render a dense list tile by tile on the pool: every worker draws the
+ * items binned to the tiles it takes, clipped to them, and composites them
+ */
+static int
+context_apply_tiles(AnnotationContext *ctx, CvMat *mat, AnnotationList *list)
+{
+    Overlay *ov = &ctx->workers[0].scratch;
+    CvPoint *pts;
+    int i;
+
+    if (mat->cols != list->width || mat->rows != list->height) {
+	fprintf(stderr, "Error: Annotation compiled for %dx%d, image is %dx%d\n",
+		list->width, list->height, mat->cols, mat->rows);
+	return -1;
+    }
+
+    if (overlay_check_image(mat) < 0)
+	return -1;
+
+    ov->stats = ctx->stats ? &ctx->workers[0].stats : NULL;
+    if (ov->stats)
+	ov->stats->frames++;
+
+    if (overlay_prepare(ov, list->bounds) < 0) {
+	fprintf(stderr, "Error: Failed to allocate annotation overlay\n");
+	return -1;
+    }
+
+    /*
+     * Room for the polygons moved to a tile
+     */
+    for (i = 0; i < ctx->num_workers; i++) {
+	if (ctx->workers[i].pts_capacity >= list->max_np)
+	    continue;
+
+	pts = (CvPoint *)realloc(ctx->workers[i].pts, list->max_np * sizeof(CvPoint));
+	if (!pts)
+	    return -1;
+	ctx->workers[i].pts = pts;
+	ctx->workers[i].pts_capacity = list->max_np;
+    }
+
+    /*
+     * Privacy masks change the frame before any tile is composited on it
+     */
+    if (mask_image(mat, list, ov) < 0)
+	return -1;
+
+    return context_dispatch(ctx, tile_job, &mat, &list, ov->tiles_x * ov->tiles_y) ? -1 : 0;
+}
+
+
+/*
+ * Annotate one image with the overlay of the calling thread, reused from
+ * frame to frame. Dense lists are rendered in parallel by tiles.
+ */
+int
+ApplyAnnotationContext(AnnotationContext *ctx, CvMat *mat, AnnotationList *list)
+{
+    if (!ctx)
+	return ApplyAnnotation(mat, list);
+
+    ctx->workers[0].scratch.stats = ctx->stats ? &ctx->workers[0].stats : NULL;
+
+    if (mat && list && ctx->num_workers > 1 && list->count >= TILE_PARALLEL_MIN_ITEMS &&
+	list->bins && list->bounds.width > 0)
+	return context_apply_tiles(ctx, mat, list);
+
+    return apply_annotation(&ctx->workers[0].scratch, mat, list);
+}
+
+
+/*
+ * Annotate a raw IYUV or NV12 frame in place like ApplyAnnotationBuffer(),
+ * reusing the overlay of the context and counting in its stats
+ */
+int
+ApplyAnnotationBufferContext(AnnotationContext *ctx, unsigned char *buffer, int width, int height,
+			     int pixel_format, AnnotationList *list)
+{
+    if (!ctx)
+	return ApplyAnnotationBuffer(buffer, width, height, pixel_format, list);
+
+    ctx->workers[0].scratch.stats = ctx->stats ? &ctx->workers[0].stats : NULL;
+
+    return apply_annotation_buffer(&ctx->workers[0].scratch, buffer, width, height, pixel_format, list);
+}
+
+
+/*
+ * Annotate count images across the worker pool, image i with lists[i].
+ * Images may share a compiled list, compiled lists are only read while
+ * drawing. A context runs one batch at a time.
+ * Return 0, or -1 if any image failed.
+ */
+int
+AnnotateImageBatch(AnnotationContext *ctx, CvMat **mats, AnnotationList **lists, int count)
+{
+    if (!ctx || !mats || !lists || count <= 0)
+	return -1;
+
+    return context_dispatch(ctx, frame_job, mats, lists, count) ? -1 : 0;
+}
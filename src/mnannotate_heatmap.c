@@ -0,0 +1,307 @@
+/*
+ * This file is part of media-utis
+ *
+ * Media-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Media-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with media-utils; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mnannotate_priv.h"
+
+#define MAX_GRID_SIZE		(4096*4096)
+
+#define FIXED_SHIFT		16
+#define FIXED_ONE		(1 << FIXED_SHIFT)
+
+
+static int
+base64_value(unsigned char c)
+{
+    if (c >= 'A' && c <= 'Z')
+	return c - 'A';
+    if (c >= 'a' && c <= 'z')
+	return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+	return c - '0' + 52;
+    if (c == '+' || c == '-')
+	return 62;
+    if (c == '/' || c == '_')
+	return 63;
+
+    return -1;
+}
+
+
+/*
+ * Decode base64 text into size bytes, white space and padding are skipped
+ */
+static int
+base64_decode(const char *text, unsigned char *dst, size_t size)
+{
+    const unsigned char *p;
+    unsigned int bits = 0;
+    size_t n = 0;
+    int v, count = 0;
+
+    for (p = (const unsigned char *)text; *p && n < size; p++) {
+	v = base64_value(*p);
+	if (v < 0)
+	    continue;
+
+	bits = (bits << 6) | v;
+	count += 6;
+	if (count >= 8) {
+	    count -= 8;
+	    dst[n++] = (bits >> count) & 0xff;
+	}
+    }
+
+    return (n == size) ? 0 : -1;
+}
+
+
+static int
+grid_load_file(const char *filename, unsigned char *dst, size_t size)
+{
+    FILE *fh;
+    size_t n;
+
+    fh = fopen(filename, "rb");
+    if (!fh) {
+	fprintf(stderr, "Error: Failed to open heatmap grid %s\n", filename);
+	return -1;
+    }
+
+    n = fread(dst, 1, size, fh);
+    fclose(fh);
+
+    return (n == size) ? 0 : -1;
+}
+
+
+/*
+ * Parse the heatmap grid of an annotation:
+ * { "width": W, "height": H, "data": "<base64>" } or
+ * { "width": W, "height": H, "file": "<raw W*H bytes>" }
+ */
+int
+annotation_get_grid(json_object *obj, Annotation *a, AnnotationArena *arena)
+{
+    json_object *val;
+    const char *data = NULL, *file = NULL;
+    int width = 0, height = 0;
+
+    if (json_object_object_get_ex(obj, "width", &val))
+	width = json_object_get_int(val);
+    if (json_object_object_get_ex(obj, "height", &val))
+	height = json_object_get_int(val);
+    if (json_object_object_get_ex(obj, "data", &val))
+	data = json_object_get_string(val);
+    if (json_object_object_get_ex(obj, "file", &val))
+	file = json_object_get_string(val);
+
+    if (width <= 0 || height <= 0 || (size_t)width * height > MAX_GRID_SIZE || (!data && !file)) {
+	fprintf(stderr, "Warning: Invalid heatmap grid %dx%d\n", width, height);
+	return -1;
+    }
+
+    arena_free(arena, a->grid);
+    a->grid = (unsigned char *)arena_alloc(arena, (size_t)width * height);
+    if (!a->grid)
+	return -1;
+
+    if (data ? base64_decode(data, a->grid, (size_t)width * height) :
+	       grid_load_file(file, a->grid, (size_t)width * height)) {
+	fprintf(stderr, "Warning: Heatmap grid is shorter than %dx%d\n", width, height);
+	arena_free(arena, a->grid);
+	a->grid = NULL;
+	return -1;
+    }
+
+    a->grid_width = width;
+    a->grid_height = height;
+
+    return 0;
+}
+
+
+int
+annotation_get_colormap(json_object *obj, int *colormap)
+{
+    const char *name;
+
+    if (!json_object_is_type(obj, json_type_string)) {
+	*colormap = json_object_get_int(obj);
+	return 0;
+    }
+
+    name = json_object_get_string(obj);
+    if (!strcmp(name, "jet"))
+	*colormap = HEATMAP_COLORMAP_JET;
+    else if (!strcmp(name, "hot"))
+	*colormap = HEATMAP_COLORMAP_HOT;
+    else if (!strcmp(name, "gray"))
+	*colormap = HEATMAP_COLORMAP_GRAY;
+    else if (!strcmp(name, "mono"))
+	*colormap = HEATMAP_COLORMAP_MONO;
+    else
+	*colormap = HEATMAP_COLORMAP_JET;
+
+    return 0;
+}
+
+
+static int
+clamp255(double v)
+{
+    return (v < 0) ? 0 : (v > 1) ? 255 : (int)(v * 255 + 0.5);
+}
+
+
+static double
+absd(double v)
+{
+    return (v < 0) ? -v : v;
+}
+
+
+/*
+ * Build the premultiplied BGRA color of every grid value. Zero is always
+ * transparent, the opacity is the alpha of the color; mono uses its color
+ * with the value as coverage.
+ */
+int
+heatmap_prepare(DrawItem *item, AnnotationArena *arena)
+{
+    Annotation *a = &item->a;
+    unsigned char *c;
+    int v, r, g, b, alpha, opacity = a->argb[0];
+    double t;
+
+    item->lut = (unsigned char *)arena_calloc(arena, 256, 4);
+    if (!item->lut)
+	return -1;
+
+    for (v = 1; v < 256; v++) {
+	t = v / 255.0;
+	alpha = opacity;
+
+	switch (a->colormap) {
+	    case HEATMAP_COLORMAP_HOT:
+		r = clamp255(3*t);
+		g = clamp255(3*t - 1);
+		b = clamp255(3*t - 2);
+		break;
+
+	    case HEATMAP_COLORMAP_GRAY:
+		r = g = b = v;
+		break;
+
+	    case HEATMAP_COLORMAP_MONO:
+		r = a->argb[1];
+		g = a->argb[2];
+		b = a->argb[3];
+		alpha = (opacity * v + 127) / 255;
+		break;
+
+	    default:
+		r = clamp255(1.5 - absd(4*t - 3));
+		g = clamp255(1.5 - absd(4*t - 2));
+		b = clamp255(1.5 - absd(4*t - 1));
+		break;
+	}
+
+	c = item->lut + v * 4;
+	c[0] = (b * alpha + 127) / 255;
+	c[1] = (g * alpha + 127) / 255;
+	c[2] = (r * alpha + 127) / 255;
+	c[3] = alpha;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Sample the grid over the clip area of the heatmap rectangle, which may
+ * extend past the frame, into the overlay mask, bilinear or nearest for the
+ * fast quality, and blend it through the color table in one pass
+ */
+void
+draw_heatmap(Overlay *ov, DrawItem *item, CvRect clip)
+{
+    Annotation *a = &item->a;
+    Point *area = item->grid_area;
+    CvMat mask;
+    unsigned char *m;
+    const unsigned char *r0, *r1;
+    int gw = a->grid_width, gh = a->grid_height;
+    long long fx, fy, gx, step_x, step_y;
+    int x, y, ix, iy, n, wx, wy, top, bottom;
+
+    if (!a->argb[0])
+	return;
+
+    overlay_mask(ov, clip, &mask);
+
+    /*
+     * Grid position of the pixel centers in 16.16 fixed point
+     */
+    step_x = (long long)((double)gw * FIXED_ONE / (area[1].x - area[0].x));
+    step_y = (long long)((double)gh * FIXED_ONE / (area[1].y - area[0].y));
+
+    for (y = 0; y < clip.height; y++) {
+	m = mask.data.ptr + y * mask.step;
+
+	fy = (long long)((clip.y + y + 0.5 - area[0].y) * step_y) - FIXED_ONE/2;
+	if (fy < 0)
+	    fy = 0;
+	if (fy > (long long)(gh - 1) << FIXED_SHIFT)
+	    fy = (long long)(gh - 1) << FIXED_SHIFT;
+	iy = fy >> FIXED_SHIFT;
+	wy = (fy >> 8) & 0xff;
+
+	r0 = a->grid + iy * gw;
+	r1 = a->grid + ((iy + 1 < gh) ? iy + 1 : iy) * gw;
+
+	fx = (long long)((clip.x + 0.5 - area[0].x) * step_x) - FIXED_ONE/2;
+
+	if (item->line_type != CV_AA) {
+	    if (wy >= 128)
+		r0 = r1;
+	    for (x = 0; x < clip.width; x++, fx += step_x) {
+		gx = (fx < 0) ? 0 : (fx + FIXED_ONE/2) >> FIXED_SHIFT;
+		m[x] = r0[(gx < gw) ? gx : gw - 1];
+	    }
+	    continue;
+	}
+
+	for (x = 0; x < clip.width; x++, fx += step_x) {
+	    gx = (fx < 0) ? 0 : fx;
+	    if (gx > (long long)(gw - 1) << FIXED_SHIFT)
+		gx = (long long)(gw - 1) << FIXED_SHIFT;
+	    ix = gx >> FIXED_SHIFT;
+	    wx = (gx >> 8) & 0xff;
+	    n = (ix + 1 < gw) ? ix + 1 : ix;
+
+	    top = r0[ix] * (256 - wx) + r0[n] * wx;
+	    bottom = r1[ix] * (256 - wx) + r1[n] * wx;
+	    m[x] = (top * (256 - wy) + bottom * wy + (1 << 15)) >> 16;
+	}
+    }
+
+    overlay_blend_lut(ov, clip, item->lut);
+}
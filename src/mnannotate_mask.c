@@ -0,0 +1,414 @@
+/*
+ * This file is part of media-utis
+ *
+ * Media-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Media-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with media-utils; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mnannotate_priv.h"
+
+#define DEFAULT_MASK_SIZE	16	/* Block size or blur width in pixel */
+
+#define MAX_CHANNELS		4
+
+
+/*
+ * Plane of an image a mask is applied to, chroma planes are subsampled
+ * by shift
+ */
+typedef struct _mask_plane {
+    unsigned char *data;
+    int step;
+    int cn;
+    int width, height;
+    int shift;
+} MaskPlane;
+
+
+/*
+ * Region of the plane covered by the item
+ */
+static CvRect
+plane_region(MaskPlane *plane, DrawItem *item)
+{
+    CvRect r = item->bounds;
+    int x1, y1;
+
+    x1 = (r.x + r.width + (1 << plane->shift) - 1) >> plane->shift;
+    y1 = (r.y + r.height + (1 << plane->shift) - 1) >> plane->shift;
+    r.x >>= plane->shift;
+    r.y >>= plane->shift;
+    if (x1 > plane->width)
+	x1 = plane->width;
+    if (y1 > plane->height)
+	y1 = plane->height;
+    r.width = x1 - r.x;
+    r.height = y1 - r.y;
+
+    return r;
+}
+
+
+/*
+ * Whether a pixel of the plane is inside the polygon coverage
+ */
+static inline int
+region_inside(const unsigned char *poly, CvRect bounds, MaskPlane *plane, int x, int y)
+{
+    x = (x << plane->shift) - bounds.x;
+    y = (y << plane->shift) - bounds.y;
+
+    if (x < 0)
+	x = 0;
+    if (y < 0)
+	y = 0;
+    if (x >= bounds.width)
+	x = bounds.width - 1;
+    if (y >= bounds.height)
+	y = bounds.height - 1;
+
+    return poly[y * bounds.width + x];
+}
+
+
+/*
+ * Average blocks aligned to the plane origin, so moving regions don't
+ * shimmer. The whole block within the region is averaged.
+ */
+static void
+pixelate_region(MaskPlane *plane, CvRect r, int size, const unsigned char *poly, CvRect bounds)
+{
+    unsigned char *p;
+    int sum[MAX_CHANNELS];
+    int bx, by, x0, x1, y0, y1, x, y, c, n;
+
+    for (by = r.y / size * size; by < r.y + r.height; by += size) {
+	y0 = (by > r.y) ? by : r.y;
+	y1 = (by + size < r.y + r.height) ? by + size : r.y + r.height;
+
+	for (bx = r.x / size * size; bx < r.x + r.width; bx += size) {
+	    x0 = (bx > r.x) ? bx : r.x;
+	    x1 = (bx + size < r.x + r.width) ? bx + size : r.x + r.width;
+
+	    memset(sum, 0, sizeof(sum));
+	    for (y = y0; y < y1; y++) {
+		p = plane->data + y * plane->step + x0 * plane->cn;
+		for (x = x0; x < x1; x++)
+		    for (c = 0; c < plane->cn; c++)
+			sum[c] += *p++;
+	    }
+
+	    n = (x1 - x0) * (y1 - y0);
+	    for (c = 0; c < plane->cn; c++)
+		sum[c] = (sum[c] + n/2) / n;
+
+	    for (y = y0; y < y1; y++) {
+		p = plane->data + y * plane->step + x0 * plane->cn;
+		for (x = x0; x < x1; x++, p += plane->cn) {
+		    if (poly && !region_inside(poly, bounds, plane, x, y))
+			continue;
+		    for (c = 0; c < plane->cn; c++)
+			p[c] = sum[c];
+		}
+	    }
+	}
+    }
+}
+
+
+/*
+ * Running box sum along a line of n samples apart by stride, edges are
+ * extended
+ */
+static void
+box_line(const unsigned char *src, int src_stride, unsigned char *dst, int dst_stride, int n, int radius)
+{
+    int i, sum, width = 2*radius + 1;
+
+    sum = src[0] * (radius + 1);
+    for (i = 1; i <= radius; i++)
+	sum += src[((i < n) ? i : n - 1) * src_stride];
+
+    for (i = 0; i < n; i++) {
+	dst[i * dst_stride] = (sum + width/2) / width;
+	sum += src[((i + radius + 1 < n) ? i + radius + 1 : n - 1) * src_stride];
+	sum -= src[((i - radius > 0) ? i - radius : 0) * src_stride];
+    }
+}
+
+
+/*
+ * Scratch bytes the blur of a region needs
+ */
+static size_t
+blur_scratch_size(MaskPlane *plane, CvRect r)
+{
+    return (size_t)r.width * r.height * plane->cn + r.height;
+}
+
+
+/*
+ * Separable box blur of the region, horizontal pass into the scratch copy
+ * and vertical pass back into the plane. Pixels outside of the polygon keep
+ * their value.
+ */
+static void
+blur_region(MaskPlane *plane, CvRect r, int size, const unsigned char *poly, CvRect bounds,
+	    unsigned char *tmp)
+{
+    unsigned char *column, *p;
+    int radius = size / 2, x, y, c, cn = plane->cn;
+
+    if (radius < 1)
+	radius = 1;
+
+    column = tmp + (size_t)r.width * r.height * cn;
+
+    for (y = 0; y < r.height; y++) {
+	p = plane->data + (r.y + y) * plane->step + r.x * cn;
+	for (c = 0; c < cn; c++)
+	    box_line(p + c, cn, tmp + y * r.width * cn + c, cn, r.width, radius);
+    }
+
+    for (x = 0; x < r.width; x++) {
+	for (c = 0; c < cn; c++) {
+	    box_line(tmp + x * cn + c, r.width * cn, column, 1, r.height, radius);
+
+	    p = plane->data + r.y * plane->step + (r.x + x) * cn + c;
+	    for (y = 0; y < r.height; y++, p += plane->step) {
+		if (poly && !region_inside(poly, bounds, plane, r.x + x, r.y + y))
+		    continue;
+		*p = column[y];
+	    }
+	}
+    }
+}
+
+
+/*
+ * Coverage of the polygon over the item bounds
+ */
+static void
+polygon_coverage(DrawItem *item, unsigned char *poly)
+{
+    CvMat mat;
+
+    memset(poly, 0, (size_t)item->bounds.width * item->bounds.height);
+    mat = cvMat(item->bounds.height, item->bounds.width, CV_8UC1, poly);
+    cvFillPoly(&mat, &item->pts, &item->a.np, 1, cvScalarAll(255), 8, 0);
+}
+
+
+/*
+ * Mask the planes with one scratch buffer for the polygon coverage and the
+ * blur, kept by the overlay if any
+ */
+static int
+mask_planes(MaskPlane *planes, int count, DrawItem *item, Overlay *ov)
+{
+    unsigned char *scratch, *poly = NULL;
+    size_t poly_size = 0, blur_size = 0;
+    CvRect r;
+    int i, size;
+
+    if (item->culled || item->bounds.width <= 0 || item->bounds.height <= 0)
+	return 0;
+
+    if (item->a.np >= 3)
+	poly_size = (size_t)item->bounds.width * item->bounds.height;
+
+    if (item->a.op == OL_BLUR) {
+	for (i = 0; i < count; i++) {
+	    r = plane_region(&planes[i], item);
+	    if (r.width > 0 && r.height > 0 && blur_scratch_size(&planes[i], r) > blur_size)
+		blur_size = blur_scratch_size(&planes[i], r);
+	}
+    }
+
+    scratch = NULL;
+    if (poly_size + blur_size > 0) {
+	scratch = ov ? overlay_scratch(ov, poly_size + blur_size) :
+		       (unsigned char *)malloc(poly_size + blur_size);
+	if (!scratch)
+	    return -1;
+    }
+
+    if (poly_size) {
+	poly = scratch;
+	polygon_coverage(item, poly);
+    }
+
+    for (i = 0; i < count; i++) {
+	r = plane_region(&planes[i], item);
+	if (r.width <= 0 || r.height <= 0)
+	    continue;
+	size = ((item->a.bold > 0) ? item->a.bold : DEFAULT_MASK_SIZE) >> planes[i].shift;
+	if (size < 1)
+	    size = 1;
+
+	if (item->a.op == OL_PIXELATE)
+	    pixelate_region(&planes[i], r, size, poly, item->bounds);
+	else
+	    blur_region(&planes[i], r, size, poly, item->bounds, scratch + poly_size);
+    }
+
+    if (!ov)
+	free(scratch);
+
+    return 0;
+}
+
+
+/*
+ * Blur or pixelate the area of a privacy mask item in a BGR image
+ */
+int
+mask_item(CvMat *mat, DrawItem *item, Overlay *ov)
+{
+    MaskPlane plane;
+
+    if (item->a.op != OL_BLUR && item->a.op != OL_PIXELATE)
+	return 0;
+
+    plane.data = mat->data.ptr;
+    plane.step = mat->step;
+    plane.cn = CV_MAT_CN(mat->type);
+    plane.width = mat->cols;
+    plane.height = mat->rows;
+    plane.shift = 0;
+
+    return mask_planes(&plane, 1, item, ov);
+}
+
+
+/*
+ * Apply the privacy masks of a list to the image, before the overlay is
+ * composited on it
+ */
+int
+mask_image(CvMat *mat, AnnotationList *list, Overlay *ov)
+{
+    AnnotationStats *stats = ov ? ov->stats : NULL;
+    DrawItem *item;
+    uint64_t start = 0;
+    int res = 0;
+
+    if (!list || list->num_masks == 0)
+	return 0;
+
+    for (item = list->items; item < list->items + list->count; item++) {
+	if (item->a.op != OL_BLUR && item->a.op != OL_PIXELATE)
+	    continue;
+
+	if (stats)
+	    start = stats_clock();
+	if (mask_item(mat, item, ov) < 0)
+	    res = -1;
+	if (stats && !item->culled) {
+	    stats->mask_time += stats_clock() - start;
+	    stats_item(stats, item, item->bounds, start);
+	}
+    }
+
+    return res;
+}
+
+
+/*
+ * Apply the privacy masks of a list to a planar IYUV or semi-planar NV12
+ * image, chroma is masked at its own resolution
+ */
+int
+mask_image_buffer(unsigned char *buffer, int width, int height, int pixel_format, AnnotationList *list,
+		  Overlay *ov)
+{
+    AnnotationStats *stats = ov ? ov->stats : NULL;
+    MaskPlane planes[3];
+    DrawItem *item;
+    uint64_t start = 0;
+    int count, res = 0;
+
+    if (!buffer || !list)
+	return -1;
+
+    if (width != list->width || height != list->height) {
+	fprintf(stderr, "Error: Annotation compiled for %dx%d, image is %dx%d\n",
+		list->width, list->height, width, height);
+	return -1;
+    }
+
+    planes[0].data = buffer;
+    planes[0].step = width;
+    planes[0].cn = 1;
+    planes[0].width = width;
+    planes[0].height = height;
+    planes[0].shift = 0;
+
+    switch (pixel_format) {
+	case PIXEL_FORMAT_IYUV:
+	    planes[1].data = buffer + width * height;
+	    planes[1].step = width / 2;
+	    planes[1].cn = 1;
+	    planes[1].width = width / 2;
+	    planes[1].height = height / 2;
+	    planes[1].shift = 1;
+	    planes[2] = planes[1];
+	    planes[2].data = planes[1].data + (width / 2) * (height / 2);
+	    count = 3;
+	    break;
+
+	case PIXEL_FORMAT_NV12:
+	    planes[1].data = buffer + width * height;
+	    planes[1].step = width;
+	    planes[1].cn = 2;
+	    planes[1].width = width / 2;
+	    planes[1].height = height / 2;
+	    planes[1].shift = 1;
+	    count = 2;
+	    break;
+
+	default:
+	    fprintf(stderr, "Error: Privacy masks need a planar YUV image\n");
+	    return -1;
+    }
+
+    if (list->num_masks == 0)
+	return 0;
+
+    for (item = list->items; item < list->items + list->count; item++) {
+	if (item->a.op != OL_BLUR && item->a.op != OL_PIXELATE)
+	    continue;
+
+	if (stats)
+	    start = stats_clock();
+	if (mask_planes(planes, count, item, ov) < 0)
+	    res = -1;
+	if (stats && !item->culled) {
+	    stats->mask_time += stats_clock() - start;
+	    stats_item(stats, item, item->bounds, start);
+	}
+    }
+
+    return res;
+}
+
+
+int
+MaskImageBuffer(unsigned char *buffer, int width, int height, int pixel_format, AnnotationList *list)
+{
+    return mask_image_buffer(buffer, width, height, pixel_format, list, NULL);
+}
@@ -0,0 +1,566 @@
+/*
+ * This file is part of media-utis
+ *
+ * Media-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Media-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with media-utils; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mnannotate_priv.h"
+
+
+/*
+ * x / 255 rounded, exact for 0 <= x <= 255*255
+ */
+static inline int
+div255(int x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+
+int
+overlay_init(Overlay *ov, CvRect area)
+{
+    memset(ov, 0, sizeof(Overlay));
+
+    return overlay_prepare(ov, area);
+}
+
+
+/*
+ * Setup the overlay for a frame area, reusing its layers when they are
+ * large enough. The layers are transparent between uses: shapes clear the
+ * mask as they are blended and composites clear the tiles they blend.
+ */
+int
+overlay_prepare(Overlay *ov, CvRect area)
+{
+    int tiles_x, tiles_y;
+
+    if (area.width <= 0 || area.height <= 0) {
+	ov->area = cvRect(0, 0, 0, 0);
+	ov->tiles_x = ov->tiles_y = 0;
+	return 0;
+    }
+
+    tiles_x = (area.width + OVERLAY_TILE_SIZE - 1) / OVERLAY_TILE_SIZE;
+    tiles_y = (area.height + OVERLAY_TILE_SIZE - 1) / OVERLAY_TILE_SIZE;
+
+    if ((size_t)area.width * area.height > ov->capacity || tiles_x * tiles_y > ov->tile_capacity) {
+	free(ov->pixels);
+	free(ov->mask);
+	free(ov->dirty);
+
+	ov->pixels = (unsigned char *)calloc(area.height, area.width * 4);
+	ov->mask = (unsigned char *)calloc(area.height, area.width);
+	ov->dirty = (unsigned char *)calloc(tiles_x * tiles_y, 1);
+	if (!ov->pixels || !ov->mask || !ov->dirty) {
+	    overlay_free(ov);
+	    return -1;
+	}
+	ov->capacity = (size_t)area.width * area.height;
+	ov->tile_capacity = tiles_x * tiles_y;
+    }
+
+    ov->area = area;
+    ov->step = area.width * 4;
+    ov->mask_step = area.width;
+    ov->tiles_x = tiles_x;
+    ov->tiles_y = tiles_y;
+
+    return 0;
+}
+
+
+void
+overlay_free(Overlay *ov)
+{
+    free(ov->pixels);
+    free(ov->mask);
+    free(ov->dirty);
+    free(ov->scratch);
+    memset(ov, 0, sizeof(Overlay));
+}
+
+
+/*
+ * Scratch memory of at least size bytes kept with the overlay, for the
+ * privacy masks drawn along with it
+ */
+unsigned char *
+overlay_scratch(Overlay *ov, size_t size)
+{
+    unsigned char *scratch;
+
+    if (size > ov->scratch_capacity) {
+	scratch = (unsigned char *)realloc(ov->scratch, size);
+	if (!scratch)
+	    return NULL;
+	ov->scratch = scratch;
+	ov->scratch_capacity = size;
+    }
+
+    return ov->scratch;
+}
+
+
+/*
+ * Coverage mask of a frame area for the OpenCV drawing functions, shapes
+ * are drawn in white with coordinates relative to the area
+ */
+CvMat *
+overlay_mask(Overlay *ov, CvRect r, CvMat *mask)
+{
+    CvMat full;
+
+    full = cvMat(ov->area.height, ov->area.width, CV_8UC1, ov->mask);
+    r.x -= ov->area.x;
+    r.y -= ov->area.y;
+
+    return cvGetSubRect(&full, mask, r);
+}
+
+
+/*
+ * Blend the color over the overlay through the coverage mask of a frame
+ * area with the "over" operator, and clear the mask for the next shape
+ */
+void
+overlay_blend(Overlay *ov, CvRect r, const int *argb)
+{
+    unsigned char *m, *o;
+    int x, y, tx, ty;
+    int cov, inv;
+    const int alpha = argb[0], red = argb[1], green = argb[2], blue = argb[3];
+
+    if (r.width <= 0 || r.height <= 0)
+	return;
+
+    r.x -= ov->area.x;
+    r.y -= ov->area.y;
+
+    for (y = r.y; y < r.y + r.height; y++) {
+	m = ov->mask + y * ov->mask_step + r.x;
+	o = ov->pixels + y * ov->step + r.x * 4;
+
+	for (x = 0; x < r.width; x++, o += 4) {
+	    if (!m[x])
+		continue;
+
+	    cov = div255(m[x] * alpha);
+	    inv = 255 - cov;
+	    o[0] = div255(o[0] * inv + blue * cov);
+	    o[1] = div255(o[1] * inv + green * cov);
+	    o[2] = div255(o[2] * inv + red * cov);
+	    o[3] = div255(o[3] * inv) + cov;
+	    m[x] = 0;
+	}
+    }
+
+    for (ty = r.y / OVERLAY_TILE_SIZE; ty <= (r.y + r.height - 1) / OVERLAY_TILE_SIZE; ty++)
+	for (tx = r.x / OVERLAY_TILE_SIZE; tx <= (r.x + r.width - 1) / OVERLAY_TILE_SIZE; tx++)
+	    ov->dirty[ty * ov->tiles_x + tx] = 1;
+}
+
+
+/*
+ * Blend per-pixel colors over the overlay: the mask of a frame area holds
+ * indexes in a table of 256 premultiplied BGRA colors. The mask is cleared
+ * for the next shape.
+ */
+void
+overlay_blend_lut(Overlay *ov, CvRect r, const unsigned char *lut)
+{
+    const unsigned char *c;
+    unsigned char *m, *o;
+    int x, y, tx, ty, inv;
+
+    if (r.width <= 0 || r.height <= 0)
+	return;
+
+    r.x -= ov->area.x;
+    r.y -= ov->area.y;
+
+    for (y = r.y; y < r.y + r.height; y++) {
+	m = ov->mask + y * ov->mask_step + r.x;
+	o = ov->pixels + y * ov->step + r.x * 4;
+
+	for (x = 0; x < r.width; x++, o += 4) {
+	    c = lut + m[x] * 4;
+	    inv = 255 - c[3];
+	    o[0] = div255(o[0] * inv) + c[0];
+	    o[1] = div255(o[1] * inv) + c[1];
+	    o[2] = div255(o[2] * inv) + c[2];
+	    o[3] = div255(o[3] * inv) + c[3];
+	}
+	memset(m, 0, r.width);
+    }
+
+    for (ty = r.y / OVERLAY_TILE_SIZE; ty <= (r.y + r.height - 1) / OVERLAY_TILE_SIZE; ty++)
+	for (tx = r.x / OVERLAY_TILE_SIZE; tx <= (r.x + r.width - 1) / OVERLAY_TILE_SIZE; tx++)
+	    ov->dirty[ty * ov->tiles_x + tx] = 1;
+}
+
+
+/*
+ * Blend a span of overlay pixels onto the frame, one loop per pixel size
+ * with constant strides for the vectorizer. Every blend onto the overlay
+ * keeps its colors premultiplied, no more than their alpha, so the result
+ * needs no clamping: div255(p * (255 - a)) + c <= 255 - a + a.
+ * BGRA spans vectorize on any SIMD target. BGR spans need deinterleaving
+ * loads of 3 bytes (NEON ld3, SSSE3 shuffles) and stay scalar on plain
+ * SSE2.
+ */
+static void
+composite_span_bgr(unsigned char *restrict p, const unsigned char *restrict o, int width)
+{
+    int x, inv;
+
+    for (x = 0; x < width; x++) {
+	inv = 255 - o[4*x + 3];
+	p[3*x] = div255(p[3*x] * inv) + o[4*x];
+	p[3*x + 1] = div255(p[3*x + 1] * inv) + o[4*x + 1];
+	p[3*x + 2] = div255(p[3*x + 2] * inv) + o[4*x + 2];
+    }
+}
+
+
+static void
+composite_span_bgra(unsigned char *restrict p, const unsigned char *restrict o, int width)
+{
+    int x, inv;
+
+    for (x = 0; x < width; x++) {
+	inv = 255 - o[4*x + 3];
+	p[4*x] = div255(p[4*x] * inv) + o[4*x];
+	p[4*x + 1] = div255(p[4*x + 1] * inv) + o[4*x + 1];
+	p[4*x + 2] = div255(p[4*x + 2] * inv) + o[4*x + 2];
+    }
+}
+
+
+/*
+ * Copy the touched tiles of an overlay into a transparent overlay covering
+ * its area
+ */
+void
+overlay_copy(Overlay *dst, Overlay *src)
+{
+    int tx, ty, x0, x1, y, y1;
+    int ox = src->area.x - dst->area.x;
+    int oy = src->area.y - dst->area.y;
+
+    for (ty = 0; ty < src->tiles_y; ty++) {
+	for (tx = 0; tx < src->tiles_x; tx++) {
+	    if (!src->dirty[ty * src->tiles_x + tx])
+		continue;
+
+	    x0 = tx * OVERLAY_TILE_SIZE;
+	    x1 = (x0 + OVERLAY_TILE_SIZE < src->area.width) ? x0 + OVERLAY_TILE_SIZE : src->area.width;
+	    y1 = ((ty + 1) * OVERLAY_TILE_SIZE < src->area.height) ? (ty + 1) * OVERLAY_TILE_SIZE : src->area.height;
+
+	    for (y = ty * OVERLAY_TILE_SIZE; y < y1; y++)
+		memcpy(dst->pixels + (y + oy) * dst->step + (x0 + ox) * 4,
+		       src->pixels + y * src->step + x0 * 4, (x1 - x0) * 4);
+
+	    /*
+	     * Both areas are aligned to tiles in the frame
+	     */
+	    dst->dirty[((ty * OVERLAY_TILE_SIZE + oy) / OVERLAY_TILE_SIZE) * dst->tiles_x +
+		       (x0 + ox) / OVERLAY_TILE_SIZE] = 1;
+	}
+    }
+}
+
+
+/*
+ * Check the image can take an overlay, before anything is drawn
+ */
+int
+overlay_check_image(CvMat *mat)
+{
+    if (CV_MAT_DEPTH(mat->type) != CV_8U || (CV_MAT_CN(mat->type) != 3 && CV_MAT_CN(mat->type) != 4)) {
+	fprintf(stderr, "Error: Annotation needs a 8-bit BGR or BGRA image\n");
+	return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Blend a run of tiles of a tile row onto the frame, clearing them unless
+ * kept. Return the frame bytes blended.
+ */
+static size_t
+composite_tiles(Overlay *ov, CvMat *mat, int ty, int first, int last, int keep)
+{
+    unsigned char *p, *o;
+    int cn = CV_MAT_CN(mat->type);
+    int x0, x1, y, y1;
+
+    x0 = first * OVERLAY_TILE_SIZE;
+    x1 = last * OVERLAY_TILE_SIZE;
+    if (x1 > ov->area.width)
+	x1 = ov->area.width;
+    y1 = (ty + 1) * OVERLAY_TILE_SIZE;
+    if (y1 > ov->area.height)
+	y1 = ov->area.height;
+
+    for (y = ty * OVERLAY_TILE_SIZE; y < y1; y++) {
+	p = mat->data.ptr + (ov->area.y + y) * mat->step + (ov->area.x + x0) * cn;
+	o = ov->pixels + y * ov->step + x0 * 4;
+	if (cn == 4)
+	    composite_span_bgra(p, o, x1 - x0);
+	else
+	    composite_span_bgr(p, o, x1 - x0);
+	if (!keep)
+	    memset(o, 0, (x1 - x0) * 4);
+    }
+
+    return (size_t)(x1 - x0) * (y1 - ty * OVERLAY_TILE_SIZE) * cn;
+}
+
+
+/*
+ * Blend the touched tiles of the overlay onto a BGR or BGRA frame in one
+ * pass. Unless kept, the overlay is left transparent for the next frame.
+ */
+int
+overlay_composite(Overlay *ov, CvMat *mat, int keep)
+{
+    size_t bytes = 0;
+    int tx, ty, first;
+
+    if (overlay_check_image(mat) < 0)
+	return -1;
+
+    if (ov->area.x + ov->area.width > mat->cols || ov->area.y + ov->area.height > mat->rows)
+	return -1;
+
+    for (ty = 0; ty < ov->tiles_y; ty++) {
+	for (tx = 0; tx < ov->tiles_x; tx++) {
+	    if (!ov->dirty[ty * ov->tiles_x + tx])
+		continue;
+
+	    /*
+	     * Composite runs of adjacent touched tiles row by row
+	     */
+	    for (first = tx; tx < ov->tiles_x && ov->dirty[ty * ov->tiles_x + tx]; tx++)
+		if (!keep)
+		    ov->dirty[ty * ov->tiles_x + tx] = 0;
+
+	    bytes += composite_tiles(ov, mat, ty, first, tx, keep);
+	}
+    }
+
+    if (ov->stats)
+	ov->stats->composite_bytes += bytes;
+
+    return 0;
+}
+
+
+static inline int
+clamp_byte(int v)
+{
+    return (v < 0) ? 0 : (v > 255) ? 255 : v;
+}
+
+
+/*
+ * Premultiplied luma of an overlay pixel in BT.601 video range, the
+ * convention of the raw formats LoadImageBufferInto() converts
+ */
+static inline int
+overlay_luma(const unsigned char *o)
+{
+    return ((66 * o[2] + 129 * o[1] + 25 * o[0] + 128) >> 8) + div255(16 * o[3]);
+}
+
+
+/*
+ * Blend a run of tiles of a tile row onto planar YUV 4:2:0, luma by pixel
+ * and chroma by the average of each 2x2 block, and clear them. Return the
+ * frame bytes blended.
+ */
+static size_t
+composite_tiles_yuv(Overlay *ov, unsigned char *luma, int luma_step, unsigned char *cb, unsigned char *cr,
+		    int chroma_step, int chroma_cn, int ty, int first, int last)
+{
+    unsigned char *p0, *p1, *u, *v, *o0, *o1;
+    int x0, x1, x, y, y1, b, g, r, a, inv;
+
+    x0 = first * OVERLAY_TILE_SIZE;
+    x1 = last * OVERLAY_TILE_SIZE;
+    if (x1 > ov->area.width)
+	x1 = ov->area.width;
+    y1 = (ty + 1) * OVERLAY_TILE_SIZE;
+    if (y1 > ov->area.height)
+	y1 = ov->area.height;
+
+    for (y = ty * OVERLAY_TILE_SIZE; y < y1; y += 2) {
+	p0 = luma + (ov->area.y + y) * luma_step + ov->area.x + x0;
+	p1 = p0 + luma_step;
+	u = cb + ((ov->area.y + y) / 2) * chroma_step + ((ov->area.x + x0) / 2) * chroma_cn;
+	v = cr + ((ov->area.y + y) / 2) * chroma_step + ((ov->area.x + x0) / 2) * chroma_cn;
+	o0 = ov->pixels + y * ov->step + x0 * 4;
+	o1 = o0 + ov->step;
+
+	for (x = x0; x < x1; x += 2, p0 += 2, p1 += 2, u += chroma_cn, v += chroma_cn, o0 += 8, o1 += 8) {
+	    p0[0] = clamp_byte(div255(p0[0] * (255 - o0[3])) + overlay_luma(o0));
+	    p0[1] = clamp_byte(div255(p0[1] * (255 - o0[7])) + overlay_luma(o0 + 4));
+	    p1[0] = clamp_byte(div255(p1[0] * (255 - o1[3])) + overlay_luma(o1));
+	    p1[1] = clamp_byte(div255(p1[1] * (255 - o1[7])) + overlay_luma(o1 + 4));
+
+	    b = (o0[0] + o0[4] + o1[0] + o1[4] + 2) >> 2;
+	    g = (o0[1] + o0[5] + o1[1] + o1[5] + 2) >> 2;
+	    r = (o0[2] + o0[6] + o1[2] + o1[6] + 2) >> 2;
+	    a = (o0[3] + o0[7] + o1[3] + o1[7] + 2) >> 2;
+	    inv = 255 - a;
+
+	    *u = clamp_byte(div255(*u * inv) + ((-38 * r - 74 * g + 112 * b + 128) >> 8) + div255(128 * a));
+	    *v = clamp_byte(div255(*v * inv) + ((112 * r - 94 * g - 18 * b + 128) >> 8) + div255(128 * a));
+	}
+
+	memset(ov->pixels + y * ov->step + x0 * 4, 0, (x1 - x0) * 4);
+	memset(ov->pixels + (y + 1) * ov->step + x0 * 4, 0, (x1 - x0) * 4);
+    }
+
+    return (size_t)(x1 - x0) * (y1 - ty * OVERLAY_TILE_SIZE) * 3 / 2;
+}
+
+
+/*
+ * Check a raw frame can take an overlay, before anything is drawn
+ */
+int
+overlay_check_yuv(int width, int height, int pixel_format)
+{
+    if ((width | height) & 1) {
+	fprintf(stderr, "Error: Annotation needs an even %dx%d YUV image\n", width, height);
+	return -1;
+    }
+
+    if (pixel_format != PIXEL_FORMAT_IYUV && pixel_format != PIXEL_FORMAT_NV12) {
+	fprintf(stderr, "Error: Annotation needs a planar YUV image\n");
+	return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Make the touched tiles transparent again without blending them, when a
+ * composite failed
+ */
+void
+overlay_clear(Overlay *ov)
+{
+    int tx, ty, x0, x1, y, y1;
+
+    for (ty = 0; ty < ov->tiles_y; ty++) {
+	for (tx = 0; tx < ov->tiles_x; tx++) {
+	    if (!ov->dirty[ty * ov->tiles_x + tx])
+		continue;
+	    ov->dirty[ty * ov->tiles_x + tx] = 0;
+
+	    x0 = tx * OVERLAY_TILE_SIZE;
+	    x1 = (x0 + OVERLAY_TILE_SIZE < ov->area.width) ? x0 + OVERLAY_TILE_SIZE : ov->area.width;
+	    y1 = ((ty + 1) * OVERLAY_TILE_SIZE < ov->area.height) ? (ty + 1) * OVERLAY_TILE_SIZE : ov->area.height;
+
+	    for (y = ty * OVERLAY_TILE_SIZE; y < y1; y++)
+		memset(ov->pixels + y * ov->step + x0 * 4, 0, (x1 - x0) * 4);
+	}
+    }
+}
+
+
+/*
+ * Blend the touched tiles of the overlay onto an IYUV or NV12 frame of even
+ * dimension, without converting the frame to BGR. The overlay is left
+ * transparent.
+ */
+int
+overlay_composite_yuv(Overlay *ov, unsigned char *buffer, int width, int height, int pixel_format)
+{
+    unsigned char *cb, *cr;
+    size_t bytes = 0;
+    int tx, ty, first, chroma_step, chroma_cn;
+
+    if (overlay_check_yuv(width, height, pixel_format) < 0)
+	return -1;
+
+    if (ov->area.x + ov->area.width > width || ov->area.y + ov->area.height > height)
+	return -1;
+
+    switch (pixel_format) {
+	case PIXEL_FORMAT_IYUV:
+	    cb = buffer + width * height;
+	    cr = cb + (width / 2) * (height / 2);
+	    chroma_step = width / 2;
+	    chroma_cn = 1;
+	    break;
+
+	case PIXEL_FORMAT_NV12:
+	    cb = buffer + width * height;
+	    cr = cb + 1;
+	    chroma_step = width;
+	    chroma_cn = 2;
+	    break;
+
+	default:
+	    fprintf(stderr, "Error: Annotation needs a planar YUV image\n");
+	    return -1;
+    }
+
+    for (ty = 0; ty < ov->tiles_y; ty++) {
+	for (tx = 0; tx < ov->tiles_x; tx++) {
+	    if (!ov->dirty[ty * ov->tiles_x + tx])
+		continue;
+
+	    for (first = tx; tx < ov->tiles_x && ov->dirty[ty * ov->tiles_x + tx]; tx++)
+		ov->dirty[ty * ov->tiles_x + tx] = 0;
+
+	    bytes += composite_tiles_yuv(ov, buffer, width, cb, cr, chroma_step, chroma_cn, ty, first, tx);
+	}
+    }
+
+    if (ov->stats)
+	ov->stats->composite_bytes += bytes;
+
+    return 0;
+}
+
+
+/*
+ * Blend one tile of the overlay onto the frame if it was touched, tiles are
+ * independent and may be composited concurrently. The image is checked by
+ * the caller. Return the frame bytes blended.
+ */
+size_t
+overlay_composite_tile(Overlay *ov, CvMat *mat, int tx, int ty)
+{
+    if (!ov->dirty[ty * ov->tiles_x + tx])
+	return 0;
+
+    ov->dirty[ty * ov->tiles_x + tx] = 0;
+
+    return composite_tiles(ov, mat, ty, tx, tx + 1, 0);
+}
@@ -0,0 +1,241 @@
+/*
+ * This file is part of media-utis
+ *
+ * Media-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Media-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with media-utils; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _MNANNOTATE_PRIV_H_
+#define _MNANNOTATE_PRIV_H_
+
+#include <pthread.h>
+#include "mnannotate.h"
+
+#define OVERLAY_TILE_SIZE	64
+
+/*
+ * Lists this dense are rendered tile by tile across the context workers
+ */
+#define TILE_PARALLEL_MIN_ITEMS	64
+
+#define DEFAULT_ANNOTATION_DEBUG	1
+
+#define GLYPH_FIRST		32	/* Printable ASCII in the glyph atlas */
+#define GLYPH_COUNT		95
+#define GLYPH_SUBPIXEL		16	/* Advance unit, 1/16 pixel */
+
+
+/*
+ * Coverage of every glyph of a Hershey font at a scale and thickness, in
+ * cells of the same size side by side
+ */
+typedef struct _glyph_atlas {
+    int font_face;
+    double scale;
+    int thickness;
+    int line_type;
+    int height, base_line;	/* Text metrics of the font */
+    int advance[GLYPH_COUNT];	/* Advance in GLYPH_SUBPIXEL units */
+    int cell_width, cell_height;
+    int origin_x, origin_y;	/* Pen position on the base line in a cell */
+    unsigned char *coverage;
+    int step;
+    int refs;			/* Compiled items using the atlas */
+    struct _glyph_atlas *next;
+} GlyphAtlas;
+
+
+/*
+ * Annotation compiled for a frame size
+ */
+typedef struct _draw_item {
+    Annotation a;
+    CvRect bounds;		/* Area touched by the shape */
+    CvPoint *pts;		/* Polygon vertices relative to the bounds */
+    GlyphAtlas *atlas;		/* Label font */
+    CvSize text_size;		/* Label size */
+    int base_line;
+    int line_type;		/* CV_AA or 8-connected */
+    unsigned char *lut;		/* Heatmap colors, premultiplied BGRA */
+    Point grid_area[2];		/* Heatmap rectangle in pixel, not clamped to the frame */
+    int culled;			/* Hidden under a later opaque fill */
+} DrawItem;
+
+/*
+ * Items touching a frame tile, in draw order
+ */
+typedef struct _tile_bin {
+    int *items;
+    int count;
+    int capacity;
+} TileBin;
+
+
+/*
+ * Bump allocator of a context, reset frame after frame
+ */
+typedef struct _arena_block {
+    struct _arena_block *next;
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+typedef struct _annotation_arena {
+    ArenaBlock *blocks;		/* Block being filled first */
+    size_t total;		/* Size of all the blocks */
+    void *last;			/* Last allocation, grown in place */
+} AnnotationArena;
+
+
+struct _annotation_list {
+    DrawItem *items;
+    int count;
+    int capacity;
+    int width, height;		/* Frame size the list was compiled for */
+    CvRect bounds;		/* Union of the item bounds, aligned to tiles */
+    TileBin *bins;		/* Frame tile grid, OVERLAY_TILE_SIZE tiles */
+    int tiles_x, tiles_y;
+    int max_np;			/* Most polygon vertices of an item */
+    int num_masks;		/* Privacy mask items, applied to the frame */
+    int quality;		/* Forced on every item, or ANNOTATION_QUALITY_AUTO */
+    AnnotationArena *arena;	/* Owner of the memory of the list, NULL for the heap */
+};
+
+
+/*
+ * Premultiplied BGRA layer every annotation of a frame is drawn on, the
+ * frame is blended once with the tiles that were touched
+ */
+typedef struct _overlay {
+    CvRect area;		/* Frame area covered, aligned to tiles */
+    unsigned char *pixels;	/* Premultiplied BGRA */
+    int step;
+    unsigned char *mask;	/* Coverage of the shape being drawn */
+    int mask_step;
+    unsigned char *dirty;	/* Tiles touched since the last composite */
+    int tiles_x, tiles_y;
+    size_t capacity;		/* Pixels the layers can hold */
+    int tile_capacity;
+    unsigned char *scratch;	/* Temporary pixels of privacy masks */
+    size_t scratch_capacity;
+    AnnotationStats *stats;	/* Counters of the owner, NULL when off */
+} Overlay;
+
+
+/*
+ * Reentrant annotation state: nothing in the library is shared between
+ * contexts but the glyph atlases
+ */
+typedef struct _annotation_worker {
+    struct _annotation_context *ctx;
+    pthread_t thread;
+    Overlay scratch;		/* Overlay reused frame after frame */
+    CvPoint *pts;		/* Polygon vertices relative to a tile */
+    int pts_capacity;
+    AnnotationStats stats;	/* Counters of the worker, summed on query */
+} AnnotationWorker;
+
+typedef int (*AnnotationJob)(struct _annotation_context *ctx, AnnotationWorker *w, int i);
+
+struct _annotation_context {
+    int debug;
+    int quality;		/* Forced on every annotation, see SetAnnotationQuality() */
+    AnnotationWorker *workers;	/* The first one is the calling thread */
+    int num_workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned int generation;	/* Batch number, wakes up the pool */
+    int active;			/* Pool threads still working on the batch */
+    int quit;
+
+    AnnotationJob job;		/* Runs the i-th frame or tile of the batch */
+    CvMat **mats;		/* Batch being annotated */
+    AnnotationList **lists;
+    int count;
+    int next;			/* Next frame or tile to take */
+    int failed;
+
+    AnnotationArena arena;	/* Frame lists, see CompileAnnotationFrame() */
+    AnnotationParser *parser;	/* Parser of the frame lists */
+    AnnotationList *frame;	/* List of the arena, released on reset */
+    int stats;			/* Performance counters enabled */
+};
+
+
+int overlay_init(Overlay *ov, CvRect area);
+int overlay_prepare(Overlay *ov, CvRect area);
+int overlay_check_image(CvMat *mat);
+int overlay_check_yuv(int width, int height, int pixel_format);
+void overlay_clear(Overlay *ov);
+void overlay_free(Overlay *ov);
+CvMat *overlay_mask(Overlay *ov, CvRect r, CvMat *mask);
+void overlay_blend(Overlay *ov, CvRect r, const int *argb);
+void overlay_blend_lut(Overlay *ov, CvRect r, const unsigned char *lut);
+void overlay_copy(Overlay *dst, Overlay *src);
+int overlay_composite(Overlay *ov, CvMat *mat, int keep);
+size_t overlay_composite_tile(Overlay *ov, CvMat *mat, int tx, int ty);
+int overlay_composite_yuv(Overlay *ov, unsigned char *buffer, int width, int height, int pixel_format);
+unsigned char *overlay_scratch(Overlay *ov, size_t size);
+
+void *arena_alloc(AnnotationArena *arena, size_t size);
+void *arena_calloc(AnnotationArena *arena, size_t count, size_t size);
+void *arena_realloc(AnnotationArena *arena, void *ptr, size_t old_size, size_t size);
+char *arena_strdup(AnnotationArena *arena, const char *s);
+void arena_free(AnnotationArena *arena, void *ptr);
+void arena_reset(AnnotationArena *arena);
+void arena_destroy(AnnotationArena *arena);
+
+uint64_t stats_clock(void);
+void stats_item(AnnotationStats *stats, DrawItem *item, CvRect area, uint64_t start);
+void stats_list(AnnotationStats *stats, AnnotationList *list, uint64_t start);
+
+GlyphAtlas *glyph_atlas_get(int font_face, double scale, int thickness, int line_type);
+void glyph_atlas_put(GlyphAtlas *atlas);
+void glyph_atlas_release_idle(void);
+CvSize glyph_atlas_measure(GlyphAtlas *atlas, const char *text, int *base_line);
+void glyph_atlas_draw(GlyphAtlas *atlas, CvMat *mask, CvPoint org, const char *text);
+
+int annotation_get_grid(json_object *obj, Annotation *a, AnnotationArena *arena);
+int annotation_get_colormap(json_object *obj, int *colormap);
+int heatmap_prepare(DrawItem *item, AnnotationArena *arena);
+void draw_heatmap(Overlay *ov, DrawItem *item, CvRect clip);
+int mask_item(CvMat *mat, DrawItem *item, Overlay *ov);
+int mask_image(CvMat *mat, AnnotationList *list, Overlay *ov);
+int mask_image_buffer(unsigned char *buffer, int width, int height, int pixel_format, AnnotationList *list,
+		      Overlay *ov);
+
+void parser_reset(AnnotationParser *parser, AnnotationCallback callback, void *data, AnnotationArena *arena);
+int parse_annotation(json_object *obj, Annotation *annotation, AnnotationArena *arena);
+void release_annotation(Annotation *a, AnnotationArena *arena);
+int prepare_item(DrawItem *item, int width, int height, AnnotationArena *arena);
+void release_item(DrawItem *item, AnnotationArena *arena);
+AnnotationList *create_annotation_list(int width, int height, int quality, AnnotationArena *arena);
+int list_add_annotation(AnnotationList *list, Annotation *a, int debug);
+AnnotationList *compile_annotation(const char *commands, int width, int height, int debug, int quality,
+				   AnnotationParser **keep, AnnotationArena *arena);
+AnnotationList *compile_annotation_binary(const void *data, size_t size, int width, int height, int quality,
+					  AnnotationArena *arena);
+AnnotationList *compile_annotation_tracks(AnnotationTracks *tracks, int64_t time, int width, int height,
+					  int quality, AnnotationArena *arena);
+void draw_item(Overlay *ov, DrawItem *item);
+void draw_item_clip(Overlay *ov, DrawItem *item, CvRect clip, CvPoint *pts);
+void draw_tile(Overlay *ov, AnnotationList *list, CvRect tile, CvPoint *pts, AnnotationStats *stats);
+void draw_annotation_list(Overlay *ov, AnnotationList *list);
+int apply_annotation(Overlay *ov, CvMat *mat, AnnotationList *list);
+int apply_annotation_buffer(Overlay *ov, unsigned char *buffer, int width, int height, int pixel_format,
+			    AnnotationList *list);
+
+#endif //_MNANNOTATE_PRIV_H_
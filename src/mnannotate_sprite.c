@@ -0,0 +1,360 @@
+/*
+ * This file is part of media-utis
+ *
+ * Media-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Media-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with media-utils; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "mnannotate_priv.h"
+
+#define DEFAULT_MAX_SPRITES	16
+
+#define FNV_OFFSET_BASIS	0xcbf29ce484222325ULL
+#define FNV_PRIME		0x100000001b3ULL
+
+
+/*
+ * Overlay rendered from a static annotation document for a frame size
+ */
+typedef struct _overlay_sprite {
+    char *id;			/* Caller ID, NULL when keyed by the document */
+    char *document;		/* Copy of the document, compared on a hash hit */
+    uint64_t hash;		/* Hash of the document */
+    size_t length;		/* Length of the document */
+    int width, height;		/* Frame size */
+    Overlay overlay;		/* Rendered annotations, kept across composites */
+    AnnotationList *masks;	/* Compiled document if it has privacy masks */
+    unsigned int last_use;
+} OverlaySprite;
+
+struct _annotation_cache {
+    OverlaySprite *sprites;
+    int count;
+    int max_count;
+    unsigned int clock;		/* Use counter for LRU replacement */
+    AnnotationContext *ctx;	/* Settings the sprites are compiled with, NULL for defaults */
+    Overlay scratch;		/* Sprite and dynamic annotations of a frame */
+};
+
+
+static uint64_t
+document_hash(const char *str, size_t *length)
+{
+    const unsigned char *p;
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    for (p = (const unsigned char *)str; *p; p++) {
+	hash ^= *p;
+	hash *= FNV_PRIME;
+    }
+    *length = p - (const unsigned char *)str;
+
+    return hash;
+}
+
+
+static void
+sprite_release(OverlaySprite *sprite)
+{
+    free(sprite->id);
+    free(sprite->document);
+    overlay_free(&sprite->overlay);
+    ReleaseAnnotation(&sprite->masks);
+    memset(sprite, 0, sizeof(OverlaySprite));
+}
+
+
+/*
+ * Counters of the context of the cache, NULL when off
+ */
+static AnnotationStats *
+cache_stats(AnnotationCache *cache)
+{
+    return (cache->ctx && cache->ctx->stats) ? &cache->ctx->workers[0].stats : NULL;
+}
+
+
+/*
+ * Render the document into the sprite overlay
+ */
+static int
+sprite_render(AnnotationCache *cache, OverlaySprite *sprite, const char *commands)
+{
+    AnnotationList *list;
+
+    overlay_free(&sprite->overlay);
+    ReleaseAnnotation(&sprite->masks);
+
+    list = CompileAnnotationContext(cache->ctx, commands, sprite->width, sprite->height);
+    if (!list)
+	return -1;
+
+    if (overlay_init(&sprite->overlay, list->bounds) < 0) {
+	ReleaseAnnotation(&list);
+	return -1;
+    }
+
+    sprite->overlay.stats = cache_stats(cache);
+    draw_annotation_list(&sprite->overlay, list);
+
+    /*
+     * Privacy masks are applied to every frame, keep what they need
+     */
+    if (list->num_masks)
+	sprite->masks = list;
+    else
+	ReleaseAnnotation(&list);
+
+    return 0;
+}
+
+
+/*
+ * Whether the sprite was rendered from the document, the hash only rules
+ * documents out and a hit is confirmed against the stored copy
+ */
+static int
+sprite_match(OverlaySprite *sprite, const char *commands, uint64_t hash, size_t length)
+{
+    return sprite->hash == hash && sprite->length == length &&
+	   sprite->document && !strcmp(sprite->document, commands);
+}
+
+
+/*
+ * Keep a copy of the document the sprite is rendered from
+ */
+static int
+sprite_set_document(OverlaySprite *sprite, const char *commands, uint64_t hash, size_t length)
+{
+    free(sprite->document);
+    sprite->document = (char *)malloc(length + 1);
+    if (!sprite->document)
+	return -1;
+    memcpy(sprite->document, commands, length + 1);
+    sprite->hash = hash;
+    sprite->length = length;
+
+    return 0;
+}
+
+
+/*
+ * Find the sprite of a document for a frame size, rendering it on a miss or
+ * when the document of the caller ID has changed
+ */
+static OverlaySprite *
+sprite_lookup(AnnotationCache *cache, const char *id, const char *commands, int width, int height)
+{
+    OverlaySprite *sprite, *victim = NULL;
+    uint64_t hash;
+    size_t length;
+    int i;
+
+    hash = document_hash(commands, &length);
+
+    for (i = 0; i < cache->count; i++) {
+	sprite = &cache->sprites[i];
+	if (sprite->width != width || sprite->height != height)
+	    continue;
+
+	if (id ? (sprite->id && !strcmp(sprite->id, id)) :
+		 (!sprite->id && sprite_match(sprite, commands, hash, length)))
+	    break;
+    }
+
+    if (i < cache->count) {
+	sprite = &cache->sprites[i];
+	if (!sprite_match(sprite, commands, hash, length)) {
+	    /*
+	     * The document of the ID has changed
+	     */
+	    if (sprite_set_document(sprite, commands, hash, length) < 0 ||
+		sprite_render(cache, sprite, commands) < 0) {
+		sprite_release(sprite);
+		sprite->width = -1;
+		return NULL;
+	    }
+	}
+	sprite->last_use = ++cache->clock;
+
+	return sprite;
+    }
+
+    /*
+     * Take a free slot or replace the least recently used sprite
+     */
+    if (cache->count < cache->max_count) {
+	victim = &cache->sprites[cache->count++];
+    } else {
+	victim = &cache->sprites[0];
+	for (i = 1; i < cache->count; i++)
+	    if (cache->sprites[i].last_use < victim->last_use)
+		victim = &cache->sprites[i];
+	sprite_release(victim);
+    }
+
+    victim->id = id ? strdup(id) : NULL;
+    victim->width = width;
+    victim->height = height;
+    victim->last_use = ++cache->clock;
+
+    if ((id && !victim->id) || sprite_set_document(victim, commands, hash, length) < 0 ||
+	sprite_render(cache, victim, commands) < 0) {
+	sprite_release(victim);
+	victim->width = -1;
+	return NULL;
+    }
+
+    return victim;
+}
+
+
+/*
+ * Create a cache of up to max_sprites sprites, compiled with the settings
+ * of the context which must outlive the cache, or the defaults if NULL
+ */
+AnnotationCache *
+CreateAnnotationCache(AnnotationContext *ctx, int max_sprites)
+{
+    AnnotationCache *cache;
+
+    cache = (AnnotationCache *)calloc(1, sizeof(AnnotationCache));
+    if (!cache)
+	return NULL;
+
+    cache->ctx = ctx;
+    cache->max_count = (max_sprites > 0) ? max_sprites : DEFAULT_MAX_SPRITES;
+    cache->sprites = (OverlaySprite *)calloc(cache->max_count, sizeof(OverlaySprite));
+    if (!cache->sprites) {
+	free(cache);
+	return NULL;
+    }
+
+    return cache;
+}
+
+
+void
+ReleaseAnnotationCache(AnnotationCache **cache)
+{
+    int i;
+
+    if (!cache || !*cache)
+	return;
+
+    for (i = 0; i < (*cache)->count; i++)
+	sprite_release(&(*cache)->sprites[i]);
+    overlay_free(&(*cache)->scratch);
+
+    free((*cache)->sprites);
+    free(*cache);
+    *cache = NULL;
+}
+
+
+/*
+ * Annotate an image with a static document and optional per-frame dynamic
+ * annotations. The document is rendered once per frame size into a cached
+ * sprite, keyed by the caller ID when given or by the document itself, and
+ * later frames only composite the sprite. The dynamic list is drawn on top.
+ */
+int
+AnnotateImageCached(CvMat *mat, AnnotationCache *cache, const char *id, const char *commands,
+		    AnnotationList *dynamic)
+{
+    OverlaySprite *sprite;
+    Overlay *ov = &cache->scratch;
+    AnnotationStats *stats;
+    CvRect area;
+    uint64_t start;
+    int x1, y1, res;
+
+    if (!mat || !cache || !commands)
+	return -1;
+
+    if (dynamic && (mat->cols != dynamic->width || mat->rows != dynamic->height)) {
+	fprintf(stderr, "Error: Annotation compiled for %dx%d, image is %dx%d\n",
+		dynamic->width, dynamic->height, mat->cols, mat->rows);
+	return -1;
+    }
+
+    if (overlay_check_image(mat) < 0)
+	return -1;
+
+    sprite = sprite_lookup(cache, id, commands, mat->cols, mat->rows);
+    if (!sprite)
+	return -1;
+
+    stats = cache_stats(cache);
+    sprite->overlay.stats = stats;
+    ov->stats = stats;
+    if (stats)
+	stats->frames++;
+
+    /*
+     * Privacy masks change the frame under the overlays
+     */
+    if (mask_image(mat, sprite->masks, &sprite->overlay) < 0 ||
+	(dynamic && mask_image(mat, dynamic, &sprite->overlay) < 0))
+	return -1;
+
+    if (!dynamic || dynamic->count == 0 || dynamic->bounds.width <= 0) {
+	start = stats ? stats_clock() : 0;
+	res = overlay_composite(&sprite->overlay, mat, 1);
+	if (stats)
+	    stats->composite_time += stats_clock() - start;
+	return res;
+    }
+
+    /*
+     * Copy the sprite into an overlay covering both and draw the dynamic
+     * annotations over it. The overlay is reused frame after frame, the
+     * composite leaves it transparent.
+     */
+    area = dynamic->bounds;
+    if (sprite->overlay.area.width > 0) {
+	x1 = area.x + area.width;
+	y1 = area.y + area.height;
+	if (sprite->overlay.area.x + sprite->overlay.area.width > x1)
+	    x1 = sprite->overlay.area.x + sprite->overlay.area.width;
+	if (sprite->overlay.area.y + sprite->overlay.area.height > y1)
+	    y1 = sprite->overlay.area.y + sprite->overlay.area.height;
+	if (sprite->overlay.area.x < area.x)
+	    area.x = sprite->overlay.area.x;
+	if (sprite->overlay.area.y < area.y)
+	    area.y = sprite->overlay.area.y;
+	area.width = x1 - area.x;
+	area.height = y1 - area.y;
+    }
+
+    if (overlay_prepare(ov, area) < 0) {
+	fprintf(stderr, "Error: Failed to allocate annotation overlay\n");
+	return -1;
+    }
+
+    overlay_copy(ov, &sprite->overlay);
+    draw_annotation_list(ov, dynamic);
+
+    start = stats ? stats_clock() : 0;
+    res = overlay_composite(ov, mat, 0);
+    if (stats)
+	stats->composite_time += stats_clock() - start;
+
+    return res;
+}
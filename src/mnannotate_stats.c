@@ -0,0 +1,216 @@
+/*
+ * This file is part of media-utis
+ *
+ * Media-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Media-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with media-utils; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mnannotate_priv.h"
+
+static const char *op_names[ANNOTATION_OP_COUNT] = {
+    "label", "rectangle", "line", "circle", "ellipse", "polygon", "heatmap", "blur", "pixelate"
+};
+
+
+uint64_t
+stats_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+ * Count an item drawn or masked over an area of the frame since start
+ */
+void
+stats_item(AnnotationStats *stats, DrawItem *item, CvRect area, uint64_t start)
+{
+    AnnotationOpStats *op;
+
+    if (item->a.op < 0 || item->a.op >= ANNOTATION_OP_COUNT)
+	return;
+
+    op = &stats->ops[item->a.op];
+    op->drawn++;
+    op->pixels += (uint64_t)area.width * area.height;
+    op->time += stats_clock() - start;
+}
+
+
+/*
+ * Count a list compiled since start
+ */
+void
+stats_list(AnnotationStats *stats, AnnotationList *list, uint64_t start)
+{
+    DrawItem *item;
+
+    stats->lists++;
+    stats->parse_time += stats_clock() - start;
+
+    if (!list)
+	return;
+
+    for (item = list->items; item < list->items + list->count; item++)
+	if (item->a.op >= 0 && item->a.op < ANNOTATION_OP_COUNT)
+	    stats->ops[item->a.op].compiled++;
+}
+
+
+/*
+ * Start or stop counting what the context compiles and draws, the counters
+ * are kept when stopped
+ */
+void
+EnableAnnotationStats(AnnotationContext *ctx, int enable)
+{
+    if (ctx)
+	ctx->stats = enable;
+}
+
+
+void
+ResetAnnotationStats(AnnotationContext *ctx)
+{
+    int i;
+
+    if (!ctx)
+	return;
+
+    for (i = 0; i < ctx->num_workers; i++)
+	memset(&ctx->workers[i].stats, 0, sizeof(AnnotationStats));
+}
+
+
+static void
+stats_add(AnnotationStats *stats, const AnnotationStats *w)
+{
+    int op;
+
+    stats->lists += w->lists;
+    stats->frames += w->frames;
+    stats->parse_time += w->parse_time;
+    stats->mask_time += w->mask_time;
+    stats->draw_time += w->draw_time;
+    stats->composite_time += w->composite_time;
+    stats->composite_bytes += w->composite_bytes;
+
+    for (op = 0; op < ANNOTATION_OP_COUNT; op++) {
+	stats->ops[op].compiled += w->ops[op].compiled;
+	stats->ops[op].drawn += w->ops[op].drawn;
+	stats->ops[op].pixels += w->ops[op].pixels;
+	stats->ops[op].time += w->ops[op].time;
+    }
+}
+
+
+/*
+ * Sum the counters of the context workers. Query between frames, the
+ * workers update their counters while annotating.
+ */
+int
+GetAnnotationStats(AnnotationContext *ctx, AnnotationStats *stats)
+{
+    int i;
+
+    if (!ctx || !stats)
+	return -1;
+
+    memset(stats, 0, sizeof(AnnotationStats));
+
+    for (i = 0; i < ctx->num_workers; i++)
+	stats_add(stats, &ctx->workers[i].stats);
+
+    return 0;
+}
+
+
+/*
+ * Add the counters of a context to another one, e.g. to dump the total of
+ * contexts used by several threads. Neither may be annotating.
+ */
+void
+MergeAnnotationStats(AnnotationContext *ctx, AnnotationContext *from)
+{
+    AnnotationStats stats;
+
+    if (!ctx || GetAnnotationStats(from, &stats) < 0)
+	return;
+
+    stats_add(&ctx->workers[0].stats, &stats);
+}
+
+
+static json_object *
+json_time(uint64_t ns)
+{
+    return json_object_new_double(ns / 1e6);
+}
+
+
+/*
+ * Dump the counters of the context as a JSON string to free(), times in
+ * milliseconds:
+ * { "lists": N, "frames": N, "parse_ms": T, "mask_ms": T, "draw_ms": T,
+ *   "composite_ms": T, "composite_bytes": N,
+ *   "ops": { "rectangle": { "compiled": N, "drawn": N, "pixels": N, "ms": T }, ... } }
+ * Operations never compiled nor drawn are left out.
+ */
+char *
+DumpAnnotationStats(AnnotationContext *ctx)
+{
+    AnnotationStats stats;
+    json_object *jobj, *ops, *obj;
+    char *str;
+    int op;
+
+    if (GetAnnotationStats(ctx, &stats) < 0)
+	return NULL;
+
+    jobj = json_object_new_object();
+    json_object_object_add(jobj, "lists", json_object_new_int64(stats.lists));
+    json_object_object_add(jobj, "frames", json_object_new_int64(stats.frames));
+    json_object_object_add(jobj, "parse_ms", json_time(stats.parse_time));
+    json_object_object_add(jobj, "mask_ms", json_time(stats.mask_time));
+    json_object_object_add(jobj, "draw_ms", json_time(stats.draw_time));
+    json_object_object_add(jobj, "composite_ms", json_time(stats.composite_time));
+    json_object_object_add(jobj, "composite_bytes", json_object_new_int64(stats.composite_bytes));
+
+    ops = json_object_new_object();
+    for (op = 0; op < ANNOTATION_OP_COUNT; op++) {
+	if (!stats.ops[op].compiled && !stats.ops[op].drawn)
+	    continue;
+
+	obj = json_object_new_object();
+	json_object_object_add(obj, "compiled", json_object_new_int64(stats.ops[op].compiled));
+	json_object_object_add(obj, "drawn", json_object_new_int64(stats.ops[op].drawn));
+	json_object_object_add(obj, "pixels", json_object_new_int64(stats.ops[op].pixels));
+	json_object_object_add(obj, "ms", json_time(stats.ops[op].time));
+	json_object_object_add(ops, op_names[op], obj);
+    }
+    json_object_object_add(jobj, "ops", ops);
+
+    str = strdup(json_object_to_json_string(jobj));
+    json_object_put(jobj);
+
+    return str;
+}
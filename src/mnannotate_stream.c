@@ -0,0 +1,442 @@
+/*
+ * This file is part of media-utis
+ *
+ * Media-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Media-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with media-utils; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mnannotate_priv.h"
+
+#define PARSER_CHUNK_SIZE	4096
+#define PARSER_KEY_LEN		32
+
+
+/*
+ * Incremental scanner of an annotation document. Only the objects of the
+ * top level "annotations" array are captured, one at a time, and handed to
+ * json-c as each completes; everything else is skipped by depth.
+ */
+struct _annotation_parser {
+    AnnotationCallback callback;
+    void *data;
+
+    int depth;			/* Nesting of objects and arrays */
+    int in_string;
+    int escape;
+    int seen;			/* Anything but white space seen */
+
+    int expect_key;		/* Next string of the top object is a key */
+    int key_capture;
+    char key[PARSER_KEY_LEN];
+    int key_len;
+    int value_pending;		/* The value of "annotations" comes next */
+    int in_annotations;		/* Inside the "annotations" array */
+
+    char *element;		/* Annotation object being captured */
+    size_t length;
+    size_t capacity;
+    int capture;
+
+    int count;			/* Annotations emitted */
+    int error;
+
+    json_tokener *tok;		/* Kept from annotation to annotation */
+    AnnotationArena *arena;	/* Where the annotations are allocated */
+};
+
+
+AnnotationParser *
+CreateAnnotationParser(AnnotationCallback callback, void *data)
+{
+    AnnotationParser *parser;
+
+    if (!callback)
+	return NULL;
+
+    parser = (AnnotationParser *)calloc(1, sizeof(AnnotationParser));
+    if (!parser)
+	return NULL;
+
+    parser->callback = callback;
+    parser->data = data;
+
+    return parser;
+}
+
+
+void
+ReleaseAnnotationParser(AnnotationParser **parser)
+{
+    if (!parser || !*parser)
+	return;
+
+    if ((*parser)->tok)
+	json_tokener_free((*parser)->tok);
+    free((*parser)->element);
+    free(*parser);
+    *parser = NULL;
+}
+
+
+/*
+ * Start a new document with the parser, the capture buffer and tokener are
+ * kept
+ */
+void
+parser_reset(AnnotationParser *parser, AnnotationCallback callback, void *data, AnnotationArena *arena)
+{
+    char *element = parser->element;
+    size_t capacity = parser->capacity;
+    json_tokener *tok = parser->tok;
+
+    memset(parser, 0, sizeof(AnnotationParser));
+    parser->callback = callback;
+    parser->data = data;
+    parser->element = element;
+    parser->capacity = capacity;
+    parser->tok = tok;
+    parser->arena = arena;
+}
+
+
+static int
+parser_append(AnnotationParser *parser, char c)
+{
+    char *element;
+    size_t capacity;
+
+    if (parser->length + 1 >= parser->capacity) {
+	capacity = parser->capacity ? parser->capacity * 2 : PARSER_CHUNK_SIZE;
+	element = (char *)realloc(parser->element, capacity);
+	if (!element)
+	    return -1;
+	parser->element = element;
+	parser->capacity = capacity;
+    }
+
+    parser->element[parser->length++] = c;
+
+    return 0;
+}
+
+
+/*
+ * Parse the captured object and hand the annotation to the callback. The
+ * ROI, label and grid are released afterwards unless the callback took them.
+ */
+static int
+parser_emit(AnnotationParser *parser)
+{
+    json_object *obj;
+    Annotation a;
+    int res;
+
+    parser->element[parser->length] = '\0';
+
+    if (!parser->tok) {
+	parser->tok = json_tokener_new();
+	if (!parser->tok)
+	    return -1;
+    }
+
+    json_tokener_reset(parser->tok);
+    obj = json_tokener_parse_ex(parser->tok, parser->element, parser->length);
+    if (obj && json_tokener_get_error(parser->tok) != json_tokener_success) {
+	json_object_put(obj);
+	obj = NULL;
+    }
+    if (!obj) {
+	fprintf(stderr, "Warning: Skip malformed annotation %d\n", parser->count);
+	return 0;
+    }
+
+    if (parse_annotation(obj, &a, parser->arena) < 0) {
+	json_object_put(obj);
+	return 0;
+    }
+
+    /*
+     * The label belongs to the JSON object
+     */
+    if (a.label)
+	a.label = arena_strdup(parser->arena, a.label);
+    json_object_put(obj);
+
+    res = parser->callback(parser->data, &a);
+    release_annotation(&a, parser->arena);
+    parser->count++;
+
+    return res;
+}
+
+
+/*
+ * Scan the next chunk of the document, annotations are emitted as their
+ * objects complete
+ */
+int
+FeedAnnotationParser(AnnotationParser *parser, const char *buffer, size_t length)
+{
+    const char *p;
+    char c;
+
+    if (!parser || parser->error)
+	return -1;
+
+    for (p = buffer; p < buffer + length; p++) {
+	c = *p;
+
+	if (parser->capture && parser_append(parser, c) < 0)
+	    goto fail;
+
+	if (parser->in_string) {
+	    if (parser->escape) {
+		parser->escape = 0;
+	    } else if (c == '\\') {
+		parser->escape = 1;
+	    } else if (c == '"') {
+		parser->in_string = 0;
+		if (parser->key_capture) {
+		    parser->key[parser->key_len] = '\0';
+		    parser->key_capture = 0;
+		}
+	    } else if (parser->key_capture && parser->key_len < PARSER_KEY_LEN - 1) {
+		parser->key[parser->key_len++] = c;
+	    }
+	    continue;
+	}
+
+	if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+	    continue;
+
+	parser->seen = 1;
+
+	/*
+	 * First token of a top level value
+	 */
+	if (parser->depth == 1 && parser->value_pending) {
+	    parser->value_pending = 0;
+	    if (c == '[') {
+		parser->in_annotations = 1;
+		parser->depth++;
+		continue;
+	    }
+	}
+
+	switch (c) {
+	    case '"':
+		parser->in_string = 1;
+		if (parser->depth == 1 && parser->expect_key) {
+		    parser->expect_key = 0;
+		    parser->key_capture = 1;
+		    parser->key_len = 0;
+		}
+		break;
+
+	    case ':':
+		if (parser->depth == 1)
+		    parser->value_pending = !strcmp(parser->key, "annotations");
+		break;
+
+	    case ',':
+		if (parser->depth == 1)
+		    parser->expect_key = 1;
+		break;
+
+	    case '{':
+	    case '[':
+		if (parser->depth == 2 && parser->in_annotations && c == '{') {
+		    parser->capture = 1;
+		    parser->length = 0;
+		    if (parser_append(parser, c) < 0)
+			goto fail;
+		}
+
+		if (parser->depth == 0 && c != '{')
+		    goto fail;
+
+		parser->depth++;
+		if (parser->depth == 1)
+		    parser->expect_key = 1;
+		break;
+
+	    case '}':
+	    case ']':
+		if (--parser->depth < 0)
+		    goto fail;
+
+		if (parser->capture && parser->depth == 2) {
+		    parser->capture = 0;
+		    if (parser_emit(parser) < 0)
+			goto fail;
+		}
+
+		if (parser->in_annotations && parser->depth == 1)
+		    parser->in_annotations = 0;
+		break;
+
+	    default:
+		break;
+	}
+    }
+
+    return 0;
+
+fail:
+    parser->error = 1;
+    return -1;
+}
+
+
+/*
+ * Check the whole document was seen
+ */
+int
+FinishAnnotationParser(AnnotationParser *parser)
+{
+    if (!parser || parser->error || !parser->seen)
+	return -1;
+
+    if (parser->depth != 0 || parser->in_string) {
+	fprintf(stderr, "Error: Annotation document is truncated after %d annotations\n", parser->count);
+	return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Feed a whole file, read in chunks, and finish the document
+ */
+int
+FeedAnnotationFile(AnnotationParser *parser, FILE *fh)
+{
+    char buffer[PARSER_CHUNK_SIZE];
+    size_t n;
+
+    while ((n = fread(buffer, 1, sizeof(buffer), fh)) > 0) {
+	if (FeedAnnotationParser(parser, buffer, n) < 0)
+	    return -1;
+    }
+
+    if (ferror(fh))
+	return -1;
+
+    return FinishAnnotationParser(parser);
+}
+
+
+typedef struct _stream_render {
+    Overlay *ov;
+    CvMat *mat;
+    int width, height;
+    int quality;		/* Forced on every annotation, or ANNOTATION_QUALITY_AUTO */
+    int failed;			/* A privacy mask could not be applied */
+} StreamRender;
+
+
+static int
+render_callback(void *data, Annotation *a)
+{
+    StreamRender *render = (StreamRender *)data;
+    DrawItem item;
+
+    memset(&item, 0, sizeof(DrawItem));
+    item.a = *a;
+    a->roi = NULL;
+    a->label = NULL;
+    a->grid = NULL;
+    if (render->quality != ANNOTATION_QUALITY_AUTO)
+	item.a.quality = render->quality;
+
+    /*
+     * Privacy masks go straight to the image, the overlay is composited
+     * over it at the end. A mask that fails stops the document.
+     */
+    if (prepare_item(&item, render->width, render->height, NULL) == 0) {
+	draw_item(render->ov, &item);
+	if (mask_item(render->mat, &item, render->ov) < 0)
+	    render->failed = 1;
+    }
+    release_item(&item, NULL);
+
+    return render->failed ? -1 : 0;
+}
+
+
+/*
+ * Annotate an image with a document read in chunks: each annotation is
+ * drawn on the overlay as soon as its object has arrived, and the overlay
+ * is blended once the document is complete. What arrived of a truncated
+ * document is still drawn, but a privacy mask that fails aborts it. The
+ * quality of the context applies, if any.
+ */
+int
+AnnotateImageFileContext(AnnotationContext *ctx, CvMat *mat, FILE *fh)
+{
+    AnnotationParser *parser;
+    StreamRender render;
+    Overlay ov;
+    int res;
+
+    if (!mat || !fh || overlay_check_image(mat) < 0)
+	return -1;
+
+    if (overlay_init(&ov, cvRect(0, 0, mat->cols, mat->rows)) < 0) {
+	fprintf(stderr, "Error: Failed to allocate annotation overlay\n");
+	return -1;
+    }
+
+    render.ov = &ov;
+    render.mat = mat;
+    render.width = mat->cols;
+    render.height = mat->rows;
+    render.quality = ctx ? ctx->quality : ANNOTATION_QUALITY_AUTO;
+    render.failed = 0;
+
+    parser = CreateAnnotationParser(render_callback, &render);
+    if (!parser) {
+	overlay_free(&ov);
+	return -1;
+    }
+
+    res = FeedAnnotationFile(parser, fh);
+    ReleaseAnnotationParser(&parser);
+
+    /*
+     * An image whose mask failed must not be exported, leave the caller
+     * nothing worth saving
+     */
+    if (render.failed) {
+	overlay_free(&ov);
+	return -1;
+    }
+
+    if (overlay_composite(&ov, mat, 0) < 0)
+	res = -1;
+    overlay_free(&ov);
+
+    return res;
+}
+
+
+int
+AnnotateImageFile(CvMat *mat, FILE *fh)
+{
+    return AnnotateImageFileContext(NULL, mat, fh);
+}
@@ -0,0 +1,267 @@
+/*
+ * This file is part of media-utis
+ *
+ * Media-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Media-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with media-utils; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "mnannotate_priv.h"
+
+/*
+ * Advances are measured on a run of the same glyph for sub-pixel precision
+ */
+#define GLYPH_MEASURE_RUN	16
+
+/*
+ * Atlases no compiled list uses that are kept for the next lists, label
+ * scales following the box sizes would otherwise build atlases forever
+ */
+#define MAX_IDLE_ATLASES	16
+
+
+/*
+ * Atlases are shared by every annotation of the process, most recently used
+ * first, and never change once built. Lists hold a reference on the atlases
+ * of their labels.
+ */
+static GlyphAtlas *atlases = NULL;
+static pthread_mutex_t atlas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int
+glyph_index(unsigned char c)
+{
+    return (c < GLYPH_FIRST || c >= GLYPH_FIRST + GLYPH_COUNT) ? '?' - GLYPH_FIRST : c - GLYPH_FIRST;
+}
+
+
+/*
+ * Rasterize every printable ASCII glyph once with the Hershey font
+ */
+static GlyphAtlas *
+glyph_atlas_build(int font_face, double scale, int thickness, int line_type)
+{
+    GlyphAtlas *atlas;
+    CvFont font;
+    CvSize size;
+    CvMat full, cell;
+    char run[GLYPH_MEASURE_RUN + 1];
+    int i, max_advance = 0, margin;
+
+    atlas = (GlyphAtlas *)calloc(1, sizeof(GlyphAtlas));
+    if (!atlas)
+	return NULL;
+
+    atlas->font_face = font_face;
+    atlas->scale = scale;
+    atlas->thickness = thickness;
+    atlas->line_type = line_type;
+
+    cvInitFont(&font, font_face, scale, scale, 0, thickness, line_type);
+
+    /*
+     * Height and base line of Hershey fonts don't depend on the text
+     */
+    cvGetTextSize("A", &font, &size, &atlas->base_line);
+    atlas->height = size.height;
+
+    for (i = 0; i < GLYPH_COUNT; i++) {
+	memset(run, GLYPH_FIRST + i, GLYPH_MEASURE_RUN);
+	run[GLYPH_MEASURE_RUN] = '\0';
+	cvGetTextSize(run, &font, &size, NULL);
+
+	atlas->advance[i] = (size.width - thickness) * GLYPH_SUBPIXEL / GLYPH_MEASURE_RUN;
+	if (atlas->advance[i] < 0)
+	    atlas->advance[i] = 0;
+	if (atlas->advance[i] > max_advance)
+	    max_advance = atlas->advance[i];
+    }
+
+    margin = thickness + 2;
+    atlas->origin_x = margin;
+    atlas->origin_y = margin + atlas->height;
+    atlas->cell_width = max_advance / GLYPH_SUBPIXEL + 1 + thickness + 2*margin;
+    atlas->cell_height = atlas->origin_y + atlas->base_line + margin;
+    atlas->step = atlas->cell_width * GLYPH_COUNT;
+
+    atlas->coverage = (unsigned char *)calloc(atlas->cell_height, atlas->step);
+    if (!atlas->coverage) {
+	free(atlas);
+	return NULL;
+    }
+
+    full = cvMat(atlas->cell_height, atlas->step, CV_8UC1, atlas->coverage);
+    for (i = 0; i < GLYPH_COUNT; i++) {
+	run[0] = GLYPH_FIRST + i;
+	run[1] = '\0';
+	cvGetSubRect(&full, &cell, cvRect(i * atlas->cell_width, 0, atlas->cell_width, atlas->cell_height));
+	cvPutText(&cell, run, cvPoint(atlas->origin_x, atlas->origin_y), &font, cvScalarAll(255));
+    }
+
+    return atlas;
+}
+
+
+static void
+glyph_atlas_free(GlyphAtlas *atlas)
+{
+    free(atlas->coverage);
+    free(atlas);
+}
+
+
+/*
+ * Free the least recently used atlases nothing references beyond the first
+ * keep ones, with the lock held
+ */
+static void
+glyph_atlas_trim(int keep)
+{
+    GlyphAtlas **link, *atlas;
+    int idle = 0;
+
+    for (link = &atlases; (atlas = *link) != NULL; ) {
+	if (atlas->refs == 0 && ++idle > keep) {
+	    *link = atlas->next;
+	    glyph_atlas_free(atlas);
+	    continue;
+	}
+	link = &atlas->next;
+    }
+}
+
+
+/*
+ * Find or build the atlas of a font and take a reference on it, see
+ * glyph_atlas_put()
+ */
+GlyphAtlas *
+glyph_atlas_get(int font_face, double scale, int thickness, int line_type)
+{
+    GlyphAtlas **link, *atlas;
+
+    pthread_mutex_lock(&atlas_lock);
+
+    for (link = &atlases; (atlas = *link) != NULL; link = &atlas->next) {
+	if (atlas->font_face == font_face && atlas->scale == scale &&
+	    atlas->thickness == thickness && atlas->line_type == line_type)
+	    break;
+    }
+
+    if (atlas)
+	*link = atlas->next;
+    else
+	atlas = glyph_atlas_build(font_face, scale, thickness, line_type);
+
+    if (atlas) {
+	atlas->refs++;
+	atlas->next = atlases;
+	atlases = atlas;
+    }
+
+    pthread_mutex_unlock(&atlas_lock);
+
+    return atlas;
+}
+
+
+/*
+ * Drop a reference taken by glyph_atlas_get(), the atlas stays cached
+ * while it is among the most recently used
+ */
+void
+glyph_atlas_put(GlyphAtlas *atlas)
+{
+    if (!atlas)
+	return;
+
+    pthread_mutex_lock(&atlas_lock);
+    if (--atlas->refs == 0)
+	glyph_atlas_trim(MAX_IDLE_ATLASES);
+    pthread_mutex_unlock(&atlas_lock);
+}
+
+
+/*
+ * Free every atlas no list uses
+ */
+void
+glyph_atlas_release_idle(void)
+{
+    pthread_mutex_lock(&atlas_lock);
+    glyph_atlas_trim(0);
+    pthread_mutex_unlock(&atlas_lock);
+}
+
+
+/*
+ * Text size from the cached metrics, as cvGetTextSize() reports it
+ */
+CvSize
+glyph_atlas_measure(GlyphAtlas *atlas, const char *text, int *base_line)
+{
+    const unsigned char *p;
+    int pen = 0;
+
+    for (p = (const unsigned char *)text; *p; p++)
+	pen += atlas->advance[glyph_index(*p)];
+
+    if (base_line)
+	*base_line = atlas->base_line;
+
+    return cvSize((pen + GLYPH_SUBPIXEL/2) / GLYPH_SUBPIXEL + atlas->thickness, atlas->height);
+}
+
+
+/*
+ * Blit the glyph coverage into the mask with the base line starting at org,
+ * like cvPutText() draws it
+ */
+void
+glyph_atlas_draw(GlyphAtlas *atlas, CvMat *mask, CvPoint org, const char *text)
+{
+    const unsigned char *p;
+    unsigned char *src, *dst;
+    int pen = 0;
+    int x0, y0, cx0, cy0, cx1, cy1, x, y, g;
+
+    for (p = (const unsigned char *)text; *p; p++) {
+	g = glyph_index(*p);
+
+	/*
+	 * Cell position in the mask, clipped
+	 */
+	x0 = org.x + (pen + GLYPH_SUBPIXEL/2) / GLYPH_SUBPIXEL - atlas->origin_x;
+	y0 = org.y - atlas->origin_y;
+	pen += atlas->advance[g];
+
+	cx0 = (x0 < 0) ? -x0 : 0;
+	cy0 = (y0 < 0) ? -y0 : 0;
+	cx1 = (x0 + atlas->cell_width > mask->cols) ? mask->cols - x0 : atlas->cell_width;
+	cy1 = (y0 + atlas->cell_height > mask->rows) ? mask->rows - y0 : atlas->cell_height;
+	if (cx0 >= cx1 || cy0 >= cy1)
+	    continue;
+
+	for (y = cy0; y < cy1; y++) {
+	    src = atlas->coverage + y * atlas->step + g * atlas->cell_width;
+	    dst = mask->data.ptr + (y0 + y) * mask->step + x0;
+	    for (x = cx0; x < cx1; x++)
+		dst[x] = (src[x] > dst[x]) ? src[x] : dst[x];
+	}
+    }
+}
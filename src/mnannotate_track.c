@@ -0,0 +1,342 @@
+/*
+ * This file is part of media-utis
+ *
+ * Media-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Media-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with media-utils; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "mnannotate_priv.h"
+
+
+/*
+ * Position of the annotation at a time
+ */
+typedef struct _track_key {
+    int64_t time;
+    Point *roi;
+    int np;
+} TrackKey;
+
+/*
+ * Annotation shown over a time range, moving from key to key
+ */
+typedef struct _track {
+    int64_t start, end;
+    Annotation a;		/* Everything but the position */
+    TrackKey *keys;		/* Sorted by time */
+    int num_keys;
+} Track;
+
+struct _annotation_tracks {
+    Track *tracks;
+    int count;
+};
+
+
+static int
+key_compare(const void *a, const void *b)
+{
+    const TrackKey *ka = (const TrackKey *)a;
+    const TrackKey *kb = (const TrackKey *)b;
+
+    return (ka->time > kb->time) - (ka->time < kb->time);
+}
+
+
+static void
+track_release(Track *track)
+{
+    int i;
+
+    for (i = 0; i < track->num_keys; i++)
+	free(track->keys[i].roi);
+    free(track->keys);
+    release_annotation(&track->a, NULL);
+}
+
+
+/*
+ * Load one track object:
+ * { "start": ms, "end": ms, "annotation": { ... }, "keys": [ { "t": ms, "roi": [ ... ] }, ... ] }
+ * The range defaults to the one of the keys, the position to the ROI of the
+ * annotation when there is no key.
+ */
+static int
+track_load(json_object *obj, Track *track)
+{
+    json_object *val, *keys;
+    Annotation key;
+    int i, n, start_seen = 0, end_seen = 0;
+
+    memset(track, 0, sizeof(Track));
+
+    if (!json_object_is_type(obj, json_type_object) || !json_object_object_get_ex(obj, "annotation", &val) ||
+	!json_object_is_type(val, json_type_object) || parse_annotation(val, &track->a, NULL) < 0) {
+	fprintf(stderr, "Warning: Skip annotation track without annotation object\n");
+	return -1;
+    }
+
+    /*
+     * The label belongs to the JSON object
+     */
+    if (track->a.label)
+	track->a.label = strdup(track->a.label);
+
+    if (json_object_object_get_ex(obj, "start", &val)) {
+	track->start = json_object_get_int64(val);
+	start_seen = 1;
+    }
+    if (json_object_object_get_ex(obj, "end", &val)) {
+	track->end = json_object_get_int64(val);
+	end_seen = 1;
+    }
+
+    if (json_object_object_get_ex(obj, "keys", &keys) && json_object_is_type(keys, json_type_array)) {
+	n = json_object_array_length(keys);
+	track->keys = (TrackKey *)calloc(n ? n : 1, sizeof(TrackKey));
+	if (!track->keys) {
+	    track_release(track);
+	    return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+	    val = json_object_array_get_idx(keys, i);
+	    if (!json_object_is_type(val, json_type_object) || parse_annotation(val, &key, NULL) < 0)
+		continue;
+
+	    /*
+	     * Only the ROI of a key is used, its label belongs to the JSON object
+	     */
+	    key.label = NULL;
+	    if (key.np <= 0) {
+		release_annotation(&key, NULL);
+		continue;
+	    }
+	    free(key.grid);
+
+	    track->keys[track->num_keys].roi = key.roi;
+	    track->keys[track->num_keys].np = key.np;
+	    if (json_object_object_get_ex(val, "t", &val))
+		track->keys[track->num_keys].time = json_object_get_int64(val);
+	    track->num_keys++;
+	}
+
+	qsort(track->keys, track->num_keys, sizeof(TrackKey), key_compare);
+    }
+
+    if (track->num_keys == 0 && track->a.np <= 0) {
+	fprintf(stderr, "Warning: Skip annotation track without position\n");
+	track_release(track);
+	return -1;
+    }
+
+    if (!start_seen)
+	track->start = track->num_keys ? track->keys[0].time : INT64_MIN;
+    if (!end_seen)
+	track->end = track->num_keys ? track->keys[track->num_keys - 1].time : INT64_MAX;
+
+    return 0;
+}
+
+
+/*
+ * Load the "tracks" of an annotation document. Times are in milliseconds of
+ * the media, the same as the grab time. Return NULL if there is no track.
+ */
+AnnotationTracks *
+LoadAnnotationTracks(const char *document)
+{
+    AnnotationTracks *tracks;
+    json_object *jobj, *array;
+    int i, n;
+
+    if (!document)
+	return NULL;
+
+    jobj = json_tokener_parse(document);
+    if (!jobj)
+	return NULL;
+
+    if (!json_object_object_get_ex(jobj, "tracks", &array) || !json_object_is_type(array, json_type_array) ||
+	(n = json_object_array_length(array)) == 0) {
+	json_object_put(jobj);
+	return NULL;
+    }
+
+    tracks = (AnnotationTracks *)calloc(1, sizeof(AnnotationTracks));
+    if (!tracks) {
+	json_object_put(jobj);
+	return NULL;
+    }
+
+    tracks->tracks = (Track *)calloc(n, sizeof(Track));
+    if (!tracks->tracks) {
+	free(tracks);
+	json_object_put(jobj);
+	return NULL;
+    }
+
+    for (i = 0; i < n; i++) {
+	if (track_load(json_object_array_get_idx(array, i), &tracks->tracks[tracks->count]) == 0)
+	    tracks->count++;
+    }
+
+    json_object_put(jobj);
+
+    if (tracks->count == 0)
+	ReleaseAnnotationTracks(&tracks);
+
+    return tracks;
+}
+
+
+void
+ReleaseAnnotationTracks(AnnotationTracks **tracks)
+{
+    int i;
+
+    if (!tracks || !*tracks)
+	return;
+
+    for (i = 0; i < (*tracks)->count; i++)
+	track_release(&(*tracks)->tracks[i]);
+
+    free((*tracks)->tracks);
+    free(*tracks);
+    *tracks = NULL;
+}
+
+
+/*
+ * Position of a track at a time, interpolated linearly between the keys
+ * around it. Keys with a different number of points switch at the later key.
+ */
+static int
+track_position(Track *track, int64_t time, Point *roi)
+{
+    TrackKey *k0, *k1;
+    double f;
+    int i;
+
+    if (track->num_keys == 0) {
+	memcpy(roi, track->a.roi, track->a.np * sizeof(Point));
+	return track->a.np;
+    }
+
+    for (i = 1; i < track->num_keys && track->keys[i].time <= time; i++)
+	;
+    k0 = &track->keys[i - 1];
+
+    if (i == track->num_keys || time <= k0->time || track->keys[i].np != k0->np) {
+	memcpy(roi, k0->roi, k0->np * sizeof(Point));
+	return k0->np;
+    }
+
+    k1 = &track->keys[i];
+    f = (double)(time - k0->time) / (k1->time - k0->time);
+    for (i = 0; i < k0->np; i++) {
+	roi[i].x = k0->roi[i].x + (k1->roi[i].x - k0->roi[i].x) * f;
+	roi[i].y = k0->roi[i].y + (k1->roi[i].y - k0->roi[i].y) * f;
+    }
+
+    return k0->np;
+}
+
+
+static int
+track_max_points(Track *track)
+{
+    int i, np = track->a.np;
+
+    for (i = 0; i < track->num_keys; i++)
+	if (track->keys[i].np > np)
+	    np = track->keys[i].np;
+
+    return np;
+}
+
+
+/*
+ * Compile the tracks shown at a time for a frame size, allocated from the
+ * arena or the heap if NULL
+ */
+AnnotationList *
+compile_annotation_tracks(AnnotationTracks *tracks, int64_t time, int width, int height, int quality,
+			  AnnotationArena *arena)
+{
+    AnnotationList *list;
+    Track *track;
+    Annotation a;
+    size_t grid_size;
+    int i;
+
+    if (!tracks)
+	return NULL;
+
+    list = create_annotation_list(width, height, quality, arena);
+    if (!list)
+	return NULL;
+
+    for (i = 0; i < tracks->count; i++) {
+	track = &tracks->tracks[i];
+	if (time < track->start || time > track->end)
+	    continue;
+
+	a = track->a;
+	a.label = track->a.label ? arena_strdup(arena, track->a.label) : NULL;
+	a.roi = (Point *)arena_alloc(arena, track_max_points(track) * sizeof(Point));
+	a.grid = NULL;
+	if (track->a.grid) {
+	    grid_size = (size_t)a.grid_width * a.grid_height;
+	    a.grid = (unsigned char *)arena_alloc(arena, grid_size);
+	    if (a.grid)
+		memcpy(a.grid, track->a.grid, grid_size);
+	}
+	if (!a.roi || (track->a.label && !a.label) || (track->a.grid && !a.grid)) {
+	    release_annotation(&a, arena);
+	    ReleaseAnnotation(&list);
+	    return NULL;
+	}
+	a.np = track_position(track, time, a.roi);
+
+	/*
+	 * Tracks are compiled for every frame, keep it quiet
+	 */
+	if (list_add_annotation(list, &a, 0) < 0) {
+	    release_annotation(&a, arena);
+	    ReleaseAnnotation(&list);
+	    return NULL;
+	}
+	release_annotation(&a, arena);
+    }
+
+    return list;
+}
+
+
+/*
+ * Compile the tracks shown at a time, in milliseconds, for a frame size.
+ * Tracks are only read, frames may be compiled concurrently. See
+ * CompileAnnotationTracksFrame() to compile frame after frame without
+ * allocating.
+ */
+AnnotationList *
+CompileAnnotationTracks(AnnotationTracks *tracks, int64_t time, int width, int height)
+{
+    return compile_annotation_tracks(tracks, time, width, height, ANNOTATION_QUALITY_AUTO, NULL);
+}
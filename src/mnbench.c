@@ -0,0 +1,442 @@
+/*
+ * This file is part of media-utis
+ *
+ * Media-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Media-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with media-utils; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include "mnannotate.h"
+
+#define DEFAULT_ITERATIONS	20
+#define MIN_BENCH_NS		200000000LL	/* Repeat short cases for at least 0.2s */
+
+typedef struct _bench_op {
+    const char *name;
+    int op;
+} BenchOp;
+
+static const BenchOp bench_ops[] = {
+    { "text",		OL_LABEL },
+    { "rectangle",	OL_RECTANGLE },
+    { "line",		OL_LINE },
+    { "ellipse",	OL_ELLIPSE },
+    { "circle",		OL_CIRCLE },
+    { "polygon",	OL_POLYGON },
+};
+
+#define NUM_BENCH_OPS	(int)(sizeof(bench_ops)/sizeof(bench_ops[0]))
+
+static const int frame_sizes[][2] = {
+    { 640, 360 },
+    { 1280, 720 },
+    { 1920, 1080 },
+};
+
+#define NUM_FRAME_SIZES	(int)(sizeof(frame_sizes)/sizeof(frame_sizes[0]))
+
+static const double shape_sizes[] = { 0.02, 0.2 };	/* Relative to the frame */
+static const int shape_alphas[] = { 255, 128 };
+static const int shape_counts[] = { 1, 16, 256 };
+
+#define NUM_SHAPE_SIZES		(int)(sizeof(shape_sizes)/sizeof(shape_sizes[0]))
+#define NUM_SHAPE_ALPHAS	(int)(sizeof(shape_alphas)/sizeof(shape_alphas[0]))
+#define NUM_SHAPE_COUNTS	(int)(sizeof(shape_counts)/sizeof(shape_counts[0]))
+
+
+static void
+print_usage(void)
+{
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Usage: mnbench [OPTION]...\n");
+    fprintf(stderr, "Measure the annotation engine, per primitive and for JSON parsing.\n");
+    fprintf(stderr, "  -j       JSON parsing and compiling only\n");
+    fprintf(stderr, "  -n       minimum iterations of each case (default %d)\n", DEFAULT_ITERATIONS);
+    fprintf(stderr, "  -p       primitive (text|rectangle|line|ellipse|circle|polygon), default all\n");
+    fprintf(stderr, "  -q       annotation quality (aa|fast|auto)\n");
+    fprintf(stderr, "  -s       frame dimension, default 640x360, 1280x720 and 1920x1080\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Examples:  mnbench -p rectangle -s 1920x1080\n");
+    fprintf(stderr, "\n");
+}
+
+
+static long long
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/*
+ * Deterministic positions, every run draws the same document
+ */
+static double
+bench_random(unsigned int *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+
+    return ((*seed >> 8) & 0xffff) / 65536.0;
+}
+
+
+static int
+doc_append(char **doc, size_t *length, size_t *capacity, const char *fmt, ...)
+{
+    va_list ap;
+    char *p;
+    int n;
+
+    for (;;) {
+	va_start(ap, fmt);
+	n = vsnprintf(*doc + *length, *capacity - *length, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+	    return -1;
+	if (*length + n < *capacity)
+	    break;
+
+	p = (char *)realloc(*doc, *capacity * 2 + n);
+	if (!p)
+	    return -1;
+	*doc = p;
+	*capacity = *capacity * 2 + n;
+    }
+    *length += n;
+
+    return 0;
+}
+
+
+/*
+ * Annotation document of count shapes of one primitive
+ */
+static char *
+build_document(int op, int count, double size, int alpha, int width, int height)
+{
+    unsigned int seed = 1;
+    size_t length = 0, capacity = 4096;
+    char *doc;
+    double x, y, w, h;
+    int i, res;
+
+    doc = (char *)malloc(capacity);
+    if (!doc)
+	return NULL;
+
+    res = doc_append(&doc, &length, &capacity, "{ \"annotations\": [");
+
+    for (i = 0; i < count && res == 0; i++) {
+	x = bench_random(&seed) * (1 - size);
+	y = bench_random(&seed) * (1 - size);
+	w = size;
+	h = size * width / height;
+	if (y + h > 1)
+	    y = 1 - h;
+	if (y < 0)
+	    y = 0;
+
+	res = doc_append(&doc, &length, &capacity, "%s{ \"op\": %d, \"argb\": [%d, 255, 128, 0], \"bold\": 2, ",
+			 i ? ", " : "", op, alpha);
+	if (res < 0)
+	    break;
+
+	switch (op) {
+	    case OL_LABEL:
+		res = doc_append(&doc, &length, &capacity,
+				 "\"label\": \"person 0.%02d\", \"scale\": %.1f, \"roi\": [{\"x\": %f, \"y\": %f}] }",
+				 i % 100, size * 20, x, y + h);
+		break;
+
+	    case OL_RECTANGLE:
+		res = doc_append(&doc, &length, &capacity,
+				 "\"fill\": [%d, 0, 128, 255], \"roi\": [{\"x\": %f, \"y\": %f}, {\"x\": %f, \"y\": %f}] }",
+				 alpha, x, y, x + w, y + h);
+		break;
+
+	    case OL_LINE:
+		res = doc_append(&doc, &length, &capacity,
+				 "\"roi\": [{\"x\": %f, \"y\": %f}, {\"x\": %f, \"y\": %f}] }",
+				 x, y, x + w, y + h);
+		break;
+
+	    case OL_ELLIPSE:
+		res = doc_append(&doc, &length, &capacity,
+				 "\"phi\": [30, 0, 360], \"roi\": [{\"x\": %f, \"y\": %f}, {\"x\": %f, \"y\": %f}] }",
+				 x + w/2, y + h/2, w/2, h/3);
+		break;
+
+	    case OL_CIRCLE:
+		res = doc_append(&doc, &length, &capacity,
+				 "\"roi\": [{\"x\": %f, \"y\": %f}, {\"x\": %f, \"y\": %f}] }",
+				 x + w/2, y + h/2, x + w, y + h/2);
+		break;
+
+	    default:
+		res = doc_append(&doc, &length, &capacity,
+				 "\"roi\": [{\"x\": %f, \"y\": %f}, {\"x\": %f, \"y\": %f}, {\"x\": %f, \"y\": %f}, "
+				 "{\"x\": %f, \"y\": %f}, {\"x\": %f, \"y\": %f}] }",
+				 x + w/2, y, x + w, y + h/3, x + w*0.8, y + h, x + w*0.2, y + h, x, y + h/3);
+		break;
+	}
+    }
+
+    if (res == 0)
+	res = doc_append(&doc, &length, &capacity, "] }");
+    if (res < 0) {
+	free(doc);
+	return NULL;
+    }
+
+    return doc;
+}
+
+
+/*
+ * Draw the document on a frame until both the iterations and the minimum
+ * time are reached
+ */
+static int
+bench_draw(AnnotationContext *ctx, const BenchOp *op, int width, int height, double size, int alpha, int count,
+	   int iterations)
+{
+    AnnotationStats stats;
+    AnnotationList *list;
+    CvMat *image;
+    char *doc;
+    long long start, elapsed;
+    int n = 0;
+
+    doc = build_document(op->op, count, size, alpha, width, height);
+    if (!doc)
+	return -1;
+
+    image = cvCreateMat(height, width, CV_8UC3);
+    list = CompileAnnotationContext(ctx, doc, width, height);
+    free(doc);
+    if (!image || !list) {
+	fprintf(stderr, "Error: Failed to set up %s %dx%d\n", op->name, width, height);
+	if (image)
+	    cvReleaseMat(&image);
+	ReleaseAnnotation(&list);
+	return -1;
+    }
+    cvSet(image, cvScalar(64, 96, 128, 0), NULL);
+
+    /*
+     * Warm up the overlay and the glyph atlases. Every frame blends the same
+     * bytes, they are counted on this one only so the timed loop runs
+     * without the counters.
+     */
+    ResetAnnotationStats(ctx);
+    EnableAnnotationStats(ctx, 1);
+    ApplyAnnotationContext(ctx, image, list);
+    EnableAnnotationStats(ctx, 0);
+    GetAnnotationStats(ctx, &stats);
+
+    start = now_ns();
+    do {
+	ApplyAnnotationContext(ctx, image, list);
+	n++;
+	elapsed = now_ns() - start;
+    } while (n < iterations || elapsed < MIN_BENCH_NS);
+
+    printf("%-10s %5dx%-5d %5.2f %5d %5d %12.1f %10.1f\n", op->name, width, height, size, alpha, count,
+	   (double)elapsed / n / count, (double)stats.composite_bytes * n / (elapsed / 1e9) / 1e6);
+
+    ReleaseAnnotation(&list);
+    cvReleaseMat(&image);
+
+    return 0;
+}
+
+
+static int
+parse_callback(void *data, Annotation *a)
+{
+    return 0;
+}
+
+
+/*
+ * JSON only: scanning and parsing the document, then compiling it for a
+ * frame without drawing
+ */
+static int
+bench_json(AnnotationContext *ctx, int width, int height, int count, int iterations)
+{
+    AnnotationParser *parser;
+    AnnotationList *list;
+    char *doc;
+    size_t length;
+    long long start, parse_ns, compile_ns;
+    int n;
+
+    doc = build_document(OL_RECTANGLE, count, 0.02, 255, width, height);
+    if (!doc)
+	return -1;
+    length = strlen(doc);
+
+    n = 0;
+    start = now_ns();
+    do {
+	parser = CreateAnnotationParser(parse_callback, NULL);
+	if (!parser || FeedAnnotationParser(parser, doc, length) < 0 || FinishAnnotationParser(parser) < 0) {
+	    fprintf(stderr, "Error: Failed to parse the benchmark document\n");
+	    ReleaseAnnotationParser(&parser);
+	    free(doc);
+	    return -1;
+	}
+	ReleaseAnnotationParser(&parser);
+	n++;
+	parse_ns = now_ns() - start;
+    } while (n < iterations || parse_ns < MIN_BENCH_NS);
+    printf("%-10s %5dx%-5d %5s %5s %5d %12.1f %10.1f\n", "parse", width, height, "-", "-", count,
+	   (double)parse_ns / n / count, (double)length * n / (parse_ns / 1e9) / 1e6);
+
+    n = 0;
+    start = now_ns();
+    do {
+	list = CompileAnnotationContext(ctx, doc, width, height);
+	ReleaseAnnotation(&list);
+	n++;
+	compile_ns = now_ns() - start;
+    } while (n < iterations || compile_ns < MIN_BENCH_NS);
+    printf("%-10s %5dx%-5d %5s %5s %5d %12.1f %10.1f\n", "compile", width, height, "-", "-", count,
+	   (double)compile_ns / n / count, (double)length * n / (compile_ns / 1e9) / 1e6);
+
+    free(doc);
+
+    return 0;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    const char *op_str = NULL;
+    char *dimension_str = NULL;
+    int iterations = DEFAULT_ITERATIONS, json_only = 0, width = 0, height = 0;
+    int quality = ANNOTATION_QUALITY_AUTO;
+    AnnotationContext *ctx;
+    int i, f, s, a, c, res = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hjn:p:q:s:")) != -1) {
+	switch (opt) {
+	    case 'j':
+		json_only = 1;
+		break;
+
+	    case 'n':
+		iterations = atoi(optarg);
+		break;
+
+	    case 'p':
+		op_str = optarg;
+		break;
+
+	    case 'q':
+		quality = ParseAnnotationQuality(optarg);
+		if (quality < 0) {
+		    fprintf(stderr, "Error: Invalid annotation quality %s\n", optarg);
+		    print_usage();
+		    exit (1);
+		}
+		break;
+
+	    case 's':
+		dimension_str = optarg;
+		break;
+
+	    case '?':
+		if (isprint(optopt))
+		    fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+		else
+		    fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+		exit (1);
+
+	    case 'h':
+	    default:
+		print_usage();
+		exit (1);
+	}
+    }
+
+    if (dimension_str && (sscanf(dimension_str, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)) {
+	fprintf(stderr, "Error: Invalid dimension %s\n", dimension_str);
+	exit (1);
+    }
+
+    if (op_str) {
+	for (i = 0; i < NUM_BENCH_OPS && strcmp(op_str, bench_ops[i].name); i++)
+	    ;
+	if (i == NUM_BENCH_OPS) {
+	    fprintf(stderr, "Error: Unknown primitive %s\n", op_str);
+	    exit (1);
+	}
+    }
+
+    /*
+     * Debug messages of the library would be most of what is measured
+     */
+    ctx = CreateAnnotationContext(1);
+    if (!ctx)
+	exit (1);
+    SetAnnotationDebug(ctx, 0);
+    SetAnnotationQuality(ctx, quality);
+
+    /*
+     * ns/shape is the time of one shape, MB/s the frame bytes the composite
+     * blends, or the document bytes for parsing
+     */
+    printf("%-10s %11s %5s %5s %5s %12s %10s\n", "case", "frame", "size", "alpha", "count", "ns/shape", "MB/s");
+
+    for (f = 0; f < (dimension_str ? 1 : NUM_FRAME_SIZES); f++) {
+	if (!dimension_str) {
+	    width = frame_sizes[f][0];
+	    height = frame_sizes[f][1];
+	}
+
+	for (c = 0; c < NUM_SHAPE_COUNTS; c++)
+	    if (bench_json(ctx, width, height, shape_counts[c], iterations) < 0)
+		res = 1;
+
+	for (i = 0; i < NUM_BENCH_OPS && !json_only; i++) {
+	    if (op_str && strcmp(op_str, bench_ops[i].name))
+		continue;
+
+	    for (s = 0; s < NUM_SHAPE_SIZES; s++)
+		for (a = 0; a < NUM_SHAPE_ALPHAS; a++)
+		    for (c = 0; c < NUM_SHAPE_COUNTS; c++)
+			if (bench_draw(ctx, &bench_ops[i], width, height, shape_sizes[s], shape_alphas[a],
+				       shape_counts[c], iterations) < 0)
+			    res = 1;
+	}
+    }
+
+    ReleaseAnnotationContext(&ctx);
+
+    exit(res);
+}
@@ -24,6 +24,12 @@
 #include <fcntl.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <strings.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+#include <libavutil/imgutils.h>
 #include "mnannotate.h"
 
 #define DEBUG	1
@@ -36,22 +42,790 @@
 
 static debug = 1;
 
+#define JPEG_QSCALE	2	/* MJPEG quantizer, about the default JPEG quality */
+
+#define MAX_SHARED_LISTS	16	/* Frame sizes the shared document is kept compiled for */
+#define BATCH_LINE_LEN		4096
+
 static void
 print_usage(void)
 {
     fprintf(stderr, "\n");
     fprintf(stderr, "Usage: mndraw [OPTION]... [FILE]\n");
     fprintf(stderr, "Draw graph annotation on an image file.\n");
+    fprintf(stderr, "  -b       binary annotation file, instead of JSON from stdin\n");
     fprintf(stderr, "  -d       turn on debug message\n");
     fprintf(stderr, "  -f       pixel format (yuv420|yuv422|nv12) for raw image input file)\n");
+    fprintf(stderr, "  -i       frame index in a raw input file of concatenated frames\n");
+    fprintf(stderr, "  -j       number of batch worker threads, default all cores\n");
+    fprintf(stderr, "  -l       batch of images: a list file of \"input output [annotation.json]\" lines,\n");
+    fprintf(stderr, "           or a directory whose images are saved as JPEG into the -o directory,\n");
+    fprintf(stderr, "           each with the annotation of its .json sibling if any\n");
     fprintf(stderr, "  -o       output image file\n");
+    fprintf(stderr, "  -q       annotation quality (aa|fast|auto), overrides the one of each annotation\n");
     fprintf(stderr, "  -s       dimension of the raw image input file\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Examples:  cat annotation.json | mndraw -f yuv420 -s 1280x720 cam0_H_yuv420p.raw -o cam0_H_yuv420p.jpg\n");
+    fprintf(stderr, "           cat annotation.json | mndraw -f yuv420 -s 1280x720 -l captures -o reports\n");
     fprintf(stderr, "\n");
 }
 
 
+static int
+is_jpeg_file(const char *filename)
+{
+    const char *ext = strrchr(filename, '.');
+
+    return ext && (!strcasecmp(ext, ".jpg") || !strcasecmp(ext, ".jpeg"));
+}
+
+
+/*
+ * Expand a video range IYUV or NV12 frame into the full range planes of a
+ * JPEG frame, chroma of NV12 is deinterleaved on the way
+ */
+static void
+jpeg_frame_fill(AVFrame *frame, const unsigned char *buffer, int width, int height, int pixel_format)
+{
+    unsigned char luma[256], chroma[256];
+    const unsigned char *src, *cb, *cr;
+    unsigned char *u, *v;
+    int x, y, i, val;
+
+    for (i = 0; i < 256; i++) {
+	val = ((i - 16) * 255 + 109) / 219;
+	luma[i] = (val < 0) ? 0 : (val > 255) ? 255 : val;
+	val = ((i - 128) * 255 + ((i < 128) ? -112 : 112)) / 224 + 128;
+	chroma[i] = (val < 0) ? 0 : (val > 255) ? 255 : val;
+    }
+
+    for (y = 0; y < height; y++) {
+	src = buffer + y * width;
+	for (x = 0; x < width; x++)
+	    frame->data[0][y * frame->linesize[0] + x] = luma[src[x]];
+    }
+
+    cb = buffer + width * height;
+    cr = (pixel_format == PIXEL_FORMAT_NV12) ? cb + 1 : cb + (width / 2) * (height / 2);
+    i = (pixel_format == PIXEL_FORMAT_NV12) ? 2 : 1;
+
+    for (y = 0; y < height / 2; y++) {
+	u = frame->data[1] + y * frame->linesize[1];
+	v = frame->data[2] + y * frame->linesize[2];
+	for (x = 0; x < width / 2; x++) {
+	    u[x] = chroma[cb[(y * (width / 2) + x) * i]];
+	    v[x] = chroma[cr[(y * (width / 2) + x) * i]];
+	}
+    }
+}
+
+
+/*
+ * MJPEG encoder and frame of one dimension, reused from image to image
+ */
+typedef struct _jpeg_writer {
+    AVCodecContext *enc_codec_ctx;
+    AVFrame *frame;
+    int width, height;
+} JpegWriter;
+
+
+static void
+jpeg_writer_close(JpegWriter *writer)
+{
+    if (writer->frame) {
+	av_freep(&writer->frame->data[0]);
+	av_frame_free(&writer->frame);
+    }
+    if (writer->enc_codec_ctx) {
+	avcodec_close(writer->enc_codec_ctx);
+	av_free(writer->enc_codec_ctx);
+    }
+    memset(writer, 0, sizeof(JpegWriter));
+}
+
+
+/*
+ * Open an encoder, with thread_count slice threads or 0 for one per core
+ */
+static int
+jpeg_writer_open(JpegWriter *writer, int width, int height, int thread_count)
+{
+    AVCodecContext *enc_codec_ctx;
+    AVCodec *enc_codec;
+
+    memset(writer, 0, sizeof(JpegWriter));
+
+    enc_codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    if (enc_codec == NULL) {
+	fprintf(stderr, "Error: Unsupported encoder codec\n");
+	return -1;
+    }
+
+    enc_codec_ctx = avcodec_alloc_context3(enc_codec);
+    if (!enc_codec_ctx) {
+	fprintf(stderr, "Error: Failed to allocate encoder codec context\n");
+	return -1;
+    }
+
+    enc_codec_ctx->pix_fmt	= PIX_FMT_YUVJ420P;
+    enc_codec_ctx->width	= width;
+    enc_codec_ctx->height	= height;
+    enc_codec_ctx->mb_lmin	= JPEG_QSCALE * FF_QP2LAMBDA;
+    enc_codec_ctx->lmin		= JPEG_QSCALE * FF_QP2LAMBDA;
+    enc_codec_ctx->mb_lmax	= JPEG_QSCALE * FF_QP2LAMBDA;
+    enc_codec_ctx->lmax		= JPEG_QSCALE * FF_QP2LAMBDA;
+    enc_codec_ctx->flags	= CODEC_FLAG_QSCALE;
+    enc_codec_ctx->global_quality = JPEG_QSCALE * FF_QP2LAMBDA;
+    enc_codec_ctx->time_base	= (AVRational){1,25};
+    enc_codec_ctx->thread_count	= thread_count;
+
+    if (avcodec_open2(enc_codec_ctx, enc_codec, NULL) < 0) {
+	fprintf(stderr, "Error: Failed to open codec for encode\n");
+	av_free(enc_codec_ctx);
+	return -1;
+    }
+    writer->enc_codec_ctx = enc_codec_ctx;
+
+    writer->frame = av_frame_alloc();
+    if (!writer->frame ||
+	av_image_alloc(writer->frame->data, writer->frame->linesize, width, height, PIX_FMT_YUVJ420P, 32) < 0) {
+	fprintf(stderr, "Error: Couldn't allocate JPEG frame\n");
+	if (writer->frame)
+	    av_frame_free(&writer->frame);
+	jpeg_writer_close(writer);
+	return -1;
+    }
+    writer->frame->format = PIX_FMT_YUVJ420P;
+    writer->frame->width = width;
+    writer->frame->height = height;
+    writer->frame->quality = enc_codec_ctx->global_quality;
+
+    writer->width = width;
+    writer->height = height;
+
+    return 0;
+}
+
+
+/*
+ * Encode a raw IYUV or NV12 frame as a JPEG file with the MJPEG encoder,
+ * without going through BGR
+ */
+static int
+jpeg_writer_save(JpegWriter *writer, const char *filename, const unsigned char *buffer, int pixel_format)
+{
+    AVPacket image;
+    int image_ready = 0;
+    FILE *fh;
+    int res = -1;
+
+    jpeg_frame_fill(writer->frame, buffer, writer->width, writer->height, pixel_format);
+
+    av_init_packet(&image);
+    image.size = 0;
+    image.data = NULL;
+
+    if (avcodec_encode_video2(writer->enc_codec_ctx, &image, writer->frame, &image_ready) < 0 || !image_ready) {
+	fprintf(stderr, "Error: Failed to encode JPEG image\n");
+	return -1;
+    }
+
+    fh = fopen(filename, "wb");
+    if (fh) {
+	if (fwrite(image.data, image.size, 1, fh) == 1)
+	    res = 0;
+	if (fclose(fh) != 0)
+	    res = -1;
+    }
+    if (res < 0)
+	fprintf(stderr, "Error: Failed to write %s\n", filename);
+    av_free_packet(&image);
+
+    return res;
+}
+
+
+/*
+ * Annotate a frame of a mapped IYUV or NV12 file in YUV and save it as
+ * JPEG, skipping the conversions to and from BGR. The frame is copied into
+ * buffer, the mapping is read-only.
+ */
+static int
+annotate_yuv_jpeg(AnnotationContext *ctx, RawImageFile *raw, int frame_index, AnnotationList *list,
+		  unsigned char *buffer, JpegWriter *writer, int pixel_format, const char *output_file)
+{
+    const unsigned char *frame;
+
+    frame = RawImageFileFrame(raw, frame_index);
+    if (!frame)
+	return -1;
+    memcpy(buffer, frame, ImageBufferSize(writer->width, writer->height, pixel_format));
+
+    /*
+     * A frame whose annotation (and so maybe a privacy mask) failed is
+     * not written
+     */
+    if (!list || ApplyAnnotationBufferContext(ctx, buffer, writer->width, writer->height, pixel_format, list) < 0) {
+	fprintf(stderr, "Error: Failed to draw annotation on %s\n", output_file);
+	return -1;
+    }
+
+    return jpeg_writer_save(writer, output_file, buffer, pixel_format);
+}
+
+
+static int
+draw_yuv_jpeg(AnnotationContext *ctx, const char *input_file, int frame_index, int width, int height,
+	      int pixel_format, const char *binary_file, const char *output_file)
+{
+    RawImageFile *raw;
+    AnnotationList *list;
+    JpegWriter writer;
+    unsigned char *buffer;
+    int res = -1;
+
+    raw = OpenRawImageFile(input_file, width, height, pixel_format);
+    if (!RawImageFileFrame(raw, frame_index)) {
+	fprintf(stderr, "Error: Failed to load image %s\n", input_file);
+	CloseRawImageFile(&raw);
+	return -1;
+    }
+
+    if (binary_file)
+	list = CompileAnnotationBinaryFileContext(ctx, binary_file, width, height);
+    else
+	list = CompileAnnotationFileContext(ctx, stdin, width, height);
+
+    buffer = (unsigned char *)malloc(ImageBufferSize(width, height, pixel_format));
+    if (buffer && jpeg_writer_open(&writer, width, height, 0) == 0) {
+	res = annotate_yuv_jpeg(ctx, raw, frame_index, list, buffer, &writer, pixel_format, output_file);
+	jpeg_writer_close(&writer);
+    }
+
+    free(buffer);
+    ReleaseAnnotation(&list);
+    CloseRawImageFile(&raw);
+
+    return res;
+}
+
+
+/*
+ * Batch of images annotated on a pool of threads. The shared document is
+ * compiled once per frame size, each thread reuses its conversion buffers.
+ */
+typedef struct _batch_job {
+    char *input;
+    char *output;
+    char *annotation;		/* Own JSON document, NULL for the shared one */
+} BatchJob;
+
+typedef struct _shared_list {
+    int width, height;
+    AnnotationList *list;
+} SharedList;
+
+typedef struct _batch {
+    BatchJob *jobs;
+    int count;
+    int capacity;
+
+    int width, height;		/* Dimension of raw input */
+    int pixel_format;
+    char *document;		/* Shared JSON document */
+    const char *binary_file;	/* or shared binary document */
+    int quality;		/* Annotation quality override */
+
+    pthread_mutex_t lock;
+    pthread_mutex_t codec_lock;	/* Held opening a codec, libavcodec has no lock manager */
+    int next;			/* Next job to take */
+    int failed;
+    SharedList lists[MAX_SHARED_LISTS];
+    int num_lists;
+} Batch;
+
+
+static int
+batch_add(Batch *batch, const char *input, const char *output, const char *annotation)
+{
+    BatchJob *jobs, *job;
+    int capacity;
+
+    if (batch->count == batch->capacity) {
+	capacity = batch->capacity ? batch->capacity * 2 : 256;
+	jobs = (BatchJob *)realloc(batch->jobs, capacity * sizeof(BatchJob));
+	if (!jobs)
+	    return -1;
+	batch->jobs = jobs;
+	batch->capacity = capacity;
+    }
+
+    job = &batch->jobs[batch->count];
+    job->input = strdup(input);
+    job->output = strdup(output);
+    job->annotation = annotation ? strdup(annotation) : NULL;
+    if (!job->input || !job->output || (annotation && !job->annotation)) {
+	free(job->input);
+	free(job->output);
+	free(job->annotation);
+	return -1;
+    }
+    batch->count++;
+
+    return 0;
+}
+
+
+static int
+compare_job_output(const void *a, const void *b)
+{
+    return strcmp(((const BatchJob *)a)->output, ((const BatchJob *)b)->output);
+}
+
+
+/*
+ * Reject jobs from first on that would overwrite each other's output, the
+ * jobs are sorted by output
+ */
+static int
+batch_check_outputs(Batch *batch, int first)
+{
+    int i;
+
+    qsort(batch->jobs + first, batch->count - first, sizeof(BatchJob), compare_job_output);
+    for (i = first + 1; i < batch->count; i++) {
+	if (!strcmp(batch->jobs[i - 1].output, batch->jobs[i].output)) {
+	    fprintf(stderr, "Error: %s and %s would both be saved as %s\n", batch->jobs[i - 1].input,
+		    batch->jobs[i].input, batch->jobs[i].output);
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+
+/*
+ * Every image of a directory, saved as <output_dir>/<name>.jpg; the
+ * <name>.json annotation next to an image is used instead of the shared one.
+ * Images of the same name but for the extension would overwrite each other,
+ * such a directory is rejected.
+ */
+static int
+batch_load_directory(Batch *batch, const char *dir, const char *output_dir)
+{
+    DIR *dh;
+    struct dirent *entry;
+    struct stat sb;
+    char input[BATCH_LINE_LEN], output[BATCH_LINE_LEN], annotation[BATCH_LINE_LEN];
+    char *ext;
+    int first = batch->count, res = 0;
+
+    dh = opendir(dir);
+    if (!dh) {
+	fprintf(stderr, "Error: Failed to open directory %s\n", dir);
+	return -1;
+    }
+
+    while ((entry = readdir(dh)) != NULL && res == 0) {
+	if (entry->d_name[0] == '.')
+	    continue;
+
+	ext = strrchr(entry->d_name, '.');
+	if (ext && (!strcasecmp(ext, ".json") || !strcasecmp(ext, ".mnab")))
+	    continue;
+
+	snprintf(input, sizeof(input), "%s/%s", dir, entry->d_name);
+	if (stat(input, &sb) < 0 || !S_ISREG(sb.st_mode))
+	    continue;
+
+	snprintf(output, sizeof(output), "%s/%.*s.jpg", output_dir,
+		 ext ? (int)(ext - entry->d_name) : (int)strlen(entry->d_name), entry->d_name);
+	snprintf(annotation, sizeof(annotation), "%s/%.*s.json", dir,
+		 ext ? (int)(ext - entry->d_name) : (int)strlen(entry->d_name), entry->d_name);
+
+	res = batch_add(batch, input, output, access(annotation, R_OK) == 0 ? annotation : NULL);
+    }
+    closedir(dh);
+
+    if (res < 0)
+	return res;
+
+    return batch_check_outputs(batch, first);
+}
+
+
+/*
+ * List file of "input output [annotation]" lines, blank lines and lines
+ * starting with # are skipped. A list naming the same output twice is
+ * rejected.
+ */
+static int
+batch_load_list(Batch *batch, const char *filename)
+{
+    FILE *fh;
+    char line[BATCH_LINE_LEN], input[BATCH_LINE_LEN], output[BATCH_LINE_LEN], annotation[BATCH_LINE_LEN];
+    int n, first = batch->count, res = 0;
+
+    fh = fopen(filename, "r");
+    if (!fh) {
+	fprintf(stderr, "Error: Failed to open batch list %s\n", filename);
+	return -1;
+    }
+
+    while (res == 0 && fgets(line, sizeof(line), fh)) {
+	n = sscanf(line, "%4095s %4095s %4095s", input, output, annotation);
+	if (n <= 0 || input[0] == '#')
+	    continue;
+	if (n < 2) {
+	    fprintf(stderr, "Warning: Skip batch line without output: %s", line);
+	    continue;
+	}
+	res = batch_add(batch, input, output, (n == 3) ? annotation : NULL);
+    }
+    fclose(fh);
+
+    if (res < 0)
+	return res;
+
+    return batch_check_outputs(batch, first);
+}
+
+
+static char *
+read_document(FILE *fh)
+{
+    char *doc, *p;
+    size_t length = 0, capacity = 0, n;
+
+    doc = NULL;
+    do {
+	if (length + 1 >= capacity) {
+	    capacity = capacity ? capacity * 2 : 64 * 1024;
+	    p = (char *)realloc(doc, capacity);
+	    if (!p) {
+		free(doc);
+		return NULL;
+	    }
+	    doc = p;
+	}
+	n = fread(doc + length, 1, capacity - length - 1, fh);
+	length += n;
+    } while (n > 0);
+
+    doc[length] = '\0';
+
+    return doc;
+}
+
+
+/*
+ * Shared document compiled for a frame size, once for the whole batch while
+ * there is room. Compiled lists are only read while drawing.
+ */
+static AnnotationList *
+batch_shared_list(Batch *batch, AnnotationContext *ctx, int width, int height, int *owned)
+{
+    AnnotationList *list = NULL;
+    int i;
+
+    *owned = 0;
+    pthread_mutex_lock(&batch->lock);
+
+    for (i = 0; i < batch->num_lists && !list; i++)
+	if (batch->lists[i].width == width && batch->lists[i].height == height)
+	    list = batch->lists[i].list;
+
+    if (!list) {
+	if (batch->binary_file)
+	    list = CompileAnnotationBinaryFileContext(ctx, batch->binary_file, width, height);
+	else
+	    list = CompileAnnotationContext(ctx, batch->document, width, height);
+
+	if (list && batch->num_lists < MAX_SHARED_LISTS) {
+	    batch->lists[batch->num_lists].width = width;
+	    batch->lists[batch->num_lists].height = height;
+	    batch->lists[batch->num_lists].list = list;
+	    batch->num_lists++;
+	} else if (list) {
+	    *owned = 1;
+	}
+    }
+
+    pthread_mutex_unlock(&batch->lock);
+
+    return list;
+}
+
+
+static AnnotationList *
+batch_list(Batch *batch, AnnotationContext *ctx, BatchJob *job, int width, int height, int *owned)
+{
+    AnnotationList *list;
+    FILE *fh;
+
+    if (!job->annotation)
+	return batch_shared_list(batch, ctx, width, height, owned);
+
+    fh = fopen(job->annotation, "r");
+    if (!fh) {
+	fprintf(stderr, "Error: Failed to open annotation %s\n", job->annotation);
+	return NULL;
+    }
+    list = CompileAnnotationFileContext(ctx, fh, width, height);
+    fclose(fh);
+    *owned = 1;
+
+    return list;
+}
+
+
+/*
+ * Buffers a batch thread keeps from image to image
+ */
+typedef struct _batch_worker {
+    Batch *batch;
+    pthread_t thread;
+    AnnotationContext *ctx;
+    CvMat *image;		/* BGR image of raw input */
+    unsigned char *buffer;	/* YUV frame for JPEG output */
+    JpegWriter writer;
+} BatchWorker;
+
+
+/*
+ * Open the JPEG writer of a batch thread, codecs are opened one at a time
+ */
+static int
+batch_writer_open(Batch *batch, JpegWriter *writer)
+{
+    int res;
+
+    pthread_mutex_lock(&batch->codec_lock);
+    res = jpeg_writer_open(writer, batch->width, batch->height, 1);
+    pthread_mutex_unlock(&batch->codec_lock);
+
+    return res;
+}
+
+
+static int
+batch_run(BatchWorker *w, BatchJob *job)
+{
+    Batch *batch = w->batch;
+    RawImageFile *raw = NULL;
+    AnnotationList *list;
+    CvMat *image;
+    int owned = 0, res = -1;
+
+    if (batch->pixel_format == PIXEL_FORMAT_NONE) {
+	image = LoadImageFile(job->input, 0, 0, PIXEL_FORMAT_NONE);
+    } else {
+	raw = OpenRawImageFile(job->input, batch->width, batch->height, batch->pixel_format);
+	if (!raw)
+	    goto fail;
+
+	/*
+	 * JPEG output of planar YUV input is encoded without going through BGR
+	 */
+	if (is_jpeg_file(job->output) &&
+	    (batch->pixel_format == PIXEL_FORMAT_IYUV || batch->pixel_format == PIXEL_FORMAT_NV12)) {
+	    if (!w->buffer)
+		w->buffer = (unsigned char *)malloc(ImageBufferSize(batch->width, batch->height, batch->pixel_format));
+	    if (!w->buffer || (!w->writer.enc_codec_ctx && batch_writer_open(batch, &w->writer) < 0))
+		goto fail;
+
+	    list = batch_list(batch, w->ctx, job, batch->width, batch->height, &owned);
+	    res = annotate_yuv_jpeg(w->ctx, raw, 0, list, w->buffer, &w->writer, batch->pixel_format,
+				    job->output);
+	    if (owned)
+		ReleaseAnnotation(&list);
+	    CloseRawImageFile(&raw);
+	    return res;
+	}
+
+	if (!w->image)
+	    w->image = cvCreateMat(batch->height, batch->width, CV_8UC3);
+	if (!w->image || LoadRawImageFrameInto(w->image, raw, 0) < 0)
+	    goto fail;
+	CloseRawImageFile(&raw);
+	image = w->image;
+    }
+
+    if (!image)
+	goto fail;
+
+    list = batch_list(batch, w->ctx, job, image->cols, image->rows, &owned);
+    res = (list && ApplyAnnotationContext(w->ctx, image, list) == 0) ? 0 : -1;
+    if (owned)
+	ReleaseAnnotation(&list);
+
+    if (res < 0) {
+	fprintf(stderr, "Error: Failed to draw annotation on %s\n", job->output);
+    } else {
+	res = cvSaveImage(job->output, image, NULL) ? 0 : -1;
+	if (res < 0)
+	    fprintf(stderr, "Error: Failed to write %s\n", job->output);
+    }
+
+    if (image != w->image)
+	cvReleaseMat(&image);
+
+    return res;
+
+fail:
+    fprintf(stderr, "Error: Failed to load image %s\n", job->input);
+    CloseRawImageFile(&raw);
+
+    return -1;
+}
+
+
+static void *
+batch_thread(void *arg)
+{
+    BatchWorker *w = (BatchWorker *)arg;
+    Batch *batch = w->batch;
+    int i;
+
+    for (;;) {
+	pthread_mutex_lock(&batch->lock);
+	i = batch->next++;
+	pthread_mutex_unlock(&batch->lock);
+	if (i >= batch->count)
+	    break;
+
+	if (batch_run(w, &batch->jobs[i]) < 0) {
+	    pthread_mutex_lock(&batch->lock);
+	    batch->failed++;
+	    pthread_mutex_unlock(&batch->lock);
+	}
+    }
+
+    return NULL;
+}
+
+
+static int
+run_batch(Batch *batch, int num_threads)
+{
+    BatchWorker *workers;
+    int i, started = 0;
+
+    if (num_threads <= 0)
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1)
+	num_threads = 1;
+    if (num_threads > batch->count)
+	num_threads = batch->count;
+
+    workers = (BatchWorker *)calloc(num_threads, sizeof(BatchWorker));
+    if (!workers)
+	return -1;
+
+    for (i = 0; i < num_threads; i++) {
+	workers[i].batch = batch;
+	workers[i].ctx = CreateAnnotationContext(1);
+	if (!workers[i].ctx)
+	    break;
+	SetAnnotationQuality(workers[i].ctx, batch->quality);
+	if (pthread_create(&workers[i].thread, NULL, batch_thread, &workers[i]) != 0) {
+	    ReleaseAnnotationContext(&workers[i].ctx);
+	    break;
+	}
+	started++;
+    }
+
+    /*
+     * Whatever started works through the whole batch
+     */
+    if (started == 0) {
+	fprintf(stderr, "Error: Failed to start batch threads\n");
+	free(workers);
+	return -1;
+    }
+
+    for (i = 0; i < started; i++) {
+	pthread_join(workers[i].thread, NULL);
+	ReleaseAnnotationContext(&workers[i].ctx);
+	if (workers[i].image)
+	    cvReleaseMat(&workers[i].image);
+	free(workers[i].buffer);
+	jpeg_writer_close(&workers[i].writer);
+    }
+    free(workers);
+
+    d_printf("%d images annotated, %d failed\n", batch->count - batch->failed, batch->failed);
+
+    return batch->failed ? -1 : 0;
+}
+
+
+static int
+draw_batch(const char *path, const char *output_dir, int width, int height, int pixel_format,
+	   const char *binary_file, int quality, int num_threads)
+{
+    Batch batch;
+    struct stat sb;
+    int i, res = -1;
+
+    memset(&batch, 0, sizeof(Batch));
+    batch.width = width;
+    batch.height = height;
+    batch.pixel_format = pixel_format;
+    batch.binary_file = binary_file;
+    batch.quality = quality;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_mutex_init(&batch.codec_lock, NULL);
+
+    if (stat(path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+	if (!output_dir) {
+	    fprintf(stderr, "Error: No output directory for %s\n", path);
+	    goto done;
+	}
+	if (batch_load_directory(&batch, path, output_dir) < 0)
+	    goto done;
+    } else if (batch_load_list(&batch, path) < 0) {
+	goto done;
+    }
+
+    if (batch.count == 0) {
+	fprintf(stderr, "Warning: No image in %s\n", path);
+	res = 0;
+	goto done;
+    }
+
+    /*
+     * The shared document is read once, if any image needs it
+     */
+    for (i = 0; i < batch.count && batch.jobs[i].annotation; i++)
+	;
+    if (i < batch.count && !binary_file) {
+	batch.document = read_document(stdin);
+	if (!batch.document)
+	    goto done;
+    }
+
+    res = run_batch(&batch, num_threads);
+
+done:
+    for (i = 0; i < batch.num_lists; i++)
+	ReleaseAnnotation(&batch.lists[i].list);
+    for (i = 0; i < batch.count; i++) {
+	free(batch.jobs[i].input);
+	free(batch.jobs[i].output);
+	free(batch.jobs[i].annotation);
+    }
+    free(batch.jobs);
+    free(batch.document);
+    pthread_mutex_destroy(&batch.codec_lock);
+    pthread_mutex_destroy(&batch.lock);
+
+    return res;
+}
+
+
 int
 main(int argc, char **argv)
 {
@@ -60,13 +834,22 @@ main(int argc, char **argv)
     char *format_str = NULL;
     int pixel_format = PIXEL_FORMAT_NONE;
     char *dimension_str = NULL;
-    int width = 0, height = 0;
-    char *annotation_str = NULL;
-    int len;
+    char *binary_file = NULL;
+    char *batch_path = NULL;
+    int num_threads = 0;
+    int annotation_quality = ANNOTATION_QUALITY_AUTO;
+    AnnotationContext *ctx;
+    AnnotationList *list;
+    RawImageFile *raw;
+    int width = 0, height = 0, frame_index = 0;
 
 
-    while ((c = getopt(argc, argv, "adf:ho:s:")) != -1) {
+    while ((c = getopt(argc, argv, "ab:df:hi:j:l:o:q:s:")) != -1) {
 	switch (c) {
+	    case 'b':
+		binary_file = optarg;
+		break;
+
 	    case 'd':
 		debug = 1;
 		break;
@@ -75,10 +858,31 @@ main(int argc, char **argv)
 		format_str = optarg;
 		break;
 
+	    case 'i':
+		frame_index = atoi(optarg);
+		break;
+
+	    case 'j':
+		num_threads = atoi(optarg);
+		break;
+
+	    case 'l':
+		batch_path = optarg;
+		break;
+
 	    case 'o':
 		output_file = optarg;
 		break;
 
+	    case 'q':
+		annotation_quality = ParseAnnotationQuality(optarg);
+		if (annotation_quality < 0) {
+		    fprintf(stderr, "Error: Invalid annotation quality %s\n", optarg);
+		    print_usage();
+		    exit (1);
+		}
+		break;
+
 	    case 's':
 		dimension_str = optarg;
 		break;
@@ -98,19 +902,11 @@ main(int argc, char **argv)
     }
 
     input_file = argv[optind];
-    if (!input_file) {
+    if (!input_file && !batch_path) {
 	fprintf(stderr, "Error: No input file\n");
 	exit (1);
     }
 
-    annotation_str = (char *)malloc(MAX_ANNOTATION_STRING_LEN+16);
-    if (annotation_str) {
-	len = fread(annotation_str, 1, MAX_ANNOTATION_STRING_LEN, stdin);
-#if 0	
-	printf(">>>> len = %d\n", len);
-#endif
-    }
-
     if (format_str) {
 	if (!strcmp(format_str, "yuv420"))
 	    pixel_format = PIXEL_FORMAT_IYUV;
@@ -128,14 +924,66 @@ main(int argc, char **argv)
 	exit (1);
     }
 
-    image = LoadImageFile(input_file, width, height, pixel_format);
+    avcodec_register_all();
+
+    if (batch_path)
+	exit(draw_batch(batch_path, output_file, width, height, pixel_format, binary_file, annotation_quality,
+			num_threads) ? 1 : 0);
+
+    ctx = CreateAnnotationContext(1);
+    if (!ctx)
+	exit (1);
+    SetAnnotationQuality(ctx, annotation_quality);
+
+    /*
+     * JPEG output of planar YUV input is encoded without going through BGR
+     */
+    if (output_file && is_jpeg_file(output_file) &&
+	(pixel_format == PIXEL_FORMAT_IYUV || pixel_format == PIXEL_FORMAT_NV12))
+	exit(draw_yuv_jpeg(ctx, input_file, frame_index, width, height, pixel_format, binary_file,
+			   output_file) ? 1 : 0);
+
+    if (frame_index) {
+	/*
+	 * Convert the frame straight from the mapping of the file
+	 */
+	raw = OpenRawImageFile(input_file, width, height, pixel_format);
+	image = raw ? cvCreateMat(height, width, CV_8UC3) : NULL;
+	if (image && LoadRawImageFrameInto(image, raw, frame_index) < 0)
+	    cvReleaseMat(&image);
+	CloseRawImageFile(&raw);
+    } else {
+	image = LoadImageFile(input_file, width, height, pixel_format);
+    }
+    if (!image) {
+	fprintf(stderr, "Error: Failed to load image %s\n", input_file);
+	exit (1);
+    }
 #if 0
     cvShowImage("Sensity", image);
     c = cvWaitKey(0);
 #endif
 
-    if (annotation_str)
-	AnnotateImage(image, annotation_str);
+    /*
+     * Nothing is saved when the annotation fails: a privacy mask may be
+     * missing from the image
+     */
+    if (binary_file) {
+	list = CompileAnnotationBinaryFileContext(ctx, binary_file, image->cols, image->rows);
+	if (!list || ApplyAnnotationContext(ctx, image, list) < 0) {
+	    fprintf(stderr, "Error: Failed to draw binary annotation %s\n", binary_file);
+	    exit (1);
+	}
+	ReleaseAnnotation(&list);
+    } else {
+	/*
+	 * The annotation document is drawn from stdin as it arrives
+	 */
+	if (AnnotateImageFileContext(ctx, image, stdin) < 0) {
+	    fprintf(stderr, "Error: Failed to draw annotation document\n");
+	    exit (1);
+	}
+    }
 
 #if 0
     cvShowImage("Sensity", image);
@@ -146,6 +994,7 @@ main(int argc, char **argv)
 	cvSaveImage(output_file, image, NULL);
 
     cvReleaseMat(&image);
+    ReleaseAnnotationContext(&ctx);
 
     exit(0);
 }
@@ -23,42 +23,108 @@
 #include <fcntl.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <string.h>
+#include <pthread.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/mathematics.h>
 #include <libswscale/swscale.h>
 #include <libavutil/avutil.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 #include "mnannotate.h"
+#include "mngrab.h"
+#include "mngrab_cache.h"
 
 #define DEFAULT_MEDIA_BUFFER_SIZE	32*1024
 
-#ifdef DEBUG
-#define d_printf(fmt, args...)    if (debug) fprintf(stderr, fmt, ## args)
-#else
-#define d_printf(fmt, args...)
-#endif
-
-
 #define OUTPUT_IMAGE_YUV	0
 #define OUTPUT_IMAGE_PPM	1
 #define OUTPUT_IMAGE_PNG	2
 #define OUTPUT_IMAGE_JPG	3
 
+#define MAX_IMAGE_OUTPUTS	8
+#define MAX_IMAGE_FILENAME_LEN	256
+
+
+int debug = 0;
+
+
+/*
+ * Conversion of the decoded frame shared by outputs of the same geometry
+ */
+typedef struct _frame_converter {
+    int crop_x, crop_y;		/* Crop area in the decoded frame */
+    int crop_width, crop_height;	/* Zero when not cropped */
+    int width, height;		/* Output dimension */
+    int pixel_format;
+    struct SwsContext *sws_ctx;	/* NULL when a plain copy is enough */
+    AVFrame *frame;		/* Converted frame, planes packed in one buffer */
+    int bufsize;
+    CvMat *image;		/* Annotated BGR image */
+    int64_t serial;		/* Decode serial of the converted frame */
+    int64_t image_serial;	/* Decode serial of the annotated image */
+} FrameConverter;
+
+
+/*
+ * Image generation for one output rendition
+ */
+typedef struct _image_output {
+    int image_format;
+    char *prefix;
+    int annotate;
+    int width, height;		/* Zero to follow the source (aspect ratio) */
+    int crop_x, crop_y;
+    int crop_width, crop_height;	/* Zero when not cropped */
+    int codec_id;
+    int pixel_format;
+    AVCodecContext *enc_codec_ctx;
+    AVCodec *enc_codec;
+    FrameConverter *converter;	/* NULL when encoding the decoded frame directly */
+} ImageOutput;
+
 
-static int debug = 0;
+/*
+ * All renditions generated from each decoded frame
+ */
+typedef struct _output_set {
+    ImageOutput outputs[MAX_IMAGE_OUTPUTS];
+    int num_outputs;
+    FrameConverter converters[MAX_IMAGE_OUTPUTS];
+    int num_converters;
+    char *annotation;
+    AnnotationCache *overlays;	/* Annotation rendered once per output size */
+    AnnotationTracks *tracks;	/* Time-keyed annotations, NULL if none */
+    AnnotationContext *annotation_ctx;	/* Quality and lists of the annotation of the set */
+    AnnotationContext *stats_ctx;	/* Annotation stats of all the sets, NULL if off */
+    int quality;		/* Annotation quality override */
+    int64_t serial;		/* Decode serial of the current frame */
+    int64_t position;		/* Position in microsecond of the current frame */
+    GrabCache *cache;		/* Cache of the generated images */
+} OutputSet;
+
+
+/*
+ * Chunk of frames decoded by one thread in parallel range decode
+ */
+typedef struct _decode_job {
+    MediaInput in;		/* Private demuxer and decoder of the thread */
+    OutputSet output;		/* Private encoders and scalers of the thread */
+    int64_t *pts;		/* Packet timestamps of the frames in the chunk */
+    int64_t *position;		/* Position in microsecond of each generated image */
+    char *written;		/* Frames of the chunk whose images were generated */
+    int first;			/* Index of the first frame of the chunk */
+    int count;			/* Number of frames in the chunk */
+    int started;
+    pthread_t thread;
+} DecodeJob;
 
 
 /*
- * IO context for medianode video record
+ * Sets of the decoding threads add their annotation stats on close
  */
-typedef struct _mio_context {
-    char *filename;
-    AVIOContext *context;
-    uint8_t *buffer;
-    int buffer_size;
-    int fd;
-} MIOContext;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 static int mio_read(void *data, uint8_t *buf, int buf_size);
@@ -223,11 +289,11 @@ mio_seek(void *data, int64_t pos, int whence)
 
 
 static int
-generate_ppm_image(AVCodecContext *ctx, AVFrame *frame, char *filename)
+generate_ppm_image(AVFrame *frame, char *filename)
 {
     FILE *fh;
     int y;
-			
+
 
     fh = fopen(filename, "wb");
     if (!fh) {
@@ -240,13 +306,13 @@ generate_ppm_image(AVCodecContext *ctx, AVFrame *frame, char *filename)
     /*
      * Write header
      */
-    fprintf(fh, "P6\n%d %d\n255\n", ctx->width, ctx->height);
-  
+    fprintf(fh, "P6\n%d %d\n255\n", frame->width, frame->height);
+
     /*
      * Write pixel data
      */
-    for (y = 0; y < ctx->height; y++)
-	fwrite(frame->data[0] + y*frame->linesize[0], 1, ctx->width*3, fh);
+    for (y = 0; y < frame->height; y++)
+	fwrite(frame->data[0] + y*frame->linesize[0], 1, frame->width*3, fh);
 
     fclose(fh);
 
@@ -255,39 +321,14 @@ generate_ppm_image(AVCodecContext *ctx, AVFrame *frame, char *filename)
 
 
 static int
-generate_image_with_annotation(AVCodecContext *ctx, AVFrame *frame, int format, char *filename, char *annotation)
+generate_image_with_annotation(CvMat *image, char *filename)
 {
-    uint8_t *video_data[4] = { NULL };
-    int video_linesize[4];
-    int video_bufsize;
-    CvMat *image;
-
-    /*
-     * Allocate image buffer for the decoded image
-     */
-    video_bufsize = av_image_alloc(video_data, video_linesize, ctx->width, ctx->height, ctx->pix_fmt, 1);
-    if (video_bufsize < 0) {
-	d_printf("Error: Failed to allocate raw video buffer\n");
+    if (!image) {
+	fprintf(stderr, "Error: Failed to annotate image %s\n", filename);
 	return -1;
     }
 
-    d_printf("##### Generate raw video image ... %s\n", filename);
-
-    /*
-     * copy decoded frame to raw video buffer:
-     * this is required since rawvideo expects non aligned data
-     */
-    av_image_copy(video_data, video_linesize,
-		  (const uint8_t **)(frame->data), frame->linesize, ctx->pix_fmt, ctx->width, ctx->height);
-
-    image = LoadImageBuffer(video_data[0], ctx->width, ctx->height, PIXEL_FORMAT_IYUV);
-#if 0
-    cvShowImage("Sensity", image);
-    cvWaitKey(0);
-#endif
-
-    if (annotation)
-	AnnotateImage(image, annotation);
+    d_printf("##### Generate annotated image ... %s\n", filename);
 
 #if 0
     cvShowImage("Sensity", image);
@@ -297,22 +338,18 @@ generate_image_with_annotation(AVCodecContext *ctx, AVFrame *frame, int format,
     if (filename)
 	cvSaveImage(filename, image, NULL);
 
-    cvReleaseMat(&image);
-
-    av_free(video_data[0]);
-
     return 0;
 }
 
 
+/*
+ * Write a frame whose planes are packed in one buffer without alignment
+ */
 static int
-generate_raw_image(AVCodecContext *ctx, AVFrame *frame, char *filename)
+generate_raw_image(AVFrame *frame, int bufsize, char *filename)
 {
     FILE *fh;
-    uint8_t *video_data[4] = { NULL };
-    int video_linesize[4];
-    int video_bufsize;
-			
+
 
     fh = fopen(filename, "wb");
     if (!fh) {
@@ -320,29 +357,11 @@ generate_raw_image(AVCodecContext *ctx, AVFrame *frame, char *filename)
 	return 0;
     }
 
-    /* 
-     * Allocate image buffer for the decoded image
-     */
-    video_bufsize = av_image_alloc(video_data, video_linesize, ctx->width, ctx->height, ctx->pix_fmt, 1);
-    if (video_bufsize < 0) {
-	d_printf("Error: Failed to allocate raw video buffer\n");
-	return -1;
-    }
-
     d_printf("##### Generate raw video image ... %s\n", filename);
 
-    /* 
-     * copy decoded frame to raw video buffer:
-     * this is required since rawvideo expects non aligned data
-     */
-    av_image_copy(video_data, video_linesize,
-		  (const uint8_t **)(frame->data), frame->linesize, ctx->pix_fmt, ctx->width, ctx->height);
-
-    fwrite(video_data[0], 1, video_bufsize, fh);
+    fwrite(frame->data[0], 1, bufsize, fh);
     fclose(fh);
 
-    av_free(video_data[0]);
-
     return 0;
 }
 
@@ -411,333 +430,1293 @@ generate_jpg_image(AVCodecContext *ctx, AVFrame *frame, char *filename)
 }
 
 
-
-
-
-static void
-print_usage(void)
-{
-    fprintf(stderr, "\n");
-    fprintf(stderr, "Usage: mngrab [OPTION]... [FILE]\n");
-    fprintf(stderr, "Grab a frame from media record FILE and output in image format.\n");
-    fprintf(stderr, "  -d	turn on debug message\n");
-    fprintf(stderr, "  -t	play time of the frame in milisecond\n");
-    fprintf(stderr, "  -n	number of consecutive frames\n");
-    fprintf(stderr, "  -i	image format of the generated frames\n");
-    fprintf(stderr, "  -p	prefix of the image filename\n");
-    fprintf(stderr, "  -a	performe image annotation based on the JSON annotation request\n");
-    fprintf(stderr, "\n");
-    fprintf(stderr, "Examples:  mngrab -t 2000 -n 5 -i png -p camera_1H mnrecord_1H.mnf\n");
-    fprintf(stderr, "           cat annotation.json | mngrab -t 2000 -n 5 -i png -p camera_1H mnrecord_1H.mnf\n");
-    fprintf(stderr, "\n");
-}
-
-
+/*
+ * Open a media record and initialize the decoder of its first video stream
+ */
 int
-main(int argc, char **argv)
+media_open(MediaInput *in, const char *filename, int dump)
 {
-    MIOContext *mctx;
-    int res, i, program, frame_decode_done;
-    int codec_id = AV_CODEC_ID_MJPEG;
-    int pixel_format = PIX_FMT_YUVJ420P;
-    AVFormatContext *fmt_ctx = NULL;
-    AVCodecContext *dec_codec_ctx = NULL;
-    AVCodec *dec_codec = NULL;
-    AVCodecContext *enc_codec_ctx = NULL;
-    AVCodec *enc_codec = NULL;
-    AVFrame *decode_frame = NULL;
-    AVFrame *output_frame = NULL;
-    struct SwsContext *sws_ctx = NULL;
-    AVPacket packet;
-    char *stream_filename = NULL;
-    char image_filename[64];
-    int c;
-    int num_frames = 1;				/* default one frame */
-    int64_t frame_time = 0;				/* default the first frame */
-    int image_format = OUTPUT_IMAGE_YUV;	/* default native format */
-    char *prefix = "frame";			/* default save image using "frame" prefix */
-    int num_tries;
-    unsigned long gop_duration = 0;
-    int seek_last_frame = 0;
-    int image_generation_done = 0;
-    char *annotation_str = NULL;
-    int annotation_flag = 0;
-    int len;
-
-
-    while ((c = getopt(argc, argv, "adhi:n:p:t:")) != -1) {
-	switch (c) {
-	    case 'a':
-		annotation_flag = 1;
-		break;
-
-	    case 'd':
-		debug = 1;
-		break;
-
-	    case 'i':
-	    {
-		if (!strcmp(optarg, "yuv"))
-		    image_format = OUTPUT_IMAGE_YUV;
-		else if (!strcmp(optarg, "ppm"))
-		    image_format = OUTPUT_IMAGE_PPM;
-		else if (!strcmp(optarg, "png"))
-		    image_format = OUTPUT_IMAGE_PNG;
-		else if (!strcmp(optarg, "jpg"))
-		    image_format = OUTPUT_IMAGE_JPG;
-		break;
-	    }
-
-	    case 'n':
-		num_frames = atoi(optarg);
-		break;
-
-	    case 'p':
-		prefix = optarg;
-		break;
-
-	    case 't':
-		frame_time = atol(optarg);
-		break;
-
-	    case '?':
-		if (isprint(optopt))
-		    fprintf(stderr, "Unknown option `-%c'.\n", optopt);
-		else
-		    fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
-		exit (1);
-
-	    case 'h':
-	    default:
-		print_usage();
-		exit (1);
-	}
-    }
+    int i;
 
-    stream_filename = argv[optind];
-    if (!stream_filename) {
-	fprintf(stderr, "Error: No media file\n");
-	exit (1);
-    }
+    memset(in, 0, sizeof(MediaInput));
 
-    if (annotation_flag > 0) {
-	annotation_str = (char *)malloc(MAX_ANNOTATION_STRING_LEN+16);
-	if (annotation_str) {
-	    len = fread(annotation_str, 1, MAX_ANNOTATION_STRING_LEN, stdin);
-#if 1
-	    printf(">>>> len = %d\n", len);
-#endif
-	}
+    in->mctx = mio_init(filename);
+    if (!in->mctx) {
+	fprintf(stderr, "Error: Failed to initialize media io - %s\n", filename);
+	return -1;
     }
 
-    av_register_all();
-
-    mctx = mio_init(stream_filename);
-    if (!mctx) {
-	fprintf(stderr, "Error: Failed to initialize media io - %s\n", stream_filename);
-	exit (1); 
-    }
-	
-    fmt_ctx = avformat_alloc_context();
-    fmt_ctx->pb = mctx->context;
-    fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
-    fmt_ctx->iformat = mio_get_input_format(mctx);
+    in->fmt_ctx = avformat_alloc_context();
+    in->fmt_ctx->pb = in->mctx->context;
+    in->fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    in->fmt_ctx->iformat = mio_get_input_format(in->mctx);
 
     /*
      * Tell avformat context to start rolling
      */
-    if(avformat_open_input(&fmt_ctx, "", fmt_ctx->iformat, NULL) != 0) {
+    if (avformat_open_input(&in->fmt_ctx, "", in->fmt_ctx->iformat, NULL) != 0) {
 	fprintf(stderr, "Error: Failed to initialize avformat context\n");
-	exit (1);
+	return -1;
     }
 
     /*
      * Retrieve stream information
      */
-    if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
+    if (avformat_find_stream_info(in->fmt_ctx, NULL) < 0) {
 	fprintf(stderr, "Error: Failed to get media info\n");
-	exit (1);
+	return -1;
     }
 
-#if 1
     /*
      * Dump information about file onto standard error
      */
-    av_dump_format(fmt_ctx, 0, mctx->filename, 0);
-#endif
+    if (dump)
+	av_dump_format(in->fmt_ctx, 0, in->mctx->filename, 0);
 
     /*
      *  Find the first video stream
      */
-    program = -1;
-    for (i = 0; i < (int)fmt_ctx->nb_streams; i++) {
-	if (fmt_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
-	    program = i;
+    in->program = -1;
+    for (i = 0; i < (int)in->fmt_ctx->nb_streams; i++) {
+	if (in->fmt_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+	    in->program = i;
 	    break;
 	}
     }
 
-    if (program == -1) {
+    if (in->program == -1) {
 	fprintf(stderr, "Error: Failed to find video program in the media stream\n");
-	exit (1);
+	return -1;
     }
-  
+
     /*
      * Process codec information
      */
-    dec_codec_ctx = fmt_ctx->streams[program]->codec;
-    dec_codec = avcodec_find_decoder(dec_codec_ctx->codec_id);
-    if (dec_codec == NULL) {
+    in->dec_codec_ctx = in->fmt_ctx->streams[in->program]->codec;
+    in->dec_codec = avcodec_find_decoder(in->dec_codec_ctx->codec_id);
+    if (in->dec_codec == NULL) {
 	fprintf(stderr, "Error: Unsupported codec\n");
-	exit (1);
+	return -1;
     }
 
     /*
      * Initialize decoder
      */
-    if (avcodec_open2(dec_codec_ctx, dec_codec, NULL) < 0) {
+    if (avcodec_open2(in->dec_codec_ctx, in->dec_codec, NULL) < 0) {
 	fprintf(stderr, "Error: Couldn't open codec for decode\n");
-	exit (1);
+	return -1;
     }
-  
-#if 0
-    d_printf("##### codec->name = %s\n", dec_codec->name);
-    d_printf("##### codec->width = %d\n", dec_codec_ctx->width);
-    d_printf("##### codec->height = %d\n", dec_codec_ctx->height);
-    d_printf("\n");
 
-    d_printf("##### bit_rate = %d\n", fmt_ctx->bit_rate);
-    d_printf("##### start_time = %lld\n", (long long)fmt_ctx->start_time);
-    d_printf("##### start_time_realtime = %lld\n", (long long)fmt_ctx->start_time_realtime);
-    d_printf("##### duration = %lld\n", (long long)fmt_ctx->duration);
-    d_printf("\n");
+    return 0;
+}
 
-    d_printf("##### time_base.den = %d\n", fmt_ctx->streams[program]->time_base.den);
-    d_printf("##### time_base.num = %d\n", fmt_ctx->streams[program]->time_base.num);
 
+void
+media_close(MediaInput *in)
+{
+    if (in->dec_codec_ctx)
+	avcodec_close(in->dec_codec_ctx);
 
-    d_printf("##### start_time = %lld\n", (long long)fmt_ctx->streams[program]->start_time);
-    d_printf("##### duration = %lld\n", (long long)fmt_ctx->streams[program]->duration);
-    d_printf("##### nb_frames = %lld\n", (long long)fmt_ctx->streams[program]->nb_frames);
+    /*
+     * Stop avformat input
+     */
+    if (in->fmt_ctx)
+	avformat_close_input(&in->fmt_ctx);
 
-    d_printf("##### avg_frame_rate.den = %d\n", fmt_ctx->streams[program]->avg_frame_rate.den);
-    d_printf("##### avg_frame_rate.num = %d\n", fmt_ctx->streams[program]->avg_frame_rate.num);
+    mio_destroy(in->mctx);
+    memset(in, 0, sizeof(MediaInput));
+}
 
-    d_printf("##### codec->qmin = %d\n", dec_codec_ctx->qmin);
-    d_printf("##### codec->qmax = %d\n", dec_codec_ctx->qmax);
-    d_printf("##### codec->time_base.den = %d\n", dec_codec_ctx->time_base.den);
-    d_printf("##### codec->time_base.num = %d\n", dec_codec_ctx->time_base.num);
-    d_printf("##### codec->gop_size = %d\n", dec_codec_ctx->gop_size);
-#endif
 
+/*
+ * Every frame of an intra-only stream (e.g. MJPEG) can be decoded on its own
+ */
+int
+media_is_intra_only(MediaInput *in)
+{
+    const AVCodecDescriptor *desc;
+
+    desc = avcodec_descriptor_get(in->dec_codec_ctx->codec_id);
+    if (!desc)
+	return 0;
 
-    /*
-     *  AVFrame(YUV) for video decode
-     */
-    decode_frame = av_frame_alloc();
-    if (decode_frame == NULL) {
-	fprintf(stderr, "Error: Couldn't allocate AVFrame for decode\n");
-	exit (1);
-    }
-  
-    switch (image_format) {
-	case OUTPUT_IMAGE_YUV:
-	    pixel_format = PIX_FMT_YUVJ420P;
-	break;
+    return (desc->props & AV_CODEC_PROP_INTRA_ONLY) ? 1 : 0;
+}
 
-	case OUTPUT_IMAGE_PPM:
-	    pixel_format = PIX_FMT_RGB24;
-	break;
 
-	case OUTPUT_IMAGE_PNG:
-	    codec_id = AV_CODEC_ID_PNG;
-	    pixel_format = PIX_FMT_RGB24;
-	break;
+/*
+ * Duration of a GOP in millisecond
+ */
+unsigned long
+media_gop_duration(MediaInput *in)
+{
+    AVStream *st = in->fmt_ctx->streams[in->program];
 
-	case OUTPUT_IMAGE_JPG:
-	    codec_id = AV_CODEC_ID_MJPEG;
-	    pixel_format = PIX_FMT_YUVJ420P;
-	break;
+    return av_rescale(in->dec_codec_ctx->gop_size, st->avg_frame_rate.den*1000, st->avg_frame_rate.num);
+}
 
-	default:
-	    break;
-    }
 
+int64_t
+packet_timestamp(AVPacket *packet)
+{
+    return (packet->pts != AV_NOPTS_VALUE) ? packet->pts : packet->dts;
+}
 
-    /*
-     * Initialize scaler for image conversion if needed
-     */
-    if (image_format == OUTPUT_IMAGE_PPM || image_format == OUTPUT_IMAGE_PNG) {
-	/*
-	 *  AVFrame for video image output
-	 */
-	output_frame = av_frame_alloc();
-	if (output_frame == NULL) {
-	    fprintf(stderr, "Error: Couldn't allocate AVFrame for output\n");
-	    exit (1);
-	}
 
-	/*
-	 * Initialize picture buffers for picture output
-	 */
-	res = av_image_alloc(output_frame->data, output_frame->linesize, dec_codec_ctx->width,
-			     dec_codec_ctx->height, pixel_format, 1);
-	if (res < 0) {
-  	    fprintf(stderr, "Error: Couldn't allocate output frame\n");
-	    exit (1);
-	}
-	output_frame->format = pixel_format;
-	output_frame->width = dec_codec_ctx->width;
-	output_frame->height = dec_codec_ctx->height;
+/*
+ * Conversion of the decoded frame for one crop, size and pixel format
+ */
+static int
+frame_converter_open(FrameConverter *conv, AVCodecContext *dec_codec_ctx)
+{
+    int src_width, src_height;
 
-	/*
-	 * Initialize SWS context for software scaling
-	 */
-	sws_ctx = sws_getContext(dec_codec_ctx->width, dec_codec_ctx->height, dec_codec_ctx->pix_fmt,
-				 dec_codec_ctx->width, dec_codec_ctx->height, pixel_format, SWS_BILINEAR,
-				 NULL, NULL, NULL);
+    src_width = conv->crop_width ? conv->crop_width : dec_codec_ctx->width;
+    src_height = conv->crop_height ? conv->crop_height : dec_codec_ctx->height;
+
+    conv->serial = -1;
+    conv->image_serial = -1;
+
+    conv->frame = av_frame_alloc();
+    if (conv->frame == NULL) {
+	fprintf(stderr, "Error: Couldn't allocate AVFrame for output\n");
+	return -1;
     }
 
+    /*
+     * Planes are packed in one buffer without alignment, as raw images and
+     * LoadImageBuffer() expect
+     */
+    conv->bufsize = av_image_alloc(conv->frame->data, conv->frame->linesize, conv->width,
+				   conv->height, conv->pixel_format, 1);
+    if (conv->bufsize < 0) {
+	fprintf(stderr, "Error: Couldn't allocate output frame\n");
+	return -1;
+    }
+    conv->frame->format = conv->pixel_format;
+    conv->frame->width = conv->width;
+    conv->frame->height = conv->height;
 
     /*
-     * Initialize encoder for image generation if needed
+     * Initialize SWS context for software scaling, a plain copy is enough
+     * when neither the geometry nor the pixel format changes
      */
-    if (image_format == OUTPUT_IMAGE_PNG || image_format == OUTPUT_IMAGE_JPG) {
-	enc_codec = avcodec_find_encoder(codec_id);
-	if (enc_codec == NULL) {
-	    fprintf(stderr, "Error: Unsupported encoder codec\n");
-	    exit (1);
+    if (conv->crop_width || conv->width != dec_codec_ctx->width || conv->height != dec_codec_ctx->height ||
+	conv->pixel_format != dec_codec_ctx->pix_fmt) {
+	conv->sws_ctx = sws_getContext(src_width, src_height, dec_codec_ctx->pix_fmt,
+				       conv->width, conv->height, conv->pixel_format, SWS_BILINEAR,
+				       NULL, NULL, NULL);
+	if (!conv->sws_ctx) {
+	    fprintf(stderr, "Error: Couldn't initialize scaler\n");
+	    return -1;
 	}
+    }
 
-	enc_codec_ctx = avcodec_alloc_context3(enc_codec);
-	if (enc_codec_ctx == NULL) {
-	    fprintf(stderr, "Error: Failed to allocate encoder codec context\n");
-	    exit (1);
-	}
+    return 0;
+}
 
-	enc_codec_ctx->pix_fmt	= pixel_format;
-	enc_codec_ctx->bit_rate = dec_codec_ctx->bit_rate;
-	enc_codec_ctx->width 	= dec_codec_ctx->width; 
-	enc_codec_ctx->height 	= dec_codec_ctx->height; 
-
-	if (image_format == OUTPUT_IMAGE_JPG) {
-	    enc_codec_ctx->mb_lmin 	= enc_codec_ctx->qmin * FF_QP2LAMBDA;
-	    enc_codec_ctx->lmin 	= enc_codec_ctx->qmin * FF_QP2LAMBDA;
-	    enc_codec_ctx->mb_lmax 	= enc_codec_ctx->qmax * FF_QP2LAMBDA;
-	    enc_codec_ctx->lmax 	= enc_codec_ctx->qmax * FF_QP2LAMBDA; 
-	    enc_codec_ctx->flags 	= CODEC_FLAG_QSCALE; 
-	    enc_codec_ctx->global_quality = enc_codec_ctx->qmin * FF_QP2LAMBDA; 
-	    enc_codec_ctx->time_base = (AVRational){1,25};
-	}
 
-	if (avcodec_open2(enc_codec_ctx, enc_codec, NULL) < 0) {
+static void
+frame_converter_close(FrameConverter *conv)
+{
+    if (conv->sws_ctx) {
+	sws_freeContext(conv->sws_ctx);
+	conv->sws_ctx = NULL;
+    }
+
+    if (conv->frame) {
+	av_freep(&conv->frame->data[0]);
+	av_frame_free(&conv->frame);
+    }
+
+    if (conv->image)
+	cvReleaseMat(&conv->image);
+}
+
+
+/*
+ * Convert the decoded frame once per decode serial, later outputs sharing
+ * the converter reuse the result
+ */
+static AVFrame *
+frame_converter_run(FrameConverter *conv, AVFrame *frame, int64_t serial)
+{
+    const uint8_t *src[4];
+    int i, h_shift = 0, v_shift = 0;
+
+    if (conv->serial == serial)
+	return conv->frame;
+
+    if (conv->sws_ctx) {
+	/*
+	 * Crop by offsetting the source planes (planar formats only)
+	 */
+	av_pix_fmt_get_chroma_sub_sample(frame->format, &h_shift, &v_shift);
+	for (i = 0; i < 4; i++) {
+	    src[i] = frame->data[i];
+	    if (src[i] && conv->crop_width) {
+		if (i == 1 || i == 2)
+		    src[i] += (conv->crop_y >> v_shift) * frame->linesize[i] + (conv->crop_x >> h_shift);
+		else
+		    src[i] += conv->crop_y * frame->linesize[i] + conv->crop_x;
+	    }
+	}
+
+	sws_scale(conv->sws_ctx, src, frame->linesize, 0,
+		  conv->crop_height ? conv->crop_height : frame->height,
+		  conv->frame->data, conv->frame->linesize);
+    } else {
+	/*
+	 * copy decoded frame to raw video buffer:
+	 * this is required since rawvideo expects non aligned data
+	 */
+	av_image_copy(conv->frame->data, conv->frame->linesize,
+		      (const uint8_t **)(frame->data), frame->linesize, conv->pixel_format,
+		      conv->width, conv->height);
+    }
+
+    conv->serial = serial;
+
+    return conv->frame;
+}
+
+
+/*
+ * Annotate the converted YUV420 frame in BGR, once per decode serial
+ */
+static CvMat *
+frame_converter_annotate(FrameConverter *conv, OutputSet *set)
+{
+    AnnotationList *dynamic = NULL;
+
+    if (conv->image_serial == set->serial)
+	return conv->image;
+
+    /*
+     * The BGR image is converted in place frame after frame
+     */
+    if (!conv->image) {
+	conv->image = cvCreateMat(conv->height, conv->width, CV_8UC3);
+	if (!conv->image)
+	    return NULL;
+    }
+
+    if (LoadImageBufferInto(conv->image, conv->frame->data[0], conv->width, conv->height, PIXEL_FORMAT_IYUV) < 0)
+	return NULL;
+
+    /*
+     * The request is the same for every frame, it is rendered once per
+     * output size and later frames only composite it. Tracks shown at the
+     * frame position are drawn on top.
+     */
+    if (set->tracks)
+	dynamic = CompileAnnotationTracksFrame(set->annotation_ctx, set->tracks, set->position / 1000,
+					       conv->width, conv->height);
+
+    /*
+     * A frame whose privacy masks failed is not exported
+     */
+    if (set->overlays && set->annotation &&
+	AnnotateImageCached(conv->image, set->overlays, NULL, set->annotation, dynamic) < 0)
+	return NULL;
+
+    conv->image_serial = set->serial;
+
+    return conv->image;
+}
+
+
+static int
+parse_image_format(const char *str)
+{
+    if (!strcmp(str, "yuv"))
+	return OUTPUT_IMAGE_YUV;
+    else if (!strcmp(str, "ppm"))
+	return OUTPUT_IMAGE_PPM;
+    else if (!strcmp(str, "png"))
+	return OUTPUT_IMAGE_PNG;
+    else if (!strcmp(str, "jpg"))
+	return OUTPUT_IMAGE_JPG;
+
+    return -1;
+}
+
+
+/*
+ * Parse an output specification: format[:WxH][:crop=WxH+X+Y][:annotate|:noannotate][:prefix=NAME]
+ */
+static int
+parse_output_spec(char *spec, ImageOutput *out, int annotate, char *prefix)
+{
+    char *token, *saveptr = NULL;
+
+    memset(out, 0, sizeof(ImageOutput));
+    out->prefix = prefix;
+    out->annotate = annotate;
+
+    token = strtok_r(spec, ":", &saveptr);
+    if (!token || (out->image_format = parse_image_format(token)) < 0)
+	return -1;
+
+    while ((token = strtok_r(NULL, ":", &saveptr)) != NULL) {
+	if (!strncmp(token, "crop=", 5)) {
+	    if (sscanf(token + 5, "%dx%d+%d+%d", &out->crop_width, &out->crop_height,
+		       &out->crop_x, &out->crop_y) != 4 || out->crop_width <= 0 || out->crop_height <= 0)
+		return -1;
+	} else if (!strncmp(token, "prefix=", 7))
+	    out->prefix = token + 7;
+	else if (!strcmp(token, "annotate"))
+	    out->annotate = 1;
+	else if (!strcmp(token, "noannotate"))
+	    out->annotate = 0;
+	else if (sscanf(token, "%dx%d", &out->width, &out->height) != 2)
+	    return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Find or add the converter producing the given crop, size and pixel format
+ */
+static FrameConverter *
+output_set_converter(OutputSet *set, ImageOutput *out, int pixel_format)
+{
+    FrameConverter *conv;
+    int i;
+
+    for (i = 0; i < set->num_converters; i++) {
+	conv = &set->converters[i];
+	if (conv->crop_x == out->crop_x && conv->crop_y == out->crop_y &&
+	    conv->crop_width == out->crop_width && conv->crop_height == out->crop_height &&
+	    conv->width == out->width && conv->height == out->height && conv->pixel_format == pixel_format)
+	    return conv;
+    }
+
+    conv = &set->converters[set->num_converters++];
+    memset(conv, 0, sizeof(FrameConverter));
+    conv->crop_x = out->crop_x;
+    conv->crop_y = out->crop_y;
+    conv->crop_width = out->crop_width;
+    conv->crop_height = out->crop_height;
+    conv->width = out->width;
+    conv->height = out->height;
+    conv->pixel_format = pixel_format;
+
+    return conv;
+}
+
+
+/*
+ * Setup pixel format, converter and encoder for the output image format
+ */
+static int
+image_output_open(OutputSet *set, ImageOutput *out, AVCodecContext *dec_codec_ctx)
+{
+    int src_width, src_height;
+    int native;
+
+    /*
+     * Resolve the geometry: crop is clipped to the frame with even offsets for
+     * chroma subsampling, a zero width or height keeps the aspect ratio
+     */
+    if (out->crop_width) {
+	out->crop_x &= ~1;
+	out->crop_y &= ~1;
+	if (out->crop_x + out->crop_width > dec_codec_ctx->width)
+	    out->crop_width = dec_codec_ctx->width - out->crop_x;
+	if (out->crop_y + out->crop_height > dec_codec_ctx->height)
+	    out->crop_height = dec_codec_ctx->height - out->crop_y;
+	if (out->crop_width <= 0 || out->crop_height <= 0) {
+	    fprintf(stderr, "Error: Crop area is outside of the frame\n");
+	    return -1;
+	}
+    }
+
+    src_width = out->crop_width ? out->crop_width : dec_codec_ctx->width;
+    src_height = out->crop_height ? out->crop_height : dec_codec_ctx->height;
+
+    if (out->width <= 0 && out->height <= 0) {
+	out->width = src_width;
+	out->height = src_height;
+    } else if (out->height <= 0)
+	out->height = (int)av_rescale(out->width, src_height, src_width) & ~1;
+    else if (out->width <= 0)
+	out->width = (int)av_rescale(out->height, src_width, src_height) & ~1;
+
+    native = (!out->crop_width && out->width == dec_codec_ctx->width && out->height == dec_codec_ctx->height);
+
+    out->codec_id = AV_CODEC_ID_MJPEG;
+    out->pixel_format = PIX_FMT_YUVJ420P;
+
+    switch (out->image_format) {
+	case OUTPUT_IMAGE_YUV:
+	    out->pixel_format = native ? dec_codec_ctx->pix_fmt : PIX_FMT_YUVJ420P;
+	break;
+
+	case OUTPUT_IMAGE_PPM:
+	    out->pixel_format = PIX_FMT_RGB24;
+	break;
+
+	case OUTPUT_IMAGE_PNG:
+	    out->codec_id = AV_CODEC_ID_PNG;
+	    out->pixel_format = PIX_FMT_RGB24;
+	break;
+
+	case OUTPUT_IMAGE_JPG:
+	    out->codec_id = AV_CODEC_ID_MJPEG;
+	    out->pixel_format = PIX_FMT_YUVJ420P;
+	break;
+
+	default:
+	    break;
+    }
+
+    if (out->annotate && out->image_format == OUTPUT_IMAGE_YUV) {
+	d_printf("Warning: Annotation on yuv output is not currently supported.\n");
+	out->annotate = 0;
+    }
+
+    /*
+     * Annotated images are drawn on the YUV420 frame and saved by OpenCV
+     */
+    if (out->annotate && set->annotation) {
+	if (dec_codec_ctx->pix_fmt == PIX_FMT_YUV420P || dec_codec_ctx->pix_fmt == PIX_FMT_YUVJ420P)
+	    out->pixel_format = dec_codec_ctx->pix_fmt;
+	else
+	    out->pixel_format = PIX_FMT_YUV420P;
+
+	out->converter = output_set_converter(set, out, out->pixel_format);
+	return 0;
+    }
+    out->annotate = 0;
+
+    /*
+     * Decoded frame feeds the JPEG encoder directly at its native size
+     */
+    if (out->image_format != OUTPUT_IMAGE_JPG || !native)
+	out->converter = output_set_converter(set, out, out->pixel_format);
+
+
+    /*
+     * Initialize encoder for image generation if needed
+     */
+    if (out->image_format == OUTPUT_IMAGE_PNG || out->image_format == OUTPUT_IMAGE_JPG) {
+	out->enc_codec = avcodec_find_encoder(out->codec_id);
+	if (out->enc_codec == NULL) {
+	    fprintf(stderr, "Error: Unsupported encoder codec\n");
+	    return -1;
+	}
+
+	out->enc_codec_ctx = avcodec_alloc_context3(out->enc_codec);
+	if (out->enc_codec_ctx == NULL) {
+	    fprintf(stderr, "Error: Failed to allocate encoder codec context\n");
+	    return -1;
+	}
+
+	out->enc_codec_ctx->pix_fmt	= out->pixel_format;
+	out->enc_codec_ctx->bit_rate	= dec_codec_ctx->bit_rate;
+	out->enc_codec_ctx->width	= out->width;
+	out->enc_codec_ctx->height	= out->height;
+
+	if (out->image_format == OUTPUT_IMAGE_JPG) {
+	    out->enc_codec_ctx->mb_lmin	= out->enc_codec_ctx->qmin * FF_QP2LAMBDA;
+	    out->enc_codec_ctx->lmin	= out->enc_codec_ctx->qmin * FF_QP2LAMBDA;
+	    out->enc_codec_ctx->mb_lmax	= out->enc_codec_ctx->qmax * FF_QP2LAMBDA;
+	    out->enc_codec_ctx->lmax	= out->enc_codec_ctx->qmax * FF_QP2LAMBDA;
+	    out->enc_codec_ctx->flags	= CODEC_FLAG_QSCALE;
+	    out->enc_codec_ctx->global_quality = out->enc_codec_ctx->qmin * FF_QP2LAMBDA;
+	    out->enc_codec_ctx->time_base = (AVRational){1,25};
+	}
+
+	if (avcodec_open2(out->enc_codec_ctx, out->enc_codec, NULL) < 0) {
 	    fprintf(stderr, "Error: Failed to open codec for encode\n");
-	    exit(1);
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+
+static void
+image_output_close(ImageOutput *out)
+{
+    if (out->enc_codec_ctx) {
+	avcodec_close(out->enc_codec_ctx);
+	av_free(out->enc_codec_ctx);
+	out->enc_codec_ctx = NULL;
+    }
+
+    out->converter = NULL;
+}
+
+
+static void
+image_output_name(ImageOutput *out, int index, char *image_filename)
+{
+    static const char *ext[] = { "yuv", "ppm", "png", "jpg" };
+
+    snprintf(image_filename, MAX_IMAGE_FILENAME_LEN, "%s%d.%s", out->prefix, index, ext[out->image_format]);
+}
+
+
+/*
+ * Generate the index-th (counting from 1) image of the output sequence
+ */
+static int
+image_output_write(OutputSet *set, ImageOutput *out, AVFrame *decode_frame, int index)
+{
+    char image_filename[MAX_IMAGE_FILENAME_LEN];
+    AVFrame *frame = decode_frame;
+    int res = -1;
+
+    image_output_name(out, index, image_filename);
+
+    if (out->converter)
+	frame = frame_converter_run(out->converter, decode_frame, set->serial);
+
+    if (out->annotate)
+	return generate_image_with_annotation(frame_converter_annotate(out->converter, set), image_filename);
+
+    switch (out->image_format) {
+	case OUTPUT_IMAGE_YUV:
+	    res = generate_raw_image(frame, out->converter->bufsize, image_filename);
+	    break;
+
+	case OUTPUT_IMAGE_PPM:
+	    res = generate_ppm_image(frame, image_filename);
+	    break;
+
+	case OUTPUT_IMAGE_PNG:
+	    res = generate_png_image(out->enc_codec_ctx, frame, image_filename);
+	    break;
+
+	case OUTPUT_IMAGE_JPG:
+	    res = generate_jpg_image(out->enc_codec_ctx, frame, image_filename);
+	    break;
+
+	default:
+	    break;
+    }
+
+    return res;
+}
+
+
+static int
+output_set_open(OutputSet *set, AVCodecContext *dec_codec_ctx)
+{
+    int i;
+
+    set->num_converters = 0;
+    set->serial = 0;
+
+    for (i = 0; i < set->num_outputs; i++) {
+	if (image_output_open(set, &set->outputs[i], dec_codec_ctx) < 0)
+	    return -1;
+    }
+
+    for (i = 0; i < set->num_converters; i++) {
+	if (frame_converter_open(&set->converters[i], dec_codec_ctx) < 0)
+	    return -1;
+    }
+
+    /*
+     * Each set is written by one thread, its context compiles the tracks
+     * of a frame into memory reused by the next one
+     */
+    set->overlays = NULL;
+    set->annotation_ctx = NULL;
+    if (set->annotation) {
+	set->annotation_ctx = CreateAnnotationContext(1);
+	if (!set->annotation_ctx)
+	    return -1;
+	SetAnnotationQuality(set->annotation_ctx, set->quality);
+	EnableAnnotationStats(set->annotation_ctx, set->stats_ctx != NULL);
+
+	set->overlays = CreateAnnotationCache(set->annotation_ctx, set->num_converters);
+	if (!set->overlays)
+	    return -1;
+    }
+
+    d_printf("##### %d outputs, %d conversions\n", set->num_outputs, set->num_converters);
+
+    return 0;
+}
+
+
+static void
+output_set_close(OutputSet *set)
+{
+    int i;
+
+    for (i = 0; i < set->num_outputs; i++)
+	image_output_close(&set->outputs[i]);
+
+    for (i = 0; i < set->num_converters; i++)
+	frame_converter_close(&set->converters[i]);
+    set->num_converters = 0;
+
+    ReleaseAnnotationCache(&set->overlays);
+
+    if (set->stats_ctx && set->annotation_ctx) {
+	pthread_mutex_lock(&stats_lock);
+	MergeAnnotationStats(set->stats_ctx, set->annotation_ctx);
+	pthread_mutex_unlock(&stats_lock);
+    }
+    ReleaseAnnotationContext(&set->annotation_ctx);
+}
+
+
+/*
+ * Generate every output image of one decoded frame, position is the one of
+ * the frame in microsecond
+ */
+static int
+output_set_write(OutputSet *set, AVFrame *decode_frame, int index, int64_t position)
+{
+    int i, res;
+
+    set->serial++;
+    set->position = position;
+
+    for (i = 0; i < set->num_outputs; i++) {
+	res = image_output_write(set, &set->outputs[i], decode_frame, index);
+	if (res < 0)
+	    return res;
+    }
+
+    return 0;
+}
+
+
+static void
+output_set_report(OutputSet *set, int index, int64_t position)
+{
+    char image_filename[MAX_IMAGE_FILENAME_LEN];
+    int i;
+
+    for (i = 0; i < set->num_outputs; i++) {
+	image_output_name(&set->outputs[i], index, image_filename);
+	printf("%s %dms\n", image_filename, (int)(position / 1000));
+
+	if (set->cache)
+	    grab_cache_add(set->cache, i, index, image_filename, position);
+    }
+}
+
+
+static void
+output_set_name(void *data, int output, int index, char *image_filename)
+{
+    OutputSet *set = (OutputSet *)data;
+
+    image_output_name(&set->outputs[output], index, image_filename);
+}
+
+
+/*
+ * Describe what a grab generates, images are cached under this description
+ * (output prefixes excepted, they only name the files)
+ */
+static char *
+output_set_request(OutputSet *set, int64_t frame_time, int num_frames)
+{
+    ImageOutput *out;
+    char *request;
+    int i, len;
+
+    len = 64 + set->num_outputs * 128 + (set->annotation ? strlen(set->annotation) : 0);
+    request = (char *)malloc(len);
+    if (!request)
+	return NULL;
+
+    i = snprintf(request, len, "t=%lld n=%d q=%d\n", (long long)frame_time, num_frames, set->quality);
+    for (out = set->outputs; out < set->outputs + set->num_outputs; out++) {
+	i += snprintf(request + i, len - i, "o=%d %dx%d %dx%d+%d+%d a=%d\n", out->image_format,
+		      out->width, out->height, out->crop_width, out->crop_height, out->crop_x, out->crop_y,
+		      out->annotate);
+    }
+
+    if (set->annotation)
+	snprintf(request + i, len - i, "%s", set->annotation);
+
+    return request;
+}
+
+
+/*
+ * Slot of a decoded frame in its chunk, by timestamp, or -1 if the frame
+ * is not one of the chunk
+ */
+static int
+decode_job_slot(DecodeJob *job, AVFrame *frame)
+{
+    int64_t ts = (frame->pkt_pts != AV_NOPTS_VALUE) ? frame->pkt_pts : frame->pkt_dts;
+    int i;
+
+    for (i = 0; i < job->count; i++)
+	if (job->pts[i] == ts)
+	    return i;
+
+    return -1;
+}
+
+
+/*
+ * Decode a chunk of consecutive frames of an intra-only record with the
+ * private demuxer and decoder of the job, seeking straight to the first
+ * packet of the chunk. Each image is named after the slot of its frame in
+ * the range, a frame that fails to decode leaves its slot empty.
+ */
+static void *
+decode_range(void *data)
+{
+    DecodeJob *job = (DecodeJob *)data;
+    MediaInput *in = &job->in;
+    AVFrame *decode_frame = NULL;
+    AVPacket packet;
+    AVStream *st;
+    int64_t last = job->pts[job->count - 1];
+    int frame_decode_done, slot;
+
+    decode_frame = av_frame_alloc();
+    if (decode_frame == NULL)
+	return NULL;
+
+    st = in->fmt_ctx->streams[in->program];
+    if (avformat_seek_file(in->fmt_ctx, in->program, st->start_time, job->pts[0], job->pts[0], AVSEEK_FLAG_ANY) < 0) {
+	fprintf(stderr, "Error: Failed in seeking media file\n");
+	av_frame_free(&decode_frame);
+	return NULL;
+    }
+
+    while (av_read_frame(in->fmt_ctx, &packet) >= 0) {
+	/*
+	 * Skip up to the first packet of the chunk if the seek landed early,
+	 * and stop at the first packet of the next chunk
+	 */
+	if (packet.stream_index != in->program || packet_timestamp(&packet) < job->pts[0]) {
+	    av_free_packet(&packet);
+	    continue;
+	}
+	if (packet_timestamp(&packet) > last) {
+	    av_free_packet(&packet);
+	    break;
+	}
+
+	avcodec_decode_video2(in->dec_codec_ctx, decode_frame, &frame_decode_done, &packet);
+	av_free_packet(&packet);
+
+	if (!frame_decode_done || (slot = decode_job_slot(job, decode_frame)) < 0 || job->written[slot])
+	    continue;
+
+	job->position[slot] = av_rescale_q(decode_frame->pkt_pts, st->time_base, AV_TIME_BASE_Q) - in->fmt_ctx->start_time;
+	if (output_set_write(&job->output, decode_frame, job->first + slot + 1, job->position[slot]) < 0)
+	    break;
+	job->written[slot] = 1;
+    }
+
+    av_frame_free(&decode_frame);
+
+    return NULL;
+}
+
+
+/*
+ * Remove the images of a frame that is not reported
+ */
+static void
+output_set_remove(OutputSet *set, int index)
+{
+    char image_filename[MAX_IMAGE_FILENAME_LEN];
+    int i;
+
+    for (i = 0; i < set->num_outputs; i++) {
+	image_output_name(&set->outputs[i], index, image_filename);
+	unlink(image_filename);
+    }
+}
+
+
+/*
+ * Split the frames starting at the current read position into chunks and
+ * decode the chunks in parallel. Image files are named and reported in
+ * stream order, same as the serial decoding.
+ */
+static int
+decode_parallel(MediaInput *in, OutputSet *spec, const char *filename, int num_frames, int num_threads)
+{
+    DecodeJob *jobs;
+    AVPacket packet;
+    int64_t *pts, *position;
+    char *written;
+    int i, n, count, first, removed;
+
+    pts = (int64_t *)malloc(num_frames * sizeof(int64_t));
+    position = (int64_t *)malloc(num_frames * sizeof(int64_t));
+    written = (char *)calloc(num_frames, 1);
+    jobs = (DecodeJob *)calloc(num_threads, sizeof(DecodeJob));
+    if (!pts || !position || !written || !jobs) {
+	fprintf(stderr, "Error: Out of memory\n");
+	exit (1);
+    }
+
+    /*
+     * Demux only pass to build the packet index of the requested range
+     */
+    n = 0;
+    while (n < num_frames) {
+	if (av_read_frame(in->fmt_ctx, &packet) < 0)
+	    break;
+
+	if (packet.stream_index == in->program && packet_timestamp(&packet) != AV_NOPTS_VALUE)
+	    pts[n++] = packet_timestamp(&packet);
+
+	av_free_packet(&packet);
+    }
+
+    if (n < num_threads)
+	num_threads = n;
+
+    d_printf("##### Decoding %d frames on %d threads\n", n, num_threads);
+
+    for (i = 0, first = 0; i < num_threads; i++, first += count) {
+	count = n / num_threads + (i < n % num_threads ? 1 : 0);
+
+	jobs[i].output = *spec;
+	jobs[i].output.cache = NULL;
+	jobs[i].pts = pts + first;
+	jobs[i].position = position + first;
+	jobs[i].written = written + first;
+	jobs[i].first = first;
+	jobs[i].count = count;
+
+	/*
+	 * libavcodec has no lock manager registered: the decoders and
+	 * encoders of every job are opened here before the threads start,
+	 * and closed once they are joined
+	 */
+	if (media_open(&jobs[i].in, filename, 0) < 0) {
+	    media_close(&jobs[i].in);
+	    continue;
+	}
+
+	if (output_set_open(&jobs[i].output, jobs[i].in.dec_codec_ctx) < 0) {
+	    output_set_close(&jobs[i].output);
+	    media_close(&jobs[i].in);
+	    continue;
+	}
+
+	if (pthread_create(&jobs[i].thread, NULL, decode_range, &jobs[i]) != 0) {
+	    fprintf(stderr, "Error: Failed to create decoding thread\n");
+	    exit (1);
+	}
+	jobs[i].started = 1;
+    }
+
+    for (i = 0; i < num_threads; i++) {
+	if (!jobs[i].started)
+	    continue;
+	pthread_join(jobs[i].thread, NULL);
+	output_set_close(&jobs[i].output);
+	media_close(&jobs[i].in);
+    }
+
+    /*
+     * Stop reporting at the first gap so the sequence stays consecutive,
+     * the images generated past it are removed
+     */
+    for (count = 0; count < n && written[count]; count++)
+	output_set_report(spec, count + 1, position[count]);
+
+    for (i = count, removed = 0; i < n; i++) {
+	if (written[i]) {
+	    output_set_remove(spec, i + 1);
+	    removed++;
+	}
+    }
+    if (count < n)
+	fprintf(stderr, "Warning: Failed to decode frame %d, %d later images removed\n", count + 1, removed);
+
+    free(jobs);
+    free(written);
+    free(position);
+    free(pts);
+
+    return count;
+}
+
+
+/*
+ * Read the whole annotation request, its annotations are applied to every
+ * grabbed frame and its tracks to the frames at their times. Unlike mndraw
+ * the document is not streamed: it is drawn again on each frame, keys the
+ * output cache and is parsed a second time for the tracks.
+ */
+static char *
+read_annotation(FILE *fh, int *length)
+{
+    char *buffer = NULL, *p;
+    size_t size = 0, capacity = 0, n;
+
+    do {
+	if (capacity - size < MAX_ANNOTATION_STRING_LEN + 1) {
+	    capacity = capacity ? capacity * 2 : MAX_ANNOTATION_STRING_LEN + 16;
+	    p = (char *)realloc(buffer, capacity);
+	    if (!p) {
+		free(buffer);
+		return NULL;
+	    }
+	    buffer = p;
+	}
+
+	n = fread(buffer + size, 1, capacity - size - 1, fh);
+	size += n;
+    } while (n > 0);
+
+    buffer[size] = '\0';
+    *length = size;
+
+    return buffer;
+}
+
+
+static void
+print_usage(void)
+{
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Usage: mngrab [OPTION]... [FILE]\n");
+    fprintf(stderr, "Grab a frame from media record FILE and output in image format.\n");
+    fprintf(stderr, "  -d	turn on debug message\n");
+    fprintf(stderr, "  -t	play time of the frame in milisecond\n");
+    fprintf(stderr, "  -n	number of consecutive frames\n");
+    fprintf(stderr, "  -i	image format of the generated frames\n");
+    fprintf(stderr, "  -p	prefix of the image filename\n");
+    fprintf(stderr, "  -a	performe image annotation based on the JSON annotation request\n");
+    fprintf(stderr, "   	(its \"tracks\" are drawn on the frames within their time range)\n");
+    fprintf(stderr, "  -q	annotation quality (aa|fast|auto), overrides the one of each annotation\n");
+    fprintf(stderr, "  -S	print the annotation performance counters as JSON on exit\n");
+    fprintf(stderr, "  -j	number of decoding threads for intra-only (MJPEG) records, default all cores\n");
+    fprintf(stderr, "  -o	output rendition format[:WxH][:crop=WxH+X+Y][:annotate|:noannotate][:prefix=NAME],\n");
+    fprintf(stderr, "   	may be repeated to generate several renditions from each decoded frame\n");
+    fprintf(stderr, "  -c	cache directory of generated images, repeated grabs are served from it\n");
+    fprintf(stderr, "  -C	size bound of the cache in MB, default 256\n");
+    fprintf(stderr, "  -V	time-lapse video file, sampling one frame per interval (-n samples, default to the end)\n");
+    fprintf(stderr, "  -T	time-lapse sampling interval in milisecond, default 60000\n");
+    fprintf(stderr, "  -r	time-lapse frame rate, default 25\n");
+    fprintf(stderr, "  -k	build a thumbnail track file of the keyframes of the record\n");
+    fprintf(stderr, "  -s	thumbnail dimension WxH, a zero keeps the aspect ratio, default 160x0\n");
+    fprintf(stderr, "  -K	read the thumbnail at -t from a thumbnail track file, no record needed\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Examples:  mngrab -t 2000 -n 5 -i png -p camera_1H mnrecord_1H.mnf\n");
+    fprintf(stderr, "           cat annotation.json | mngrab -t 2000 -n 5 -i png -p camera_1H mnrecord_1H.mnf\n");
+    fprintf(stderr, "           mngrab -t 2000 -o jpg -o jpg:160x0:prefix=thumb_ -o yuv mnrecord_1H.mnf\n");
+    fprintf(stderr, "           mngrab -T 10000 -V timelapse_1H.mp4 mnrecord_1H.mnf\n");
+    fprintf(stderr, "           mngrab -k mnrecord_1H.mnt -s 160x90 mnrecord_1H.mnf; mngrab -K mnrecord_1H.mnt -t 2000\n");
+    fprintf(stderr, "\n");
+}
+
+
+int
+main(int argc, char **argv)
+{
+    MediaInput input;
+    OutputSet spec, output;
+    GrabCache cache;
+    int res, i, frame_decode_done;
+    AVFormatContext *fmt_ctx = NULL;
+    AVCodecContext *dec_codec_ctx = NULL;
+    AVFrame *decode_frame = NULL;
+    AVPacket packet;
+    char *stream_filename = NULL;
+    char image_filename[MAX_IMAGE_FILENAME_LEN];
+    char *output_specs[MAX_IMAGE_OUTPUTS];
+    int num_output_specs = 0;
+    int image_format = OUTPUT_IMAGE_YUV;	/* default native format */
+    char *prefix = "frame";			/* default save image using "frame" prefix */
+    int c;
+    int num_frames = 1;				/* default one frame */
+    int num_frames_set = 0;
+    int64_t frame_time = 0;				/* default the first frame */
+    int num_threads = 0;			/* default one per core */
+    int num_tries;
+    unsigned long gop_duration = 0;
+    int seek_last_frame = 0;
+    int image_generation_done = 0;
+    char *annotation_str = NULL;
+    int annotation_flag = 0;
+    int annotation_quality = ANNOTATION_QUALITY_AUTO;
+    int stats_flag = 0;
+    char *stats_str;
+    char *timelapse_file = NULL;
+    int64_t timelapse_interval = 60000;		/* default one frame per minute */
+    int timelapse_rate = 25;
+    char *thumb_build_file = NULL;
+    char *thumb_read_file = NULL;
+    int thumb_width = 0, thumb_height = 0;
+    char *cache_dir = NULL;
+    int64_t cache_size = 0;
+    char *request;
+    int program;
+    int len;
+
+
+    while ((c = getopt(argc, argv, "aC:c:dhi:j:K:k:n:o:p:q:r:Ss:T:t:V:")) != -1) {
+	switch (c) {
+	    case 'a':
+		annotation_flag = 1;
+		break;
+
+	    case 'C':
+		cache_size = atoll(optarg) * 1024 * 1024;
+		break;
+
+	    case 'c':
+		cache_dir = optarg;
+		break;
+
+	    case 'd':
+		debug = 1;
+		break;
+
+	    case 'i':
+	    {
+		if (parse_image_format(optarg) >= 0)
+		    image_format = parse_image_format(optarg);
+		break;
+	    }
+
+	    case 'j':
+		num_threads = atoi(optarg);
+		break;
+
+	    case 'q':
+		annotation_quality = ParseAnnotationQuality(optarg);
+		if (annotation_quality < 0) {
+		    fprintf(stderr, "Error: Invalid annotation quality %s\n", optarg);
+		    print_usage();
+		    exit (1);
+		}
+		break;
+
+	    case 'K':
+		thumb_read_file = optarg;
+		break;
+
+	    case 'k':
+		thumb_build_file = optarg;
+		break;
+
+	    case 'n':
+		num_frames = atoi(optarg);
+		num_frames_set = 1;
+		break;
+
+	    case 'o':
+		if (num_output_specs == MAX_IMAGE_OUTPUTS) {
+		    fprintf(stderr, "Error: Too many outputs, at most %d\n", MAX_IMAGE_OUTPUTS);
+		    exit (1);
+		}
+		output_specs[num_output_specs++] = optarg;
+		break;
+
+	    case 'p':
+		prefix = optarg;
+		break;
+
+	    case 'r':
+		timelapse_rate = atoi(optarg);
+		break;
+
+	    case 'S':
+		stats_flag = 1;
+		break;
+
+	    case 's':
+		if (sscanf(optarg, "%dx%d", &thumb_width, &thumb_height) != 2) {
+		    fprintf(stderr, "Error: Invalid thumbnail dimension - %s\n", optarg);
+		    exit (1);
+		}
+		break;
+
+	    case 'T':
+		timelapse_interval = atol(optarg);
+		break;
+
+	    case 't':
+		frame_time = atol(optarg);
+		break;
+
+	    case 'V':
+		timelapse_file = optarg;
+		break;
+
+	    case '?':
+		if (isprint(optopt))
+		    fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+		else
+		    fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+		exit (1);
+
+	    case 'h':
+	    default:
+		print_usage();
+		exit (1);
+	}
+    }
+
+    /*
+     * Preview from a thumbnail track never touches the record or a decoder
+     */
+    if (thumb_read_file) {
+	snprintf(image_filename, sizeof(image_filename), "%s1.jpg", prefix);
+	exit (thumb_track_read(thumb_read_file, frame_time, image_filename) < 0 ? 1 : 0);
+    }
+
+    stream_filename = argv[optind];
+    if (!stream_filename) {
+	fprintf(stderr, "Error: No media file\n");
+	exit (1);
+    }
+
+    if (annotation_flag > 0 && timelapse_file) {
+	fprintf(stderr, "Error: Annotation on time-lapse output is not supported\n");
+	exit (1);
+    }
+
+    /*
+     * The document is kept whole for the frames, the cache key and the
+     * tracks
+     */
+    if (annotation_flag > 0) {
+	annotation_str = read_annotation(stdin, &len);
+	if (annotation_str)
+	    d_printf("##### Annotation request of %d bytes\n", len);
+    }
+
+    /*
+     * Renditions generated from each decoded frame, -i and -p describe the
+     * only one when none is given
+     */
+    memset(&spec, 0, sizeof(OutputSet));
+    spec.annotation = annotation_str;
+    spec.tracks = LoadAnnotationTracks(annotation_str);
+    spec.quality = annotation_quality;
+    if (stats_flag && annotation_str) {
+	spec.stats_ctx = CreateAnnotationContext(1);
+	if (!spec.stats_ctx)
+	    exit (1);
+    }
+    if (num_output_specs == 0) {
+	spec.outputs[0].image_format = image_format;
+	spec.outputs[0].prefix = prefix;
+	spec.outputs[0].annotate = annotation_flag;
+	spec.num_outputs = 1;
+    }
+
+    for (i = 0; i < num_output_specs; i++) {
+	if (parse_output_spec(output_specs[i], &spec.outputs[i], annotation_flag, prefix) < 0) {
+	    fprintf(stderr, "Error: Invalid output specification - %s\n", output_specs[i]);
+	    exit (1);
+	}
+	spec.num_outputs++;
+    }
+
+    if (num_threads <= 0)
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    /*
+     * Serve repeated grabs from the cache without opening the record
+     */
+    if (cache_dir && !timelapse_file && !thumb_build_file) {
+	request = output_set_request(&spec, frame_time, num_frames);
+	if (grab_cache_open(&cache, cache_dir, cache_size, stream_filename, request) == 0) {
+	    if (grab_cache_restore(&cache, output_set_name, &spec) > 0) {
+		d_printf("##### Served from cache %s\n", cache.entry);
+		exit (0);
+	    }
+	    spec.cache = &cache;
 	}
+	free(request);
+    }
+
+    av_register_all();
+
+    if (media_open(&input, stream_filename, 1) < 0)
+	exit (1);
+
+    fmt_ctx = input.fmt_ctx;
+    dec_codec_ctx = input.dec_codec_ctx;
+    program = input.program;
+
+    /*
+     * The thumbnail track packs a small JPEG of every keyframe
+     */
+    if (thumb_build_file) {
+	res = thumb_track_build(&input, thumb_build_file, thumb_width, thumb_height);
+	media_close(&input);
+	exit (res < 0 ? 1 : 0);
+    }
+
+    /*
+     * Time-lapse encodes the sampled frames straight into a video file
+     */
+    if (timelapse_file) {
+	res = timelapse_generate(&input, timelapse_file, frame_time, timelapse_interval,
+				 num_frames_set ? num_frames : 0, timelapse_rate);
+	media_close(&input);
+	exit (res < 0 ? 1 : 0);
+    }
+
+#if 0
+    d_printf("##### codec->name = %s\n", input.dec_codec->name);
+    d_printf("##### codec->width = %d\n", dec_codec_ctx->width);
+    d_printf("##### codec->height = %d\n", dec_codec_ctx->height);
+    d_printf("\n");
+
+    d_printf("##### bit_rate = %d\n", fmt_ctx->bit_rate);
+    d_printf("##### start_time = %lld\n", (long long)fmt_ctx->start_time);
+    d_printf("##### start_time_realtime = %lld\n", (long long)fmt_ctx->start_time_realtime);
+    d_printf("##### duration = %lld\n", (long long)fmt_ctx->duration);
+    d_printf("\n");
+
+    d_printf("##### time_base.den = %d\n", fmt_ctx->streams[program]->time_base.den);
+    d_printf("##### time_base.num = %d\n", fmt_ctx->streams[program]->time_base.num);
+
+
+    d_printf("##### start_time = %lld\n", (long long)fmt_ctx->streams[program]->start_time);
+    d_printf("##### duration = %lld\n", (long long)fmt_ctx->streams[program]->duration);
+    d_printf("##### nb_frames = %lld\n", (long long)fmt_ctx->streams[program]->nb_frames);
+
+    d_printf("##### avg_frame_rate.den = %d\n", fmt_ctx->streams[program]->avg_frame_rate.den);
+    d_printf("##### avg_frame_rate.num = %d\n", fmt_ctx->streams[program]->avg_frame_rate.num);
+
+    d_printf("##### codec->qmin = %d\n", dec_codec_ctx->qmin);
+    d_printf("##### codec->qmax = %d\n", dec_codec_ctx->qmax);
+    d_printf("##### codec->time_base.den = %d\n", dec_codec_ctx->time_base.den);
+    d_printf("##### codec->time_base.num = %d\n", dec_codec_ctx->time_base.num);
+    d_printf("##### codec->gop_size = %d\n", dec_codec_ctx->gop_size);
+#endif
+
+
+    /*
+     *  AVFrame(YUV) for video decode
+     */
+    decode_frame = av_frame_alloc();
+    if (decode_frame == NULL) {
+	fprintf(stderr, "Error: Couldn't allocate AVFrame for decode\n");
+	exit (1);
     }
 
+    output = spec;
+    if (output_set_open(&output, dec_codec_ctx) < 0)
+	exit (1);
+
 
-    gop_duration = av_rescale(dec_codec_ctx->gop_size, fmt_ctx->streams[program]->avg_frame_rate.den*1000, fmt_ctx->streams[program]->avg_frame_rate.num);
+    gop_duration = media_gop_duration(&input);
     if (frame_time > 0 && frame_time * 1000 > fmt_ctx->duration) {
 	frame_time  = fmt_ctx->duration / 1000;
 	seek_last_frame = 1;
@@ -759,13 +1738,13 @@ main(int argc, char **argv)
 	    frame_time -= gop_duration;
 
 #if 1
-	res = avformat_seek_file(fmt_ctx, program, 
+	res = avformat_seek_file(fmt_ctx, program,
 				 fmt_ctx->streams[program]->start_time,
 				 fmt_ctx->streams[program]->start_time + frame_time*90,
 				 INT64_MAX,
 				 AVSEEK_FLAG_ANY);
 #else
-	res = av_seek_frame(fmt_ctx, program, 
+	res = av_seek_frame(fmt_ctx, program,
 				 fmt_ctx->streams[program]->start_time + frame_time*90,
 				 AVSEEK_FLAG_ANY);
 #endif
@@ -778,10 +1757,19 @@ main(int argc, char **argv)
 	    exit(1);
 	}
 
-#ifdef DEBUG	
+#ifdef DEBUG
 	d_printf("##### Seeking to frame location at %ld\n", fmt_ctx->streams[program]->start_time + frame_time*90);
 #endif
 
+	/*
+	 * Intra-only frames have no dependencies, decode the range on several threads
+	 */
+	if (num_frames > 1 && num_threads > 1 && media_is_intra_only(&input)) {
+	    if (decode_parallel(&input, &spec, stream_filename, num_frames, num_threads) > 0)
+		image_generation_done = 1;
+	    continue;
+	}
+
 	/*
 	 * Decode video and process picture frames
 	 */
@@ -801,74 +1789,19 @@ main(int argc, char **argv)
 	    d_printf("##### duration = %lld\n", (long long)packet.duration);
 #endif
 
-	    res = -1;
 	    avcodec_decode_video2(dec_codec_ctx, decode_frame, &frame_decode_done, &packet);
 	    if (frame_decode_done) {
-		switch (image_format) {
-		    case OUTPUT_IMAGE_YUV:
-			sprintf(image_filename, "%s%d.yuv", prefix, ++i);
-			if (annotation_flag > 0 && annotation_str)
-			    d_printf("Warning: Annotation on yuv output is not currently supported.\n");
-
-			res = generate_raw_image(dec_codec_ctx, decode_frame, image_filename);
-			break;
-
-		    case OUTPUT_IMAGE_PPM:
-			sprintf(image_filename, "%s%d.ppm", prefix, ++i);
-			if (annotation_flag > 0 && annotation_str)
-			    res = generate_image_with_annotation(dec_codec_ctx, decode_frame, image_format,
-								 image_filename, annotation_str);
-			else {
-			    /*
-			     * Convert the image from its native format to RGB
-			     */
-			    sws_scale(sws_ctx, (uint8_t const * const *)decode_frame->data,
-				      decode_frame->linesize, 0, dec_codec_ctx->height,
-				      output_frame->data, output_frame->linesize);
-
-			    res = generate_ppm_image(dec_codec_ctx, output_frame, image_filename);
-			}
-			break;
-
-		    case OUTPUT_IMAGE_PNG:
-			sprintf(image_filename, "%s%d.png", prefix, ++i);
-			if (annotation_flag > 0 && annotation_str)
-			    res = generate_image_with_annotation(dec_codec_ctx, decode_frame, image_format,
-								 image_filename, annotation_str);
-			else {
-			    /*
-			     * Convert the image from its native format to RGB
-			     */
-			    sws_scale(sws_ctx, (uint8_t const * const *)decode_frame->data,
-				      decode_frame->linesize, 0, dec_codec_ctx->height,
-				      output_frame->data, output_frame->linesize);
-			    res = generate_png_image(enc_codec_ctx, output_frame, image_filename);
-			}
-			break;
-
-		    case OUTPUT_IMAGE_JPG:
-			sprintf(image_filename, "%s%d.jpg", prefix, ++i);
-			if (annotation_flag > 0 && annotation_str)
-			    res = generate_image_with_annotation(dec_codec_ctx, decode_frame, image_format,
-								 image_filename, annotation_str);
-			else
-			    res = generate_jpg_image(enc_codec_ctx, decode_frame, image_filename);
-			break;
-
-		    default:
-			break;
-		}
+		int64_t position;
 
+		position = av_rescale_q(decode_frame->pkt_pts, fmt_ctx->streams[program]->time_base, AV_TIME_BASE_Q) - fmt_ctx->start_time;
+		res = output_set_write(&output, decode_frame, ++i, position);
 		if (res < 0) {
 		    av_free_packet(&packet);
 		    break;
 		}
 
 		if (res == 0) {
-		    int64_t position;
-
-		    position = av_rescale_q(decode_frame->pkt_pts, fmt_ctx->streams[program]->time_base, AV_TIME_BASE_Q) - fmt_ctx->start_time;
-		    printf("%s %dms\n", image_filename, (int)(position / 1000));
+		    output_set_report(&output, i, position);
 		    image_generation_done = 1;
 		}
 	    }
@@ -876,25 +1809,27 @@ main(int argc, char **argv)
 	    av_free_packet(&packet);
 	}
     }
-  
-  
+
+
     /*
      * Close the codecs
      */
-    if (dec_codec_ctx)
-	avcodec_close(dec_codec_ctx);
-    if (enc_codec_ctx)
-	avcodec_close(enc_codec_ctx);
-
-    av_frame_free(&output_frame);
+    if (spec.cache)
+	grab_cache_commit(spec.cache);
+
+    output_set_close(&output);
+    ReleaseAnnotationTracks(&spec.tracks);
+
+    if (spec.stats_ctx) {
+	stats_str = DumpAnnotationStats(spec.stats_ctx);
+	if (stats_str)
+	    fprintf(stderr, "Annotation stats: %s\n", stats_str);
+	free(stats_str);
+	ReleaseAnnotationContext(&spec.stats_ctx);
+    }
     av_frame_free(&decode_frame);
 
-    /*
-     * Stop avformat input
-     */
-    avformat_close_input(&fmt_ctx);
+    media_close(&input);
 
-    mio_destroy(mctx);
-  
     return 0;
 }
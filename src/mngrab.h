@@ -0,0 +1,70 @@
+/*
+ * This file is part of media-utis
+ *
+ * Media-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Media-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with media-utils; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _MNGRAB_H_
+#define _MNGRAB_H_
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#ifdef DEBUG
+#define d_printf(fmt, args...)    if (debug) fprintf(stderr, fmt, ## args)
+#else
+#define d_printf(fmt, args...)
+#endif
+
+
+/*
+ * IO context for medianode video record
+ */
+typedef struct _mio_context {
+    char *filename;
+    AVIOContext *context;
+    uint8_t *buffer;
+    int buffer_size;
+    int fd;
+} MIOContext;
+
+
+/*
+ * Demuxer and decoder of a medianode video record
+ */
+typedef struct _media_input {
+    MIOContext *mctx;
+    AVFormatContext *fmt_ctx;
+    AVCodecContext *dec_codec_ctx;
+    AVCodec *dec_codec;
+    int program;
+} MediaInput;
+
+
+extern int debug;
+
+int media_open(MediaInput *in, const char *filename, int dump);
+void media_close(MediaInput *in);
+int media_is_intra_only(MediaInput *in);
+unsigned long media_gop_duration(MediaInput *in);
+int64_t packet_timestamp(AVPacket *packet);
+
+int timelapse_generate(MediaInput *in, const char *filename, int64_t frame_time, int64_t interval,
+		       int num_frames, int frame_rate);
+
+int thumb_track_build(MediaInput *in, const char *filename, int width, int height);
+int thumb_track_read(const char *filename, int64_t frame_time, const char *image_filename);
+
+#endif //_MNGRAB_H_
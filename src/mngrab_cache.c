@@ -0,0 +1,412 @@
+/*
+ * This file is part of media-utis
+ *
+ * Media-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Media-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with media-utils; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include "mngrab_cache.h"
+
+#define CACHE_COPY_BUFFER_SIZE		64*1024
+
+#define FNV_OFFSET_BASIS		0xcbf29ce484222325ULL
+#define FNV_PRIME			0x100000001b3ULL
+
+
+/*
+ * Cache entry directory seen during eviction
+ */
+typedef struct _cache_entry {
+    char name[64];
+    time_t mtime;
+    int64_t size;
+} CacheEntry;
+
+
+static uint64_t
+cache_hash(uint64_t hash, const char *str)
+{
+    const unsigned char *p;
+
+    for (p = (const unsigned char *)str; *p; p++) {
+	hash ^= *p;
+	hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+
+static int
+cache_copy_file(const char *src, const char *dst)
+{
+    char buffer[CACHE_COPY_BUFFER_SIZE];
+    int in, out;
+    int n, res = 0;
+
+    in = open(src, O_RDONLY);
+    if (in < 0)
+	return -1;
+
+    out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+	close(in);
+	return -1;
+    }
+
+    while ((n = read(in, buffer, sizeof(buffer))) != 0) {
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    res = -1;
+	    break;
+	}
+
+	if (write(out, buffer, n) != n) {
+	    res = -1;
+	    break;
+	}
+    }
+
+    close(in);
+    close(out);
+
+    return res;
+}
+
+
+/*
+ * Remove an entry directory with its images and manifest
+ */
+static int64_t
+cache_remove_entry(const char *path)
+{
+    char file[GRAB_CACHE_PATH_LEN];
+    struct dirent *de;
+    struct stat sb;
+    int64_t size = 0;
+    DIR *dir;
+
+    dir = opendir(path);
+    if (!dir)
+	return 0;
+
+    while ((de = readdir(dir)) != NULL) {
+	if (de->d_name[0] == '.')
+	    continue;
+
+	snprintf(file, sizeof(file), "%s/%s", path, de->d_name);
+	if (stat(file, &sb) == 0)
+	    size += sb.st_size;
+	unlink(file);
+    }
+
+    closedir(dir);
+    rmdir(path);
+
+    return size;
+}
+
+
+static int64_t
+cache_entry_size(const char *path)
+{
+    char file[GRAB_CACHE_PATH_LEN];
+    struct dirent *de;
+    struct stat sb;
+    int64_t size = 0;
+    DIR *dir;
+
+    dir = opendir(path);
+    if (!dir)
+	return 0;
+
+    while ((de = readdir(dir)) != NULL) {
+	if (de->d_name[0] == '.')
+	    continue;
+
+	snprintf(file, sizeof(file), "%s/%s", path, de->d_name);
+	if (stat(file, &sb) == 0)
+	    size += sb.st_size;
+    }
+
+    closedir(dir);
+
+    return size;
+}
+
+
+static int
+cache_entry_compare(const void *a, const void *b)
+{
+    const CacheEntry *ea = (const CacheEntry *)a;
+    const CacheEntry *eb = (const CacheEntry *)b;
+
+    return (ea->mtime < eb->mtime) ? -1 : (ea->mtime > eb->mtime) ? 1 : 0;
+}
+
+
+/*
+ * Evict the least recently used entries until the cache fits its size bound.
+ * A cache hit touches the entry directory, so its mtime is the last use.
+ */
+static void
+grab_cache_evict(GrabCache *cache)
+{
+    char path[GRAB_CACHE_PATH_LEN];
+    CacheEntry *entries = NULL, *e;
+    struct dirent *de;
+    struct stat sb;
+    int64_t total = 0;
+    int i, count = 0, capacity = 0;
+    DIR *dir;
+
+    dir = opendir(cache->dir);
+    if (!dir)
+	return;
+
+    while ((de = readdir(dir)) != NULL) {
+	/*
+	 * Skip entries being filled by other processes
+	 */
+	if (de->d_name[0] == '.' || strchr(de->d_name, '.') || strlen(de->d_name) >= sizeof(e->name))
+	    continue;
+
+	snprintf(path, sizeof(path), "%s/%s", cache->dir, de->d_name);
+	if (stat(path, &sb) < 0 || !S_ISDIR(sb.st_mode))
+	    continue;
+
+	if (count == capacity) {
+	    capacity = capacity ? capacity * 2 : 64;
+	    e = (CacheEntry *)realloc(entries, capacity * sizeof(CacheEntry));
+	    if (!e)
+		break;
+	    entries = e;
+	}
+
+	e = &entries[count++];
+	strcpy(e->name, de->d_name);
+	e->mtime = sb.st_mtime;
+	e->size = cache_entry_size(path);
+	total += e->size;
+    }
+
+    closedir(dir);
+
+    if (total > cache->max_size) {
+	qsort(entries, count, sizeof(CacheEntry), cache_entry_compare);
+
+	for (i = 0; i < count && total > cache->max_size; i++) {
+	    snprintf(path, sizeof(path), "%s/%s", cache->dir, entries[i].name);
+	    if (!strcmp(path, cache->entry))
+		continue;
+
+	    cache_remove_entry(path);
+	    total -= entries[i].size;
+	}
+    }
+
+    free(entries);
+}
+
+
+/*
+ * Prepare the cache entry of a request. The key combines the identity of the
+ * record file (device, inode, size and modification time) with a description
+ * of the request, so a rewritten record never hits stale images.
+ */
+int
+grab_cache_open(GrabCache *cache, const char *dir, int64_t max_size, const char *filename, const char *request)
+{
+    char identity[256];
+    struct stat sb;
+    uint64_t h1, h2;
+
+    memset(cache, 0, sizeof(GrabCache));
+
+    if (!dir || !filename || !request)
+	return -1;
+
+    if (stat(filename, &sb) < 0)
+	return -1;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+	fprintf(stderr, "Warning: Failed to create cache directory %s\n", dir);
+	return -1;
+    }
+
+    snprintf(identity, sizeof(identity), "%llu:%llu:%lld:%lld\n",
+	     (unsigned long long)sb.st_dev, (unsigned long long)sb.st_ino,
+	     (long long)sb.st_size, (long long)sb.st_mtime);
+
+    /*
+     * Two FNV-1a hashes with different basis make a 128 bit key
+     */
+    h1 = cache_hash(cache_hash(FNV_OFFSET_BASIS, identity), request);
+    h2 = cache_hash(cache_hash(~FNV_OFFSET_BASIS, request), identity);
+
+    snprintf(cache->dir, sizeof(cache->dir), "%s", dir);
+    snprintf(cache->entry, sizeof(cache->entry), "%s/%016llx%016llx", dir,
+	     (unsigned long long)h1, (unsigned long long)h2);
+    cache->max_size = (max_size > 0) ? max_size : GRAB_CACHE_DEFAULT_SIZE;
+
+    return 0;
+}
+
+
+/*
+ * Restore the cached images of the request under the names given by the
+ * callback and report them like freshly generated images.
+ * Return the number of restored images, or -1 on cache miss.
+ */
+int
+grab_cache_restore(GrabCache *cache, GrabCacheName name, void *data)
+{
+    char path[GRAB_CACHE_PATH_LEN];
+    char image_filename[GRAB_CACHE_PATH_LEN];
+    struct stat sb;
+    long long position;
+    int output, index;
+    int pass, count = 0;
+    FILE *fh;
+
+    if (!cache->entry[0])
+	return -1;
+
+    snprintf(path, sizeof(path), "%s/manifest", cache->entry);
+    fh = fopen(path, "r");
+    if (!fh)
+	return -1;
+
+    /*
+     * First pass checks every image is still there, so a damaged entry is a
+     * plain miss rather than a partial report
+     */
+    for (pass = 0; pass < 2; pass++) {
+	rewind(fh);
+	count = 0;
+
+	while (fscanf(fh, "%d %d %lld", &output, &index, &position) == 3) {
+	    snprintf(path, sizeof(path), "%s/%d-%d", cache->entry, output, index);
+
+	    if (pass == 0) {
+		if (stat(path, &sb) < 0) {
+		    fclose(fh);
+		    return -1;
+		}
+	    } else {
+		name(data, output, index, image_filename);
+		if (cache_copy_file(path, image_filename) < 0) {
+		    fprintf(stderr, "Error: Failed to restore cached image %s\n", image_filename);
+		    fclose(fh);
+		    return -1;
+		}
+		printf("%s %dms\n", image_filename, (int)(position / 1000));
+	    }
+	    count++;
+	}
+
+	if (count == 0)
+	    break;
+    }
+
+    fclose(fh);
+
+    if (count == 0)
+	return -1;
+
+    /*
+     * Mark the entry as most recently used
+     */
+    utime(cache->entry, NULL);
+
+    return count;
+}
+
+
+/*
+ * Add a generated image to the entry being filled
+ */
+int
+grab_cache_add(GrabCache *cache, int output, int index, const char *image_filename, int64_t position)
+{
+    char path[GRAB_CACHE_PATH_LEN];
+
+    if (!cache->entry[0])
+	return -1;
+
+    if (!cache->manifest) {
+	snprintf(cache->temp, sizeof(cache->temp), "%s.%d.tmp", cache->entry, (int)getpid());
+	if (mkdir(cache->temp, 0755) < 0) {
+	    cache->entry[0] = '\0';
+	    return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s/manifest", cache->temp);
+	cache->manifest = fopen(path, "w");
+	if (!cache->manifest) {
+	    cache_remove_entry(cache->temp);
+	    cache->entry[0] = '\0';
+	    return -1;
+	}
+    }
+
+    snprintf(path, sizeof(path), "%s/%d-%d", cache->temp, output, index);
+    if (cache_copy_file(image_filename, path) < 0)
+	return -1;
+
+    fprintf(cache->manifest, "%d %d %lld\n", output, index, (long long)position);
+    cache->count++;
+
+    return 0;
+}
+
+
+/*
+ * Publish the filled entry and evict old entries beyond the size bound
+ */
+int
+grab_cache_commit(GrabCache *cache)
+{
+    int res = -1;
+
+    if (!cache->manifest)
+	return -1;
+
+    fclose(cache->manifest);
+    cache->manifest = NULL;
+
+    /*
+     * The rename is atomic, a concurrent grab of the same request keeps
+     * the entry published first
+     */
+    if (cache->count > 0 && rename(cache->temp, cache->entry) == 0)
+	res = 0;
+    else
+	cache_remove_entry(cache->temp);
+
+    grab_cache_evict(cache);
+
+    return res;
+}
@@ -0,0 +1,53 @@
+/*
+ * This file is part of media-utis
+ *
+ * Media-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Media-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with media-utils; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _MNGRAB_CACHE_H_
+#define _MNGRAB_CACHE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define GRAB_CACHE_DEFAULT_SIZE		(256LL*1024*1024)	/* 256MB */
+#define GRAB_CACHE_PATH_LEN		1024
+
+
+/*
+ * On-disk cache of generated images, keyed by record identity and request
+ */
+typedef struct _grab_cache {
+    char dir[GRAB_CACHE_PATH_LEN];	/* Cache directory */
+    char entry[GRAB_CACHE_PATH_LEN];	/* Entry directory of the request */
+    char temp[GRAB_CACHE_PATH_LEN];	/* Entry directory being filled */
+    int64_t max_size;			/* Size bound in bytes for LRU eviction */
+    FILE *manifest;			/* Manifest of the entry being filled */
+    int count;				/* Number of images stored in the entry */
+} GrabCache;
+
+
+/*
+ * Name of the image file generated for an output at a frame index
+ */
+typedef void (*GrabCacheName)(void *data, int output, int index, char *image_filename);
+
+
+int grab_cache_open(GrabCache *cache, const char *dir, int64_t max_size, const char *filename, const char *request);
+int grab_cache_restore(GrabCache *cache, GrabCacheName name, void *data);
+int grab_cache_add(GrabCache *cache, int output, int index, const char *image_filename, int64_t position);
+int grab_cache_commit(GrabCache *cache);
+
+#endif //_MNGRAB_CACHE_H_
@@ -0,0 +1,411 @@
+/*
+ * This file is part of media-utis
+ *
+ * Media-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Media-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with media-utils; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/mathematics.h>
+#include <libswscale/swscale.h>
+#include <libavutil/avutil.h>
+#include <libavutil/imgutils.h>
+#include "mngrab.h"
+
+
+/*
+ * Thumbnail track file layout (host byte order):
+ *
+ *   ThumbTrackHeader
+ *   JPEG images, back to back
+ *   Zero padding up to THUMB_TRACK_ALIGN
+ *   ThumbTrackEntry[count], sorted by position
+ */
+#define THUMB_TRACK_MAGIC	"MNTT"
+#define THUMB_TRACK_VERSION	2
+#define THUMB_TRACK_ALIGN	8
+
+typedef struct _thumb_track_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t width;		/* Thumbnail dimension */
+    uint32_t height;
+    uint32_t count;		/* Number of thumbnails */
+    uint32_t reserved;
+    uint64_t index_offset;	/* File offset of the index */
+} ThumbTrackHeader;
+
+typedef struct _thumb_track_entry {
+    int64_t position;		/* Play time in millisecond */
+    uint64_t offset;		/* File offset of the JPEG image */
+    uint32_t size;		/* Size of the JPEG image */
+    uint32_t reserved;
+} ThumbTrackEntry;
+
+
+static int
+entry_compare(const void *a, const void *b)
+{
+    const ThumbTrackEntry *ea = (const ThumbTrackEntry *)a, *eb = (const ThumbTrackEntry *)b;
+
+    return (ea->position > eb->position) - (ea->position < eb->position);
+}
+
+
+/*
+ * Pick the largest lowres decoding (1/2, 1/4, 1/8) still covering the thumbnail
+ */
+static int
+thumb_track_lowres(MediaInput *in, int width, int height)
+{
+    AVCodecContext *dec_codec_ctx = in->dec_codec_ctx;
+    int lowres;
+
+    for (lowres = in->dec_codec->max_lowres; lowres > 0; lowres--) {
+	if ((dec_codec_ctx->width >> lowres) >= width && (dec_codec_ctx->height >> lowres) >= height)
+	    break;
+    }
+
+    if (lowres > 0) {
+	avcodec_close(dec_codec_ctx);
+	dec_codec_ctx->lowres = lowres;
+	if (avcodec_open2(dec_codec_ctx, in->dec_codec, NULL) < 0) {
+	    fprintf(stderr, "Error: Couldn't open codec for decode\n");
+	    return -1;
+	}
+    }
+
+    return lowres;
+}
+
+
+static AVCodecContext *
+thumb_track_encoder(int width, int height)
+{
+    AVCodecContext *enc_codec_ctx;
+    AVCodec *enc_codec;
+
+    enc_codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    if (enc_codec == NULL) {
+	fprintf(stderr, "Error: Unsupported encoder codec\n");
+	return NULL;
+    }
+
+    enc_codec_ctx = avcodec_alloc_context3(enc_codec);
+    if (enc_codec_ctx == NULL) {
+	fprintf(stderr, "Error: Failed to allocate encoder codec context\n");
+	return NULL;
+    }
+
+    enc_codec_ctx->pix_fmt	= PIX_FMT_YUVJ420P;
+    enc_codec_ctx->width	= width;
+    enc_codec_ctx->height	= height;
+    enc_codec_ctx->mb_lmin	= enc_codec_ctx->qmin * FF_QP2LAMBDA;
+    enc_codec_ctx->lmin		= enc_codec_ctx->qmin * FF_QP2LAMBDA;
+    enc_codec_ctx->mb_lmax	= enc_codec_ctx->qmax * FF_QP2LAMBDA;
+    enc_codec_ctx->lmax		= enc_codec_ctx->qmax * FF_QP2LAMBDA;
+    enc_codec_ctx->flags	= CODEC_FLAG_QSCALE;
+    enc_codec_ctx->global_quality = enc_codec_ctx->qmin * FF_QP2LAMBDA;
+    enc_codec_ctx->time_base	= (AVRational){1,25};
+    enc_codec_ctx->thread_count	= 0;	/* one slice thread per core */
+
+    if (avcodec_open2(enc_codec_ctx, enc_codec, NULL) < 0) {
+	fprintf(stderr, "Error: Failed to open codec for encode\n");
+	av_free(enc_codec_ctx);
+	return NULL;
+    }
+
+    return enc_codec_ctx;
+}
+
+
+/*
+ * Walk the record once and pack a downscaled JPEG of every keyframe into a
+ * thumbnail track file. Only keyframe packets reach the decoder, and MJPEG
+ * records are decoded at reduced resolution when the thumbnail allows.
+ * A zero width or height keeps the aspect ratio.
+ */
+int
+thumb_track_build(MediaInput *in, const char *filename, int width, int height)
+{
+    AVCodecContext *dec_codec_ctx = in->dec_codec_ctx;
+    AVCodecContext *enc_codec_ctx = NULL;
+    struct SwsContext *sws_ctx = NULL;
+    AVFrame *decode_frame = NULL, *thumb_frame = NULL;
+    AVStream *st = in->fmt_ctx->streams[in->program];
+    ThumbTrackHeader header;
+    ThumbTrackEntry *index = NULL, *entry;
+    AVPacket packet, image;
+    char temp[1024];
+    int count = 0, capacity = 0;
+    int frame_decode_done, image_ready;
+    uint64_t offset;
+    FILE *fh = NULL;
+    int lowres;
+    int res = -1;
+
+    if (width <= 0 && height <= 0)
+	width = 160;
+    if (height <= 0)
+	height = (int)av_rescale(width, dec_codec_ctx->height, dec_codec_ctx->width) & ~1;
+    else if (width <= 0)
+	width = (int)av_rescale(height, dec_codec_ctx->width, dec_codec_ctx->height) & ~1;
+
+    lowres = thumb_track_lowres(in, width, height);
+    if (lowres < 0)
+	return -1;
+
+    d_printf("##### Thumbnail track %dx%d, lowres %d\n", width, height, lowres);
+
+    dec_codec_ctx->skip_frame = AVDISCARD_NONKEY;
+
+    decode_frame = av_frame_alloc();
+    thumb_frame = av_frame_alloc();
+    if (!decode_frame || !thumb_frame) {
+	fprintf(stderr, "Error: Couldn't allocate AVFrame for thumbnail\n");
+	goto done;
+    }
+
+    if (av_image_alloc(thumb_frame->data, thumb_frame->linesize, width, height, PIX_FMT_YUVJ420P, 32) < 0) {
+	fprintf(stderr, "Error: Couldn't allocate thumbnail frame\n");
+	goto done;
+    }
+    thumb_frame->format = PIX_FMT_YUVJ420P;
+    thumb_frame->width = width;
+    thumb_frame->height = height;
+
+    enc_codec_ctx = thumb_track_encoder(width, height);
+    if (!enc_codec_ctx)
+	goto done;
+
+    snprintf(temp, sizeof(temp), "%s.%d.tmp", filename, (int)getpid());
+    fh = fopen(temp, "wb");
+    if (!fh) {
+	fprintf(stderr, "Error: Failed to create thumbnail track %s\n", filename);
+	goto done;
+    }
+
+    memset(&header, 0, sizeof(ThumbTrackHeader));
+    fwrite(&header, sizeof(ThumbTrackHeader), 1, fh);
+    offset = sizeof(ThumbTrackHeader);
+
+    avformat_seek_file(in->fmt_ctx, in->program, INT64_MIN, st->start_time, st->start_time, AVSEEK_FLAG_BACKWARD);
+
+    while (av_read_frame(in->fmt_ctx, &packet) >= 0) {
+	if (packet.stream_index != in->program || !(packet.flags & AV_PKT_FLAG_KEY)) {
+	    av_free_packet(&packet);
+	    continue;
+	}
+
+	avcodec_decode_video2(dec_codec_ctx, decode_frame, &frame_decode_done, &packet);
+	av_free_packet(&packet);
+	if (!frame_decode_done)
+	    continue;
+
+	/*
+	 * The decoded size depends on lowres, the scaler follows it
+	 */
+	sws_ctx = sws_getCachedContext(sws_ctx, decode_frame->width, decode_frame->height, decode_frame->format,
+				       width, height, PIX_FMT_YUVJ420P, SWS_BILINEAR, NULL, NULL, NULL);
+	if (!sws_ctx) {
+	    fprintf(stderr, "Error: Couldn't initialize scaler\n");
+	    goto done;
+	}
+
+	sws_scale(sws_ctx, (uint8_t const * const *)decode_frame->data, decode_frame->linesize, 0,
+		  decode_frame->height, thumb_frame->data, thumb_frame->linesize);
+
+	av_init_packet(&image);
+	image.size = 0;
+	image.data = NULL;
+	image_ready = 0;
+
+	if (avcodec_encode_video2(enc_codec_ctx, &image, thumb_frame, &image_ready) < 0 || !image_ready)
+	    continue;
+
+	if (count == capacity) {
+	    capacity = capacity ? capacity * 2 : 256;
+	    entry = (ThumbTrackEntry *)realloc(index, capacity * sizeof(ThumbTrackEntry));
+	    if (!entry) {
+		fprintf(stderr, "Error: Out of memory\n");
+		av_free_packet(&image);
+		goto done;
+	    }
+	    index = entry;
+	}
+
+	entry = &index[count++];
+	memset(entry, 0, sizeof(ThumbTrackEntry));
+	entry->position = (av_rescale_q(decode_frame->pkt_pts, st->time_base, AV_TIME_BASE_Q) - in->fmt_ctx->start_time) / 1000;
+	entry->offset = offset;
+	entry->size = image.size;
+
+	fwrite(image.data, image.size, 1, fh);
+	offset += image.size;
+	av_free_packet(&image);
+    }
+
+    /*
+     * Append the index, aligned for the mapping and sorted for the binary
+     * search of the reader, and complete the header
+     */
+    while (offset % THUMB_TRACK_ALIGN) {
+	fputc(0, fh);
+	offset++;
+    }
+
+    if (count > 0)
+	qsort(index, count, sizeof(ThumbTrackEntry), entry_compare);
+    fwrite(index, sizeof(ThumbTrackEntry), count, fh);
+
+    memcpy(header.magic, THUMB_TRACK_MAGIC, 4);
+    header.version = THUMB_TRACK_VERSION;
+    header.width = width;
+    header.height = height;
+    header.count = count;
+    header.index_offset = offset;
+
+    rewind(fh);
+    fwrite(&header, sizeof(ThumbTrackHeader), 1, fh);
+
+    if (ferror(fh)) {
+	fprintf(stderr, "Error: Failed to write thumbnail track %s\n", filename);
+	goto done;
+    }
+
+    fclose(fh);
+    fh = NULL;
+
+    if (rename(temp, filename) < 0) {
+	fprintf(stderr, "Error: Failed to create thumbnail track %s\n", filename);
+	goto done;
+    }
+
+    printf("%s %d thumbnails\n", filename, count);
+    res = count;
+
+done:
+    if (fh) {
+	fclose(fh);
+	unlink(temp);
+    }
+
+    free(index);
+
+    if (enc_codec_ctx) {
+	avcodec_close(enc_codec_ctx);
+	av_free(enc_codec_ctx);
+    }
+
+    if (sws_ctx)
+	sws_freeContext(sws_ctx);
+
+    if (thumb_frame)
+	av_freep(&thumb_frame->data[0]);
+    av_frame_free(&thumb_frame);
+    av_frame_free(&decode_frame);
+
+    return res;
+}
+
+
+/*
+ * Write the thumbnail of the last keyframe at or before frame_time (the first
+ * one if none) straight from the mapped track, without any decoding
+ */
+int
+thumb_track_read(const char *filename, int64_t frame_time, const char *image_filename)
+{
+    ThumbTrackHeader *header;
+    ThumbTrackEntry *index;
+    struct stat sb;
+    uint8_t *base;
+    int lo, hi, mid;
+    int fd, res = -1;
+    FILE *fh;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+	fprintf(stderr, "Error: Failed to open thumbnail track %s\n", filename);
+	return -1;
+    }
+
+    if (fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof(ThumbTrackHeader)) {
+	fprintf(stderr, "Error: Invalid thumbnail track %s\n", filename);
+	close(fd);
+	return -1;
+    }
+
+    base = (uint8_t *)mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+	fprintf(stderr, "Error: Failed to map thumbnail track %s\n", filename);
+	return -1;
+    }
+
+    header = (ThumbTrackHeader *)base;
+    index = (ThumbTrackEntry *)(base + header->index_offset);
+
+    if (memcmp(header->magic, THUMB_TRACK_MAGIC, 4) || header->version != THUMB_TRACK_VERSION ||
+	header->count == 0 || header->index_offset % THUMB_TRACK_ALIGN ||
+	header->index_offset > (uint64_t)sb.st_size ||
+	header->count > (sb.st_size - header->index_offset) / sizeof(ThumbTrackEntry)) {
+	fprintf(stderr, "Error: Invalid thumbnail track %s\n", filename);
+	goto done;
+    }
+
+    /*
+     * Last entry with position <= frame_time
+     */
+    lo = 0;
+    hi = header->count - 1;
+    while (lo < hi) {
+	mid = (lo + hi + 1) / 2;
+	if (index[mid].position <= frame_time)
+	    lo = mid;
+	else
+	    hi = mid - 1;
+    }
+
+    if (index[lo].offset + index[lo].size > header->index_offset) {
+	fprintf(stderr, "Error: Invalid thumbnail track %s\n", filename);
+	goto done;
+    }
+
+    fh = fopen(image_filename, "wb");
+    if (!fh) {
+	fprintf(stderr, "Error: Failed to create JPEG image file %s\n", image_filename);
+	goto done;
+    }
+
+    fwrite(base + index[lo].offset, index[lo].size, 1, fh);
+    fclose(fh);
+
+    printf("%s %dms\n", image_filename, (int)index[lo].position);
+    res = 0;
+
+done:
+    munmap(base, sb.st_size);
+
+    return res;
+}
@@ -0,0 +1,386 @@
+/*
+ * This file is part of media-utis
+ *
+ * Media-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Media-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with media-utils; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/mathematics.h>
+#include <libswscale/swscale.h>
+#include <libavutil/avutil.h>
+#include <libavutil/imgutils.h>
+#include "mngrab.h"
+
+#define TIMELAPSE_GOP_SIZE	12
+#define GOP_PROBE_KEYFRAMES	4	/* Keyframes read to measure the GOP */
+#define GOP_PROBE_PACKETS	2000	/* Packets read at most to find them */
+
+
+/*
+ * Video encoder and muxer of the time-lapse output
+ */
+typedef struct _timelapse_output {
+    AVFormatContext *fmt_ctx;
+    AVStream *stream;
+    AVCodecContext *enc_codec_ctx;
+    struct SwsContext *sws_ctx;
+    AVFrame *frame;
+    int64_t num_frames;
+} TimelapseOutput;
+
+
+static int
+timelapse_open(TimelapseOutput *out, const char *filename, AVCodecContext *dec_codec_ctx, int frame_rate)
+{
+    AVCodec *enc_codec = NULL;
+    AVCodecContext *enc;
+    int res;
+
+    memset(out, 0, sizeof(TimelapseOutput));
+
+    /*
+     * Container is guessed from the file name, e.g. mp4, mkv or avi
+     */
+    avformat_alloc_output_context2(&out->fmt_ctx, NULL, NULL, filename);
+    if (!out->fmt_ctx) {
+	fprintf(stderr, "Error: Unknown container format for %s\n", filename);
+	return -1;
+    }
+
+    if (out->fmt_ctx->oformat->video_codec != AV_CODEC_ID_NONE)
+	enc_codec = avcodec_find_encoder(out->fmt_ctx->oformat->video_codec);
+    if (!enc_codec)
+	enc_codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+    if (!enc_codec) {
+	fprintf(stderr, "Error: Unsupported encoder codec\n");
+	return -1;
+    }
+
+    out->stream = avformat_new_stream(out->fmt_ctx, enc_codec);
+    if (!out->stream) {
+	fprintf(stderr, "Error: Failed to allocate output stream\n");
+	return -1;
+    }
+
+    enc = out->enc_codec_ctx = out->stream->codec;
+    enc->codec_id	= enc_codec->id;
+    enc->width		= dec_codec_ctx->width;
+    enc->height		= dec_codec_ctx->height;
+    enc->pix_fmt	= (enc_codec->pix_fmts) ? enc_codec->pix_fmts[0] : PIX_FMT_YUV420P;
+    enc->time_base	= (AVRational){1, frame_rate};
+    enc->gop_size	= TIMELAPSE_GOP_SIZE;
+    enc->bit_rate	= (dec_codec_ctx->bit_rate > 0) ? dec_codec_ctx->bit_rate : 4*1000*1000;
+    out->stream->time_base = enc->time_base;
+
+    if (out->fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+	enc->flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+    if (avcodec_open2(enc, enc_codec, NULL) < 0) {
+	fprintf(stderr, "Error: Failed to open codec for encode\n");
+	return -1;
+    }
+
+    /*
+     * Frame in the encoder pixel format
+     */
+    out->frame = av_frame_alloc();
+    if (!out->frame) {
+	fprintf(stderr, "Error: Couldn't allocate AVFrame for output\n");
+	return -1;
+    }
+
+    res = av_image_alloc(out->frame->data, out->frame->linesize, enc->width, enc->height, enc->pix_fmt, 32);
+    if (res < 0) {
+	fprintf(stderr, "Error: Couldn't allocate output frame\n");
+	return -1;
+    }
+    out->frame->format = enc->pix_fmt;
+    out->frame->width = enc->width;
+    out->frame->height = enc->height;
+
+    out->sws_ctx = sws_getContext(dec_codec_ctx->width, dec_codec_ctx->height, dec_codec_ctx->pix_fmt,
+				  enc->width, enc->height, enc->pix_fmt, SWS_BILINEAR, NULL, NULL, NULL);
+    if (!out->sws_ctx) {
+	fprintf(stderr, "Error: Couldn't initialize scaler\n");
+	return -1;
+    }
+
+    if (!(out->fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+	if (avio_open(&out->fmt_ctx->pb, filename, AVIO_FLAG_WRITE) < 0) {
+	    fprintf(stderr, "Error: Failed to create video file %s\n", filename);
+	    return -1;
+	}
+    }
+
+    if (avformat_write_header(out->fmt_ctx, NULL) < 0) {
+	fprintf(stderr, "Error: Failed to write video header\n");
+	return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Encode a frame, NULL drains the encoder
+ */
+static int
+timelapse_encode(TimelapseOutput *out, AVFrame *frame)
+{
+    AVPacket packet;
+    int res, packet_ready;
+
+    av_init_packet(&packet);
+    packet.size = 0;
+    packet.data = NULL;
+    packet_ready = 0;
+
+    res = avcodec_encode_video2(out->enc_codec_ctx, &packet, frame, &packet_ready);
+    if (res < 0)
+	return res;
+
+    if (!packet_ready)
+	return 0;
+
+    av_packet_rescale_ts(&packet, out->enc_codec_ctx->time_base, out->stream->time_base);
+    packet.stream_index = out->stream->index;
+
+    res = av_interleaved_write_frame(out->fmt_ctx, &packet);
+    av_free_packet(&packet);
+
+    return (res < 0) ? res : 1;
+}
+
+
+static int
+timelapse_add(TimelapseOutput *out, AVCodecContext *dec_codec_ctx, AVFrame *decode_frame)
+{
+    sws_scale(out->sws_ctx, (uint8_t const * const *)decode_frame->data,
+	      decode_frame->linesize, 0, dec_codec_ctx->height,
+	      out->frame->data, out->frame->linesize);
+
+    out->frame->pts = out->num_frames++;
+
+    return timelapse_encode(out, out->frame);
+}
+
+
+static void
+timelapse_close(TimelapseOutput *out)
+{
+    if (out->enc_codec_ctx && out->fmt_ctx->pb) {
+	/*
+	 * Drain delayed frames and finish the container
+	 */
+	while (timelapse_encode(out, NULL) > 0)
+	    ;
+	av_write_trailer(out->fmt_ctx);
+    }
+
+    if (out->enc_codec_ctx)
+	avcodec_close(out->enc_codec_ctx);
+
+    if (out->sws_ctx)
+	sws_freeContext(out->sws_ctx);
+
+    if (out->frame) {
+	av_freep(&out->frame->data[0]);
+	av_frame_free(&out->frame);
+    }
+
+    if (out->fmt_ctx) {
+	if (out->fmt_ctx->pb && !(out->fmt_ctx->oformat->flags & AVFMT_NOFILE))
+	    avio_closep(&out->fmt_ctx->pb);
+	avformat_free_context(out->fmt_ctx);
+    }
+
+    memset(out, 0, sizeof(TimelapseOutput));
+}
+
+
+/*
+ * Decode the first frame at or after the current read position. With
+ * keyframe only decoding the non-key packets are not even sent to the decoder.
+ */
+static int
+timelapse_decode_next(MediaInput *in, AVFrame *decode_frame, int keyframe_only)
+{
+    AVPacket packet;
+    int frame_decode_done = 0;
+
+    while (!frame_decode_done) {
+	if (av_read_frame(in->fmt_ctx, &packet) < 0)
+	    return -1;
+
+	if (packet.stream_index == in->program && (!keyframe_only || (packet.flags & AV_PKT_FLAG_KEY)))
+	    avcodec_decode_video2(in->dec_codec_ctx, decode_frame, &frame_decode_done, &packet);
+
+	av_free_packet(&packet);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Longest spacing in milliseconds between the first keyframe packets of the
+ * record, or -1 if fewer than two were found. The codec GOP size is often
+ * unset by demuxers so the keyframes are measured instead. The read
+ * position is left past the probe, the caller seeks afterwards.
+ */
+static int64_t
+timelapse_gop_duration(MediaInput *in)
+{
+    AVStream *st = in->fmt_ctx->streams[in->program];
+    AVPacket packet;
+    int64_t last = AV_NOPTS_VALUE, ts, gop = -1;
+    int keyframes = 0, packets = 0;
+
+    avformat_seek_file(in->fmt_ctx, in->program, INT64_MIN, st->start_time, st->start_time,
+		       AVSEEK_FLAG_BACKWARD);
+
+    while (keyframes < GOP_PROBE_KEYFRAMES && packets < GOP_PROBE_PACKETS &&
+	   av_read_frame(in->fmt_ctx, &packet) >= 0) {
+	if (packet.stream_index == in->program) {
+	    packets++;
+	    ts = packet_timestamp(&packet);
+	    if ((packet.flags & AV_PKT_FLAG_KEY) && ts != AV_NOPTS_VALUE) {
+		if (last != AV_NOPTS_VALUE && ts - last > gop)
+		    gop = ts - last;
+		last = ts;
+		keyframes++;
+	    }
+	}
+	av_free_packet(&packet);
+    }
+
+    if (gop < 0)
+	return -1;
+
+    return av_rescale_q(gop, st->time_base, (AVRational){1, 1000});
+}
+
+
+/*
+ * Sample one frame per interval from frame_time on and encode the samples
+ * into a video file, num_frames <= 0 samples up to the end of the record.
+ *
+ * When the interval is longer than a GOP only the keyframe closest before
+ * each sample time is decoded, a keyframe already taken is not sampled
+ * again. Otherwise the record is decoded sequentially and the first frame
+ * at or after each sample time is taken.
+ */
+int
+timelapse_generate(MediaInput *in, const char *filename, int64_t frame_time, int64_t interval,
+		   int num_frames, int frame_rate)
+{
+    TimelapseOutput out;
+    AVFormatContext *fmt_ctx = in->fmt_ctx;
+    AVStream *st = fmt_ctx->streams[in->program];
+    AVFrame *decode_frame;
+    int64_t target, position, duration, gop, pts, last_pts = AV_NOPTS_VALUE;
+    int keyframe_only;
+    int count = 0;
+
+    if (interval <= 0 || frame_rate <= 0) {
+	fprintf(stderr, "Error: Invalid time-lapse interval or frame rate\n");
+	return -1;
+    }
+
+    decode_frame = av_frame_alloc();
+    if (decode_frame == NULL) {
+	fprintf(stderr, "Error: Couldn't allocate AVFrame for decode\n");
+	return -1;
+    }
+
+    if (timelapse_open(&out, filename, in->dec_codec_ctx, frame_rate) < 0) {
+	timelapse_close(&out);
+	av_frame_free(&decode_frame);
+	return -1;
+    }
+
+    gop = timelapse_gop_duration(in);
+    keyframe_only = (gop > 0 && interval > gop);
+    if (keyframe_only)
+	in->dec_codec_ctx->skip_frame = AVDISCARD_NONKEY;
+
+    d_printf("##### Time-lapse every %lldms, %s decode\n", (long long)interval,
+	     keyframe_only ? "keyframe only" : "sequential");
+
+    duration = fmt_ctx->duration / 1000;
+    target = frame_time;
+
+    if (!keyframe_only)
+	avformat_seek_file(fmt_ctx, in->program, st->start_time,
+			   st->start_time + av_rescale_q(target, (AVRational){1, 1000}, st->time_base),
+			   INT64_MAX, AVSEEK_FLAG_BACKWARD);
+
+    while ((num_frames <= 0 || count < num_frames) && (duration <= 0 || target <= duration)) {
+	if (keyframe_only) {
+	    /*
+	     * Jump to the keyframe before the sample time
+	     */
+	    if (avformat_seek_file(fmt_ctx, in->program, INT64_MIN,
+				   st->start_time + av_rescale_q(target, (AVRational){1, 1000}, st->time_base),
+				   st->start_time + av_rescale_q(target, (AVRational){1, 1000}, st->time_base),
+				   AVSEEK_FLAG_BACKWARD) < 0)
+		break;
+	    avcodec_flush_buffers(in->dec_codec_ctx);
+	}
+
+	if (timelapse_decode_next(in, decode_frame, keyframe_only) < 0)
+	    break;
+
+	pts = (decode_frame->pkt_pts != AV_NOPTS_VALUE) ? decode_frame->pkt_pts : decode_frame->pkt_dts;
+	position = av_rescale_q(pts - st->start_time, st->time_base, (AVRational){1, 1000});
+	if (!keyframe_only && position < target)
+	    continue;
+
+	if (keyframe_only && last_pts != AV_NOPTS_VALUE && pts <= last_pts) {
+	    /*
+	     * The seek fell back on a keyframe already sampled, a GOP longer
+	     * than measured or the end of the record
+	     */
+	    if (target - position > 2 * gop)
+		break;
+	    target += interval;
+	    continue;
+	}
+	last_pts = pts;
+
+	if (timelapse_add(&out, in->dec_codec_ctx, decode_frame) < 0) {
+	    fprintf(stderr, "Error: Failed to encode time-lapse frame\n");
+	    break;
+	}
+
+	d_printf("##### Sample %d at %lldms\n", count, (long long)position);
+
+	count++;
+	target += interval;
+	while (!keyframe_only && target <= position)
+	    target += interval;
+    }
+
+    timelapse_close(&out);
+    av_frame_free(&decode_frame);
+
+    printf("%s %d frames\n", filename, count);
+
+    return count;
+}